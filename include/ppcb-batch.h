@@ -0,0 +1,127 @@
+#ifndef PPCB_BATCH_H
+#define PPCB_BATCH_H
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "ppcb-common.h"
+#include "ppcb-timestamp.h"
+#include "ppcb-uring.h"
+
+// Datagrams handed to the kernel in one system call.
+#define BATCH_SIZE 64
+// Largest UDP payload, which bounds a whole GSO train.
+#define MAX_UDP_PAYLOAD 65507
+// Room for one received datagram, or for one GRO train of them.
+#define RECEIVE_BUFFER_SIZE (1 << 16)
+
+/// BATCHED SENDING ///
+
+// DATA packets gathered for one sendmmsg, or for one sendmsg with UDP_SEGMENT (GSO) when they
+// are equally sized and small enough to form a train. Each packet takes three vectors: the
+// header, its timestamp (empty without one) and the payload.
+typedef struct {
+    int                 socket_fd;
+    struct sockaddr_in  address;
+    PPCB_Protocol       protocol;
+    bool                gso;
+    bool                timestamps;     // DATA carries PPCB_DATA_timestamp, set by the sender.
+    bool                mtu_exceeded;   // DATA went out fragmented, see send_batch_fit.
+    size_t              count;
+    PPCB_DATA_packet    headers[BATCH_SIZE];
+    PPCB_DATA_timestamp stamps[BATCH_SIZE];
+    struct iovec        vectors[3 * BATCH_SIZE];
+    struct mmsghdr      messages[BATCH_SIZE];
+} PPCB_send_batch;
+
+void send_batch_init(
+        PPCB_send_batch     *batch,
+        int                 socket_fd,
+        struct sockaddr_in  address,
+        PPCB_Protocol       protocol
+);
+
+// Queues DATA with the payload taken straight from the byte sequence. A full batch is sent.
+void send_batch_add_DATA(
+        PPCB_send_batch     *batch,
+        uint64_t            session_id,
+        uint64_t            packet_number,
+        const char          *payload,
+        uint32_t            payload_length
+);
+
+// Sends everything queued. Failures are fatal, as for other DATA sent by the client, except
+// for EMSGSIZE after a drop of the path MTU: such DATA is sent again with fragmentation allowed.
+// With timestamps, DATA is stamped just before the send, and the kernel's transmit stamps are
+// collected right after it.
+void send_batch_flush(
+        PPCB_send_batch     *batch
+);
+
+// Once DATA didn't fit the path MTU, shrinks payload_size to what fits it now, for the DATA
+// which is yet to be cut. Returns payload_size otherwise.
+uint32_t send_batch_fit(
+        PPCB_send_batch     *batch,
+        uint32_t            payload_size
+);
+
+/// BATCHED RECEIVING ///
+
+// Datagrams taken from the socket by one recvmmsg, handed out one by one. With UDP_GRO
+// a datagram may hold a train of segments, which are handed out separately. With an io_uring
+// the datagrams come from its provided buffers instead, and payloads may be written from there.
+typedef struct {
+    int                 socket_fd;
+    bool                gro;
+    PPCB_uring          *ring;              // NULL - recvmmsg.
+    uint16_t            buffer_ids[BATCH_SIZE];
+    int                 count;              // Datagrams in the batch.
+    int                 current;            // Datagram being handed out.
+    size_t              offset;             // Start of its next segment.
+    size_t              segment_sizes[BATCH_SIZE];
+    char                *buffers;
+    struct sockaddr_in  addresses[BATCH_SIZE];
+    struct iovec        vectors[BATCH_SIZE];
+    bool                timestamps;         // Datagrams are stamped by the kernel.
+    uint64_t            arrived_at;         // Stamp of the datagram handed out last.
+    char                controls[BATCH_SIZE][CMSG_SPACE(sizeof(int)) + TIMESTAMP_CONTROL_SIZE];
+    struct mmsghdr      messages[BATCH_SIZE];
+} PPCB_receive_batch;
+
+// Sets the socket options once, timeouts are kept by the batch itself. With use_uring the
+// datagrams are received through io_uring, if the kernel allows it. With timestamp_used, the
+// datagrams received by recvmmsg are stamped by the kernel.
+void receive_batch_init(
+        PPCB_receive_batch  *batch,
+        int                 socket_fd,
+        bool                use_uring
+);
+
+// Hands out the next datagram, receiving a new batch if all were handed out. Waits at most
+// timeout microseconds (0 - no limit) and returns 0 on timeout, like receive_packet_udp.
+// The datagram stays valid until the batch is received again.
+ssize_t receive_batch_next(
+        PPCB_receive_batch  *batch,
+        struct sockaddr_in  *receive_address,
+        char                **datagram,
+        uint64_t            timeout
+);
+
+// The kernel's arrival stamp of the datagram handed out last, 0 if it has none.
+uint64_t receive_batch_arrival(
+        PPCB_receive_batch  *batch
+);
+
+// Whether the next datagram is already in the batch, so the ones handed out are still valid.
+bool receive_batch_pending(
+        PPCB_receive_batch  *batch
+);
+
+void receive_batch_destroy(
+        PPCB_receive_batch  *batch
+);
+
+#endif // PPCB_BATCH_H
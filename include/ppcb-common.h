@@ -4,12 +4,18 @@
 #include <inttypes.h>
 #include <stddef.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
 #include <stdbool.h>
 
 #define MAX_PACKET_SIZE 64000
 #define PACKET_SIZE 64000
+// Largest payload a TCP session may negotiate; a datagram can't carry more than MAX_PACKET_SIZE.
+#define MAX_TCP_PAYLOAD (1 << 20)
 #define SEQUENCE_SIZE 16
 #define BUFFER_SIZE 64500
+// Receive buffer a udp server asks for, so a window of DATA isn't dropped before it is read.
+#define RECEIVE_SOCKET_BUFFER (4 << 20)
 
 /// ENUMS ///
 
@@ -19,6 +25,9 @@ typedef enum {
     PPCB_UDPR    = 3
 } PPCB_Protocol;
 
+// Set in CONN's protocol_id when a PPCB_CONN_extension follows the packet.
+#define PPCB_EXTENDED 0x80
+
 typedef enum {
     PPCB_CONN      = 1, 
     PPCB_CONACC    = 2, 
@@ -38,6 +47,16 @@ typedef struct __attribute__((__packed__)) {
     uint64_t    byte_sequence_length;
 } PPCB_CONN_packet;
 
+// Options of PPCB_CONN_extension's flags.
+#define PPCB_FLAG_TIMESTAMPS 0x01  // DATA carries a PPCB_DATA_timestamp.
+
+// Optional extension appended to CONN (requested values) and to CONACC (granted values).
+typedef struct __attribute__((__packed__)) {
+    uint16_t    window;
+    uint32_t    payload_size;   // Largest payload of DATA.
+    uint8_t     flags;          // Options requested, and the subset granted.
+} PPCB_CONN_extension;
+
 typedef struct __attribute__((__packed__)) {
     uint8_t     id;
     uint64_t    session_id;
@@ -50,6 +69,11 @@ typedef struct __attribute__((__packed__)) {
     uint32_t    packet_byte_sequence_length;
 } PPCB_DATA_packet;
 
+// Follows the header of DATA, before the payload, in sessions granted PPCB_FLAG_TIMESTAMPS.
+typedef struct __attribute__((__packed__)) {
+    uint64_t    sent_at;        // CLOCK_REALTIME nanoseconds, just before the send.
+} PPCB_DATA_timestamp;
+
 
 typedef struct __attribute__((__packed__)) {
     uint8_t     id;
@@ -57,6 +81,14 @@ typedef struct __attribute__((__packed__)) {
     uint64_t    packet_number;
 } PPCB_PACKET_RESPONSE_packet;
 
+// Follows ACC in udpr sessions with a window above 1: the run of DATA the server holds beyond the
+// acknowledged packet, around the one which has just arrived. Empty (count 0) when nothing new
+// is held.
+typedef struct __attribute__((__packed__)) {
+    uint64_t    first;
+    uint16_t    count;
+} PPCB_ACC_selective;
+
 /// PACKET FUNCTIONS ///
 
 void set_CONN(
@@ -66,6 +98,21 @@ void set_CONN(
         uint64_t            byte_sequence_length
 );
 
+void set_CONN_extension(
+        PPCB_CONN_extension     *extension,
+        uint16_t                window,
+        uint32_t                payload_size,
+        uint8_t                 flags
+);
+
+bool read_CONN(
+        const char              *buffer,
+        size_t                  received_length,
+        PPCB_CONN_packet        *packet,
+        PPCB_CONN_extension     *extension,
+        bool                    *extended
+);
+
 void set_RESPONSE(
         PPCB_RESPONSE_packet    *packet,
         uint8_t                 packet_id,
@@ -86,8 +133,22 @@ void set_PACKET_RESPONSE(
         uint64_t                        packet_number
 );
 
+void set_ACC_selective(
+        PPCB_ACC_selective  *selective,
+        uint64_t            first,
+        uint16_t            count
+);
+
 /// SENDING UDP PACKETS ///
 
+// Sends the pieces as one datagram without copying them together.
+ssize_t send_vector_udp(
+        int                 socket_fd,
+        struct sockaddr_in  server_address,
+        struct iovec        *vector,
+        size_t              vector_length
+);
+
 ssize_t send_packet_udp(
         int                 socket_fd,
         struct sockaddr_in  server_address,
@@ -95,11 +156,32 @@ ssize_t send_packet_udp(
         void                *buffer
 );
 
+// Sends DATA with the payload taken straight from the byte sequence.
+ssize_t send_DATA_udp(
+        int                 socket_fd,
+        struct sockaddr_in  server_address,
+        uint64_t            session_id,
+        uint64_t            packet_number,
+        const char          *payload,
+        uint32_t            payload_length
+);
+
+// Timeout is in microseconds, 0 waits indefinitely. Returns 0 on timeout.
 ssize_t receive_packet_udp(
         int                   socket_fd,
         struct sockaddr_in    *receive_address,
         void                  *buffer,
-        bool                  connection_initialize
+        uint64_t              timeout
+);
+
+// Largest DATA payload which reaches the server without IP fragmentation, as far as the path
+// MTU known to the kernel tells; with timestamps, DATA carries a PPCB_DATA_timestamp as well.
+// Fragmentation is turned off on the socket from then on, so a drop of the MTU shows up as
+// EMSGSIZE instead of fragments. Returns 0 if the MTU is unknown.
+uint32_t path_payload_size_udp(
+        int                 socket_fd,
+        struct sockaddr_in  server_address,
+        bool                timestamps
 );
 
 void server_sends_RESPONSE_udp(
@@ -118,6 +200,22 @@ void server_sends_RJT_udp(
         PPCB_Protocol       protocol
 );
 
+// Answers CONN or DATA from a client other than the one being served: CONRJT or RJT.
+void server_rejects_stranger(
+        int                 socket_fd,
+        struct sockaddr_in  address,
+        const char          *datagram,
+        uint64_t            packet_number,
+        PPCB_Protocol       protocol
+);
+
+// The largest udpr window (at most MAX_WINDOW, at least 1) whose DATA of payload_size fits the
+// receive buffer of the socket, as the kernel sized it.
+uint16_t receive_window_udp(
+        int                 socket_fd,
+        uint32_t            payload_size
+);
+
 /// COMPARE ADDRESS ///
 
 bool different_addresses(
@@ -133,7 +231,8 @@ bool validate_data_packet(
         uint64_t            session_id,
         uint64_t            packet_number,
         uint64_t            bytes_received,
-        uint64_t            byte_sequence_length
+        uint64_t            byte_sequence_length,
+        uint32_t            payload_size
 );
 
 bool validate_send(
@@ -182,8 +281,24 @@ ssize_t writen(
         size_t        n
 );
 
+// Writes all pieces, continuing after partial writes. The vector is modified.
+ssize_t writevn(
+        int             fd,
+        struct iovec    *vector,
+        int             count
+);
+
+// Like writevn, at a given offset of a file.
+ssize_t pwritevn(
+        int             fd,
+        struct iovec    *vector,
+        int             count,
+        off_t           offset
+);
+
 
-/// CUSTOM MIN FUNCTION ///
+/// CUSTOM MIN AND MAX FUNCTIONS ///
 #define min(a, b) (((a) < (b)) ? (a) : (b))
+#define max(a, b) (((a) > (b)) ? (a) : (b))
 
 #endif // PPCB_COMMON_H
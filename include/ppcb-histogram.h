@@ -0,0 +1,57 @@
+#ifndef PPCB_HISTOGRAM_H
+#define PPCB_HISTOGRAM_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Linear sub-buckets per power of two are 2^(HISTOGRAM_SUB_BITS - 1), so a bucket is less
+// than 1/64 of the values it holds wide; values below 2^HISTOGRAM_SUB_BITS are exact.
+#define HISTOGRAM_SUB_BITS 7
+// Values from 2^HISTOGRAM_MAX_BITS on (over an hour in nanoseconds) share the last bucket.
+#define HISTOGRAM_MAX_BITS 42
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) << (HISTOGRAM_SUB_BITS - 1))
+
+/// LATENCY HISTOGRAM ///
+
+// A log-linear histogram in the manner of HdrHistogram: recording is a few instructions and
+// percentiles keep the same relative precision from microseconds to minutes.
+typedef struct {
+    uint64_t    count;
+    uint64_t    min;
+    uint64_t    max;
+    uint64_t    buckets[HISTOGRAM_BUCKETS];
+} PPCB_histogram;
+
+void histogram_init(
+        PPCB_histogram  *histogram
+);
+
+void histogram_record(
+        PPCB_histogram  *histogram,
+        uint64_t        value
+);
+
+// The value which percentile percent of the recorded ones don't exceed, rounded up to the
+// end of its bucket but never past the maximum. 0 for an empty histogram.
+uint64_t histogram_percentile(
+        const PPCB_histogram    *histogram,
+        double                  percentile
+);
+
+// Writes a line: name, samples, p50, p99, p99.9 and max, tab-separated.
+void histogram_print(
+        const PPCB_histogram    *histogram,
+        const char              *name,
+        FILE                    *stream
+);
+
+// Writes a JSON object of the same values: {"samples":..,"p50":..,"p99":..,"p99.9":..,"max":..}.
+// Returns what snprintf does.
+int histogram_format(
+        const PPCB_histogram    *histogram,
+        char                    *buffer,
+        size_t                  size
+);
+
+#endif // PPCB_HISTOGRAM_H
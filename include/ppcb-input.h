@@ -0,0 +1,47 @@
+#ifndef PPCB_INPUT_H
+#define PPCB_INPUT_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Bytes sent before the already sent part of a mapping is dropped and the next part is
+// requested from the disk.
+#define INPUT_RELEASE_CHUNK (8 << 20)
+
+// Size of a single read() from a pipe.
+#define SPOOL_BLOCK (1 << 20)
+// Default amount of piped input kept in memory before the rest is spilled to a temporary file.
+#define SPOOL_THRESHOLD (64 << 20)
+
+/// BYTE SEQUENCE ///
+
+typedef struct {
+    char        *data;
+    uint64_t    length;
+    int         fd;             // Backing file, -1 when the data was read into memory.
+    char        *mapping;       // Start of the mapping (data may point past it), NULL if none.
+    size_t      mapping_length;
+    uint64_t    released;       // Bytes before this offset are no longer needed.
+} PPCB_input;
+
+// Opens the byte sequence from path, or from stdin if path is NULL. Regular files are mapped
+// instead of being copied into memory. Other input is read into memory up to spool_threshold
+// bytes; longer input is spilled to an unlinked temporary file, which is then mapped.
+void input_open(
+        PPCB_input  *input,
+        const char  *path,
+        uint64_t    spool_threshold
+);
+
+// Tells that bytes before offset won't be sent again.
+void input_release(
+        PPCB_input  *input,
+        uint64_t    offset
+);
+
+void input_close(
+        PPCB_input  *input
+);
+
+#endif // PPCB_INPUT_H
@@ -0,0 +1,55 @@
+#ifndef PPCB_METRICS_H
+#define PPCB_METRICS_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+// How often the exporter samples the counters, for the rates and the rewritten file.
+#define METRICS_INTERVAL_USEC 1000000
+// Threads which may keep metrics, one shard each.
+#define METRICS_MAX_SHARDS 256
+// Scrapers waiting for accept on the metrics socket.
+#define METRICS_QUEUE_LENGTH 16
+
+/// PROCESS-WIDE METRICS ///
+
+typedef enum {
+    METRIC_CONN_ACCEPTED    = 0,
+    METRIC_CONN_REJECTED    = 1,
+    METRIC_BYTES_RECEIVED   = 2,
+    METRIC_BYTES_SENT       = 3,
+    METRIC_RJT_SENT         = 4,
+    METRIC_TIMEOUTS         = 5,
+    METRIC_SESSIONS_CLOSED  = 6,
+    METRIC_COUNTERS         = 7
+} PPCB_metric;
+
+// Starts a thread exporting the metrics in the Prometheus text format: served to every
+// connection on a UNIX socket for "unix:<path>", rewritten every METRICS_INTERVAL_USEC in the
+// file at target otherwise. Called before the threads which keep metrics start.
+void metrics_serve(
+        const char  *target
+);
+
+// Gives the calling thread a shard of its own, if metrics are served. Threads without one,
+// like the client's, count nothing.
+void metrics_register_thread(void);
+
+// The updates below touch only the shard of the calling thread, with relaxed atomics, so
+// they cost a load and a store.
+
+void metrics_add(
+        PPCB_metric     metric,
+        uint64_t        value
+);
+
+// Bytes waiting in the output stage: gathered in buffers or queued to io_uring.
+void metrics_backlog(
+        int64_t         delta
+);
+
+void metrics_session_closed(
+        uint64_t        duration_usec
+);
+
+#endif // PPCB_METRICS_H
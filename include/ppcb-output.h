@@ -0,0 +1,99 @@
+#ifndef PPCB_OUTPUT_H
+#define PPCB_OUTPUT_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "ppcb-uring.h"
+
+// Received bytes gathered before a write when throughput comes first.
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+// Alignment of buffers, offsets and lengths for O_DIRECT writes.
+#define OUTPUT_ALIGNMENT 4096
+
+typedef enum {
+    PPCB_FLUSH_LATENCY      = 1,    // Every packet is written as soon as it is received.
+    PPCB_FLUSH_THROUGHPUT   = 2     // Packets are gathered into large writes.
+} PPCB_flush_policy;
+
+/// OUTPUT STAGE ///
+
+// Writes received bytes as they are (binary-safe) to a descriptor, or to a file per session.
+typedef struct {
+    int                 fd;
+    PPCB_flush_policy   policy;
+    char                *buffer;
+    size_t              length;
+    PPCB_uring          *ring;      // Writes are queued here instead, until output_flush.
+
+    int                 file_fd;    // File of the current session, -1 - writing to fd.
+    uint64_t            offset;     // Where the next byte goes in the file.
+    bool                direct;     // The file is open with O_DIRECT.
+} PPCB_output;
+
+// From then on every session goes to a file of its own in directory, named by its session id,
+// instead of to the descriptor. With direct the files bypass the page cache.
+void output_use_directory(
+        const char      *directory,
+        bool            direct
+);
+
+void output_init(
+        PPCB_output         *output,
+        int                 fd,
+        PPCB_flush_policy   policy
+);
+
+// Several workers write to the same descriptor. Their writes to it then stay system calls under
+// a lock, as queued ones could take the same file position.
+void output_share_descriptor(void);
+
+// Packets go out through the ring that received them. Only latency-first outputs take a ring,
+// the gathered ones already write in large pieces.
+void output_attach_ring(
+        PPCB_output     *output,
+        PPCB_uring      *ring
+);
+
+bool output_write(
+        PPCB_output     *output,
+        const char      *data,
+        size_t          length
+);
+
+// Writes the payloads of a whole batch of packets, in a single call when nothing is gathered.
+bool output_write_vector(
+        PPCB_output     *output,
+        struct iovec    *vector,
+        size_t          count
+);
+
+// Waits for the writes queued on the ring, after which the bytes they were given may change.
+bool output_drain(
+        PPCB_output     *output
+);
+
+// Writes out everything gathered so far.
+bool output_flush(
+        PPCB_output     *output
+);
+
+// Opens the file of a session, preallocated to its length. Does nothing without a directory.
+bool output_open_session(
+        PPCB_output     *output,
+        uint64_t        session_id,
+        uint64_t        byte_sequence_length
+);
+
+// Writes out everything gathered and closes the file of the session, if there is one.
+bool output_close_session(
+        PPCB_output     *output
+);
+
+void output_destroy(
+        PPCB_output     *output
+);
+
+#endif // PPCB_OUTPUT_H
@@ -0,0 +1,72 @@
+#ifndef PPCB_REASSEMBLY_H
+#define PPCB_REASSEMBLY_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+// Bytes of payload a udpr session may hold ahead of the awaited DATA.
+#define REASSEMBLY_BYTES (1 << 20)
+
+/// REASSEMBLY BUFFER ///
+
+// DATA which arrived ahead of the awaited packet, up to capacity packets beyond it. Packet
+// numbers awaited + 1 .. awaited + capacity fall into distinct slots, so a slot is free again
+// once its packet is taken.
+typedef struct {
+    size_t      capacity;
+    uint32_t    payload_size;
+    size_t      held;
+    uint32_t    *lengths;       // Payload length of each slot, 0 - empty.
+    char        *payloads;      // capacity * payload_size, allocated by the first hold.
+} PPCB_reassembly;
+
+typedef enum {
+    REASSEMBLY_HELD,
+    REASSEMBLY_DUPLICATE,       // The packet is held already.
+    REASSEMBLY_BEYOND           // Too far ahead, or the buffer has no room at all.
+} PPCB_reassembly_result;
+
+// Holds DATA of up to window - 1 packets of payload_size, or fewer if they would take more
+// than REASSEMBLY_BYTES. Nothing is held with a window of 1.
+void reassembly_init(
+        PPCB_reassembly *reassembly,
+        uint16_t        window,
+        uint32_t        payload_size
+);
+
+// Largest window whose DATA ahead of the awaited packet all fits REASSEMBLY_BYTES.
+uint16_t reassembly_window(
+        uint32_t        payload_size
+);
+
+// Holds the payload of DATA packet_number, which is ahead of awaited.
+PPCB_reassembly_result reassembly_hold(
+        PPCB_reassembly *reassembly,
+        uint64_t        awaited,
+        uint64_t        packet_number,
+        const char      *payload,
+        uint32_t        length
+);
+
+// Takes DATA packet_number, the awaited one, if it's held: sets payload to it (valid until
+// the next hold) and returns its length. Returns 0 otherwise.
+uint32_t reassembly_take(
+        PPCB_reassembly *reassembly,
+        uint64_t        packet_number,
+        const char      **payload
+);
+
+// Finds the run of held packets around packet_number, or the first run above it if it isn't
+// held: sets first to the lowest of them and returns how many there are, 0 if there is none.
+uint16_t reassembly_run(
+        const PPCB_reassembly   *reassembly,
+        uint64_t                awaited,
+        uint64_t                packet_number,
+        uint64_t                *first
+);
+
+void reassembly_destroy(
+        PPCB_reassembly *reassembly
+);
+
+#endif // PPCB_REASSEMBLY_H
@@ -0,0 +1,54 @@
+#ifndef PPCB_RTT_H
+#define PPCB_RTT_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#define USEC_PER_SEC 1000000
+
+/// RETRANSMISSION TIMEOUT ///
+
+// Smoothed RTT estimation as in RFC 6298. All values are in microseconds.
+typedef struct {
+    uint64_t    srtt;
+    uint64_t    rttvar;
+    uint64_t    rto;
+    uint64_t    silent_since;   // Last time the peer made progress.
+} PPCB_rtt;
+
+void rtt_init(
+        PPCB_rtt    *rtt
+);
+
+// Feeds a round trip measured on a packet that was sent once (Karn's rule).
+void rtt_sample(
+        PPCB_rtt    *rtt,
+        uint64_t    sample
+);
+
+// Doubles the timeout after it expired.
+void rtt_backoff(
+        PPCB_rtt    *rtt
+);
+
+// Marks that the peer made progress, resetting the silence budget. The backoff stays until
+// rtt_sample gets a round trip measured on a packet sent once.
+void rtt_progress(
+        PPCB_rtt    *rtt
+);
+
+// True once the peer has been silent for longer than MAX_SILENCE.
+bool rtt_expired(
+        const PPCB_rtt  *rtt
+);
+
+/// CLOCK ///
+
+uint64_t monotonic_usec(void);
+
+// Time left until deadline, at least 1 (0 would mean no timeout for a socket).
+uint64_t usec_until(
+        uint64_t    deadline
+);
+
+#endif // PPCB_RTT_H
@@ -0,0 +1,102 @@
+#ifndef PPCB_SESSION_H
+#define PPCB_SESSION_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "ppcb-common.h"
+#include "ppcb-output.h"
+#include "ppcb-reassembly.h"
+#include "ppcb-rtt.h"
+#include "ppcb-stats.h"
+#include "ppcb-timer.h"
+
+// Sessions served at once; a CONN beyond that is rejected.
+#define MAX_SESSIONS 1024
+// Hash buckets of the session table, a power of two.
+#define SESSION_BUCKETS (2 * MAX_SESSIONS)
+
+/// SESSIONS ///
+
+// State of one transfer on a shared UDP socket.
+typedef struct PPCB_session {
+    struct sockaddr_in      address;
+    uint64_t                session_id;
+    PPCB_Protocol           protocol;
+    uint64_t                byte_sequence_length;
+    uint64_t                bytes_received;
+    uint64_t                packet_number;      // Next DATA awaited.
+    PPCB_output             output;
+    PPCB_stats              stats;
+
+    // udpr only: the window granted by an extended CONACC, the DATA which came ahead of its
+    // turn and the timing of confirmations.
+    bool                    extended;
+    PPCB_CONN_extension     extension;
+    PPCB_reassembly         reassembly;
+    PPCB_rtt                rtt;
+    uint64_t                sent_at;
+    uint64_t                transmit;
+
+    // Set by the protocol, after which the table is told with session_update.
+    uint64_t                deadline;
+
+    // Kept by the table.
+    PPCB_timer              timer;
+    struct PPCB_session     *next;
+} PPCB_session;
+
+// Sessions looked up by (client address, session_id), with a timer wheel of their deadlines.
+typedef struct {
+    size_t              count;
+    PPCB_session        *buckets[SESSION_BUCKETS];
+    PPCB_timer_wheel    timers;
+} PPCB_session_table;
+
+void session_table_init(
+        PPCB_session_table  *table
+);
+
+PPCB_session *session_find(
+        PPCB_session_table  *table,
+        struct sockaddr_in  address,
+        uint64_t            session_id
+);
+
+// Returns a new session with its output set up, or NULL when the table is full.
+PPCB_session *session_add(
+        PPCB_session_table  *table,
+        struct sockaddr_in  address,
+        uint64_t            session_id,
+        PPCB_Protocol       protocol,
+        PPCB_flush_policy   policy
+);
+
+// Flushes what the session received, reports its statistics and forgets it.
+void session_remove(
+        PPCB_session_table  *table,
+        PPCB_session        *session
+);
+
+// Puts the session in place after its deadline changed.
+void session_update(
+        PPCB_session_table  *table,
+        PPCB_session        *session
+);
+
+// Takes a session whose deadline passed by now, or NULL when there is none. It stays in the
+// table, but without a deadline until the next session_update.
+PPCB_session *session_expired(
+        PPCB_session_table  *table,
+        uint64_t            now
+);
+
+// How long a wait may last before some session expires, 0 - no limit.
+uint64_t session_timeout(
+        PPCB_session_table  *table,
+        uint64_t            now
+);
+
+#endif // PPCB_SESSION_H
@@ -0,0 +1,115 @@
+#ifndef PPCB_STATS_H
+#define PPCB_STATS_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ppcb-common.h"
+#include "ppcb-timestamp.h"
+
+/// SESSION STATISTICS ///
+
+// Counters of one session, as seen by the side that keeps them. Bytes and packets are those
+// on the wire, headers included; payload_bytes are the bytes of the sequence delivered.
+typedef struct {
+    const char      *role;              // "client" or "server"
+    PPCB_Protocol   protocol;
+    uint64_t        session_id;
+    bool            opened;             // The session got past CONN; only then it is reported.
+    bool            completed;          // RCVD was sent or received.
+    uint64_t        started_at;
+
+    uint64_t        bytes_sent;
+    uint64_t        bytes_received;
+    uint64_t        packets_sent;
+    uint64_t        packets_received;
+    uint64_t        payload_bytes;
+
+    uint64_t        retransmissions;
+    uint64_t        duplicate_data;
+    uint64_t        duplicate_acc;      // Repeated ACC or CONACC.
+    uint64_t        rejects;            // RJT or CONRJT, sent by the server, received by the client.
+    uint64_t        timeouts;
+
+    uint64_t        rtt_samples;
+    uint64_t        rtt_min;
+    uint64_t        rtt_max;
+    uint64_t        rtt_sum;
+
+    PPCB_delay      *delay;             // Allocated by the first stats_delay, NULL until then.
+} PPCB_stats;
+
+// Has every reported session written as a JSON line to path, or to stderr for "-". Called
+// before any session starts; without it nothing is reported.
+void stats_use_file(
+        const char      *path
+);
+
+void stats_init(
+        PPCB_stats      *stats,
+        const char      *role,
+        PPCB_Protocol   protocol
+);
+
+// Makes stats the session of the calling thread, which the counting functions below update;
+// NULL counts nothing. Returns the session attached before.
+PPCB_stats *stats_attach(
+        PPCB_stats      *stats
+);
+
+// Ends a session: writes its report, if reports were asked for and it was opened, and counts
+// it in the process-wide metrics. Frees what the statistics allocated.
+void stats_report(
+        PPCB_stats      *stats
+);
+
+/// COUNTING FOR THE ATTACHED SESSION ///
+
+// Opening the session, bytes on the wire and timeouts count toward the process-wide metrics
+// too, attached session or not.
+
+void stats_session(
+        uint64_t        session_id
+);
+
+void stats_sent(
+        size_t          length,
+        uint64_t        packets
+);
+
+void stats_received(
+        size_t          length,
+        uint64_t        packets
+);
+
+void stats_delivered(
+        uint64_t        length
+);
+
+void stats_completed(void);
+
+void stats_retransmitted(
+        uint64_t        packets
+);
+
+void stats_duplicate_data(void);
+
+void stats_duplicate_acc(void);
+
+void stats_rejected(void);
+
+void stats_timed_out(void);
+
+void stats_rtt(
+        uint64_t        sample
+);
+
+// DATA stamped with PPCB_DATA_timestamp's sent_at arrived at the kernel at arrived_at (0 - it
+// wasn't stamped) and is taken by the server now.
+void stats_delay(
+        uint64_t        sent_at,
+        uint64_t        arrived_at
+);
+
+#endif // PPCB_STATS_H
@@ -1,20 +1,85 @@
 #ifndef PPCB_TCP_H
 #define PPCB_TCP_H
 
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "ppcb-common.h"
+#include "ppcb-input.h"
+#include "ppcb-output.h"
+#include "ppcb-stats.h"
+#include "ppcb-timer.h"
+
 
 void send_bytes_tcp(
         int                   socket_fd,
         struct sockaddr_in    server_address,
         uint64_t              session_id,
-        uint64_t              byte_sequence_length,
-        char*                 byte_sequence
+        PPCB_input            *input,
+        bool                  use_sendfile,
+        uint32_t              payload_size
 );
 
 #define QUEUE_LENGTH  5
+// Connections waiting for accept in the event-driven server.
+#define CONCURRENT_QUEUE_LENGTH  SOMAXCONN
+// Bytes read from one connection before the others get their turn.
+#define CONNECTION_READ_BUDGET  (1 << 20)
+
+// Size of the buffer handle_connection_tcp needs: a DATA header and the largest payload.
+#define TCP_BUFFER_SIZE (sizeof(PPCB_DATA_packet) + MAX_TCP_PAYLOAD)
 
 void handle_connection_tcp(
-        int     client_fd,
-        char    *buffer
+        int             client_fd,
+        PPCB_output     *output,
+        char            *buffer
+);
+
+/// EVENT-DRIVEN TCP SERVER ///
+
+typedef enum {
+    PPCB_TCP_READING_CONN       = 1,
+    PPCB_TCP_READING_HEADER     = 2,    // Header of the next DATA.
+    PPCB_TCP_READING_PAYLOAD    = 3,    // Payload of the DATA whose header was read.
+    PPCB_TCP_READING_EXTENSION  = 4     // Extension announced by CONN.
+} PPCB_tcp_state;
+
+// A session on a non-blocking socket, advanced as its bytes arrive.
+typedef struct PPCB_tcp_connection {
+    int                             fd;
+    PPCB_tcp_state                  state;
+    size_t                          received;   // Bytes of the awaited part read so far.
+    uint64_t                        session_id;
+    uint64_t                        byte_sequence_length;
+    uint64_t                        bytes_received;
+    uint64_t                        packet_number;
+    uint32_t                        payload_size;   // Largest payload granted to DATA.
+    PPCB_CONN_packet                conn_packet;
+    PPCB_CONN_extension             extension;
+    PPCB_DATA_packet                data_packet;
+    char                            *payload;
+    PPCB_output                     output;
+    PPCB_stats                      stats;
+
+    // Kept by the server, which drops the connection once it expires.
+    PPCB_timer                      timer;
+} PPCB_tcp_connection;
+
+void connection_tcp_init(
+        PPCB_tcp_connection     *connection,
+        int                     client_fd,
+        PPCB_flush_policy       policy
+);
+
+// Reads whatever has arrived and answers it. Returns whether the connection stays open:
+// false once the session is over, successfully or not.
+bool connection_tcp_receive(
+        PPCB_tcp_connection     *connection
+);
+
+// Flushes what was received and closes the socket.
+void connection_tcp_destroy(
+        PPCB_tcp_connection     *connection
 );
 
 #endif // PPCB_TCP_H
@@ -0,0 +1,75 @@
+#ifndef PPCB_TIMER_H
+#define PPCB_TIMER_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Resolution of the timers, in microseconds; deadlines are rounded up to a whole tick.
+#define TIMER_TICK_USEC 250
+// Slots per level of the wheel, a power of two, and bits of a tick each level stands for.
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+// Levels of the wheel: 64^4 ticks of 250 us span over an hour. Farther deadlines wait in
+// the last level and are placed again when they come down.
+#define TIMER_LEVELS 4
+
+/// TIMER WHEEL ///
+
+// A deadline kept by a wheel. It is embedded in what it times, which data points back to.
+typedef struct PPCB_timer {
+    uint64_t            deadline;   // In microseconds of monotonic_usec.
+    void                *data;
+
+    // Kept by the wheel; slot is NULL when the timer isn't scheduled.
+    struct PPCB_timer   **slot;
+    struct PPCB_timer   *previous;
+    struct PPCB_timer   *next;
+} PPCB_timer;
+
+// A hierarchical timer wheel: scheduling and cancelling are O(1), and every tick moves only
+// the timers of one slot, so thousands of sessions cost nothing while they wait.
+typedef struct {
+    uint64_t            tick;       // Next tick to be processed.
+    size_t              count;
+    PPCB_timer          *slots[TIMER_LEVELS][TIMER_SLOTS];
+    PPCB_timer          *expired;   // Due, but not taken yet.
+} PPCB_timer_wheel;
+
+void timer_wheel_init(
+        PPCB_timer_wheel    *wheel,
+        uint64_t            now
+);
+
+void timer_init(
+        PPCB_timer  *timer,
+        void        *data
+);
+
+// Sets the deadline of the timer, moving it if it is already scheduled.
+void timer_schedule(
+        PPCB_timer_wheel    *wheel,
+        PPCB_timer          *timer,
+        uint64_t            deadline
+);
+
+// Does nothing when the timer isn't scheduled.
+void timer_cancel(
+        PPCB_timer_wheel    *wheel,
+        PPCB_timer          *timer
+);
+
+// Takes a timer whose deadline passed by now, unscheduled, or NULL when there is none.
+PPCB_timer *timer_wheel_expire(
+        PPCB_timer_wheel    *wheel,
+        uint64_t            now
+);
+
+// Microseconds a wait may last before the wheel needs to be looked at again, at least 1,
+// or 0 when no timer is scheduled (no limit).
+uint64_t timer_wheel_timeout(
+        const PPCB_timer_wheel  *wheel,
+        uint64_t                now
+);
+
+#endif // PPCB_TIMER_H
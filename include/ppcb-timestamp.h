@@ -0,0 +1,86 @@
+#ifndef PPCB_TIMESTAMP_H
+#define PPCB_TIMESTAMP_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+
+#include "ppcb-histogram.h"
+
+// Room in a control buffer for the timestamps of one received datagram.
+#define TIMESTAMP_CONTROL_SIZE CMSG_SPACE(sizeof(struct scm_timestamping))
+// Sends whose transmit timestamps may be awaited at once, a power of two.
+#define TIMESTAMP_TX_RING 1024
+
+/// KERNEL TIMESTAMPS ///
+
+// Turns SO_TIMESTAMPING on for sessions started from now on, and the timestamps of DATA with
+// it. A client gets the time its DATA spent in the local stack recorded in send_stack; a
+// server passes NULL. Called before any session starts.
+void timestamp_use(
+        PPCB_histogram  *send_stack
+);
+
+bool timestamp_used(void);
+
+// Clock of the kernel timestamps; hosts measuring one-way delay must keep it in sync.
+uint64_t realtime_nsec(void);
+
+// Has the kernel stamp datagrams arriving at the socket, in software and also in hardware
+// where the NIC does it. Returns false if the kernel refuses.
+bool timestamp_receive(
+        int     socket_fd
+);
+
+// Arrival time of a datagram from the control messages recvmsg gave, 0 if it wasn't stamped.
+// Hardware stamps are preferred.
+uint64_t timestamp_arrival(
+        struct msghdr   *message
+);
+
+/// TRANSMIT TIMESTAMPS ///
+
+// Has the kernel stamp every datagram sent on the socket from now on; only DATA may be sent
+// after this, as the stamps are matched to timestamp_sent by count. Returns false if the
+// kernel refuses.
+bool timestamp_transmit(
+        int     socket_fd
+);
+
+// Notes that count datagrams were handed to the kernel at sent_at.
+void timestamp_sent(
+        uint64_t    sent_at,
+        uint32_t    count
+);
+
+// Takes the stamps waiting in the socket's error queue, without blocking.
+void timestamp_collect(
+        int     socket_fd
+);
+
+/// ONE-WAY DELAY ///
+
+// Delays of a session's DATA as seen by the server, in nanoseconds.
+typedef struct {
+    PPCB_histogram  one_way_delay;          // From sent_at to the arrival; below 0 counts as 0.
+    PPCB_histogram  jitter;                 // Difference between delays of consecutive DATA.
+    PPCB_histogram  receive_stack;          // From the arrival to the server taking DATA.
+    uint64_t        interarrival_jitter;    // Smoothed as in RFC 3550.
+    int64_t         previous_delay;
+    bool            has_previous;
+} PPCB_delay;
+
+void delay_init(
+        PPCB_delay  *delay
+);
+
+// arrived_at is 0 if the kernel didn't stamp the datagram, read_at then stands for it.
+void delay_record(
+        PPCB_delay  *delay,
+        uint64_t    sent_at,
+        uint64_t    arrived_at,
+        uint64_t    read_at
+);
+
+#endif // PPCB_TIMESTAMP_H
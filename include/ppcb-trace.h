@@ -0,0 +1,60 @@
+#ifndef PPCB_TRACE_H
+#define PPCB_TRACE_H
+
+#include <inttypes.h>
+
+/// TRACE POINTS ///
+
+// Built with PPCB_TRACE defined (make TRACE=1), the trace points below record timestamped
+// events into a ring of the calling thread, which keeps the latest TRACE_RING_SIZE of them.
+// The rings are written to a Chrome trace (JSON, opened by Perfetto or chrome://tracing) when
+// the process exits, is interrupted or terminated, and whenever it gets SIGUSR1; the file is
+// PPCB_TRACE_FILE from the environment, ppcb-trace-<pid>.json by default.
+//
+// Otherwise the trace points are nothing at all: their arguments aren't even evaluated.
+
+#ifdef PPCB_TRACE
+
+// Events kept by each thread, a power of two.
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 65536
+#endif
+
+typedef struct {
+    const char  *name;
+    uint64_t    started_at;
+    int64_t     value;
+} PPCB_trace_span;
+
+PPCB_trace_span trace_begin(
+        const char  *name,
+        int64_t     value
+);
+
+void trace_end(
+        PPCB_trace_span *span
+);
+
+void trace_instant(
+        const char  *name,
+        int64_t     value
+);
+
+// Times the rest of the enclosing block as an event called name (a string literal), with
+// value as its argument.
+#define TRACE_SPAN(name, value) \
+    PPCB_trace_span trace_span __attribute__((cleanup(trace_end))) = trace_begin(name, value)
+// Replaces the argument of the block's TRACE_SPAN, e.g. with a result.
+#define TRACE_RESULT(result) (trace_span.value = (int64_t) (result))
+// An event without a duration, e.g. a retransmission.
+#define TRACE_INSTANT(name, value) trace_instant(name, (int64_t) (value))
+
+#else
+
+#define TRACE_SPAN(name, value) ((void) 0)
+#define TRACE_RESULT(result) ((void) 0)
+#define TRACE_INSTANT(name, value) ((void) 0)
+
+#endif // PPCB_TRACE
+
+#endif // PPCB_TRACE_H
@@ -3,12 +3,17 @@
 
 #include <inttypes.h>
 
+#include "ppcb-batch.h"
+#include "ppcb-input.h"
+#include "ppcb-output.h"
+#include "ppcb-session.h"
+
 void send_bytes_udp(
         int                   socket_fd,
         struct sockaddr_in    server_address,
         uint64_t              session_id,
-        uint64_t              byte_sequence_length,
-        char*                 byte_sequence
+        PPCB_input            *input,
+        uint32_t              payload_size
 );
 
 void handle_connection_udp(
@@ -16,7 +21,25 @@ void handle_connection_udp(
         struct sockaddr_in  client_address,
         uint64_t            session_id,
         uint64_t            byte_sequence_length,
-        char                *buffer
+        PPCB_output         *output,
+        PPCB_receive_batch  *batch
+);
+
+/// EVENT-DRIVEN UDP SERVER ///
+
+// Session functions return whether the session goes on; a finished or failed one is removed.
+
+// Answers a valid CONN with CONACC.
+bool session_udp_start(
+        int                 socket_fd,
+        PPCB_session        *session
+);
+
+bool session_udp_receive(
+        int                 socket_fd,
+        PPCB_session        *session,
+        const char          *datagram,
+        size_t              received_length
 );
 
 #endif // PPCB_UDP_H
@@ -3,12 +3,29 @@
 
 #include <inttypes.h>
 
+#include "ppcb-common.h"
+#include "ppcb-batch.h"
+#include "ppcb-histogram.h"
+#include "ppcb-input.h"
+#include "ppcb-output.h"
+#include "ppcb-session.h"
+
+// Latencies of a client session, in microseconds.
+typedef struct {
+    PPCB_histogram  handshake;          // From the first CONN to CONACC.
+    PPCB_histogram  acknowledgement;    // From DATA to the ACC covering it, for DATA sent once.
+    PPCB_histogram  completion;         // From the last DATA sent to RCVD.
+} PPCB_udpr_latency;
+
+// Records the latencies into latency unless it's NULL.
 void send_bytes_udpr(
         int                   socket_fd,
         struct sockaddr_in    server_address,
         uint64_t              session_id,
-        uint64_t              byte_sequence_length,
-        char*                 byte_sequence
+        PPCB_input            *input,
+        uint16_t              window,
+        uint32_t              payload_size,
+        PPCB_udpr_latency     *latency
 );
 
 void handle_connection_udpr(
@@ -16,7 +33,33 @@ void handle_connection_udpr(
         struct sockaddr_in  client_address,
         uint64_t            session_id,
         uint64_t            byte_sequence_length,
-        char                *buffer
+        PPCB_CONN_extension *extension,
+        PPCB_output         *output,
+        PPCB_receive_batch  *batch
+);
+
+/// EVENT-DRIVEN UDPR SERVER ///
+
+// Answers a valid CONN with CONACC, extended when extension isn't NULL.
+bool session_udpr_start(
+        int                         socket_fd,
+        PPCB_session                *session,
+        const PPCB_CONN_extension   *extension
+);
+
+// arrived_at is the kernel's arrival stamp of the datagram, 0 if it has none.
+bool session_udpr_receive(
+        int                 socket_fd,
+        PPCB_session        *session,
+        const char          *datagram,
+        size_t              received_length,
+        uint64_t            arrived_at
+);
+
+// Called once the session's deadline passed: retransmits the confirmation or gives up.
+bool session_udpr_timeout(
+        int                 socket_fd,
+        PPCB_session        *session
 );
 
 #endif // PPCB_UDPR_H
@@ -0,0 +1,112 @@
+#ifndef PPCB_URING_H
+#define PPCB_URING_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+// Submission queue entries of a ring.
+#define URING_ENTRIES 256
+// Receive buffers provided to the kernel, a power of two.
+#define URING_BUFFERS 128
+// Size of one provided buffer: the recvmsg header, the address and the datagram.
+#define URING_BUFFER_SIZE (1 << 16)
+
+/// IO_URING BACKEND ///
+
+typedef struct {
+    int32_t     result;
+    uint32_t    flags;
+} PPCB_uring_completion;
+
+// An io_uring set up with raw system calls, serving one UDP socket: datagrams come in through
+// a multishot recvmsg into provided buffers, and writes of their payloads are queued behind it.
+typedef struct {
+    int                         fd;
+
+    unsigned                    *sq_head;
+    unsigned                    *sq_tail;
+    unsigned                    sq_mask;
+    unsigned                    *sq_array;
+    struct io_uring_sqe         *sqes;
+    unsigned                    sq_pending;         // Queued, but not submitted yet.
+
+    unsigned                    *cq_head;
+    unsigned                    *cq_tail;
+    unsigned                    cq_mask;
+    struct io_uring_cqe         *cqes;
+
+    void                        *ring_mapping;
+    size_t                      ring_mapping_length;
+    size_t                      sqes_length;
+
+    struct io_uring_buf_ring    *buffer_ring;
+    char                        *buffers;
+    uint16_t                    buffer_tail;
+
+    int                         socket_fd;
+    struct msghdr               receive_template;
+    bool                        receive_armed;
+    PPCB_uring_completion       received[URING_BUFFERS];
+    size_t                      received_first;
+    size_t                      received_count;
+
+    size_t                      pending_writes;
+    struct io_uring_sqe         *chain_tail;        // Last write of the chain being queued.
+    const void                  *chain;
+    int                         chain_fd;
+    int                         write_error;        // errno of the first failed write, or 0.
+} PPCB_uring;
+
+// Returns false when the kernel doesn't offer what is needed, so the caller can fall back.
+bool uring_init(
+        PPCB_uring  *ring,
+        int         socket_fd
+);
+
+// Queues a write at offset, or at the file position for -1; the data must stay valid until
+// uring_drain_writes. Writes at the file position queued in a row for the same chain (one
+// session's output) are linked until they are submitted, so they land in order.
+void uring_queue_write(
+        PPCB_uring  *ring,
+        const void  *chain,
+        int         fd,
+        const void  *data,
+        size_t      length,
+        uint64_t    offset
+);
+
+// Waits for every queued write. Returns false if any failed since the last call, with errno set.
+bool uring_drain_writes(
+        PPCB_uring  *ring
+);
+
+// Waits at most timeout microseconds (0 - no limit) for datagrams, submitting queued writes
+// in the same call. Returns the number received, 0 on timeout, -1 on error.
+int uring_wait_received(
+        PPCB_uring  *ring,
+        uint64_t    timeout
+);
+
+// Takes the oldest received datagram. Its buffer goes back with uring_recycle.
+bool uring_take_received(
+        PPCB_uring          *ring,
+        struct sockaddr_in  *receive_address,
+        char                **datagram,
+        size_t              *length,
+        uint16_t            *buffer_id
+);
+
+void uring_recycle(
+        PPCB_uring  *ring,
+        uint16_t    buffer_id
+);
+
+void uring_destroy(
+        PPCB_uring  *ring
+);
+
+#endif // PPCB_URING_H
@@ -4,4 +4,19 @@
 #define MAX_WAIT 5
 #define MAX_RETRANSMITS 5
 
+// Bounds of the udpr retransmission timeout, in microseconds. MAX_RTO stays above MAX_WAIT,
+// so peers retransmitting only on MAX_WAIT timeouts get a chance to do so.
+#define MIN_RTO 1000
+#define INITIAL_RTO 200000
+#define MAX_RTO (2 * MAX_WAIT * 1000000ULL)
+// A udpr peer silent for this long (in microseconds) is given up on.
+#define MAX_SILENCE ((MAX_RETRANSMITS + 1) * MAX_WAIT * 1000000ULL)
+
+// Largest udpr window (DATA packets in flight) the server grants.
+#define MAX_WINDOW 256
+// udpr DATA counts as lost once DATA sent this many transmissions after it is acknowledged.
+#define REORDER_THRESHOLD 3
+// Extended CONNs sent before the client falls back to a plain one.
+#define CONN_EXTENDED_ATTEMPTS 2
+
 #endif // PROTCONST_H
@@ -0,0 +1,454 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ppcb-batch.h"
+#include "ppcb-common.h"
+#include "ppcb-rtt.h"
+#include "ppcb-stats.h"
+#include "ppcb-timestamp.h"
+#include "ppcb-trace.h"
+#include "err.h"
+
+
+/// BATCHED SENDING ///
+
+void send_batch_init(
+        PPCB_send_batch     *batch,
+        int                 socket_fd,
+        struct sockaddr_in  address,
+        PPCB_Protocol       protocol
+) {
+    batch->socket_fd = socket_fd;
+    batch->address = address;
+    batch->protocol = protocol;
+    batch->timestamps = false;
+    batch->mtu_exceeded = false;
+    batch->count = 0;
+
+    // Kernels without UDP GSO don't know the option.
+    int segment_size;
+    socklen_t option_length = sizeof(segment_size);
+    batch->gso = getsockopt(socket_fd, SOL_UDP, UDP_SEGMENT, &segment_size, &option_length) == 0;
+}
+
+void send_batch_add_DATA(
+        PPCB_send_batch     *batch,
+        uint64_t            session_id,
+        uint64_t            packet_number,
+        const char          *payload,
+        uint32_t            payload_length
+) {
+    size_t i = batch->count++;
+
+    set_DATA(&batch->headers[i], session_id, packet_number, payload_length);
+    batch->vectors[3 * i] = (struct iovec) {
+        .iov_base = &batch->headers[i],
+        .iov_len = sizeof(PPCB_DATA_packet)
+    };
+    batch->vectors[3 * i + 1] = (struct iovec) {
+        .iov_base = &batch->stamps[i],
+        .iov_len = batch->timestamps ? sizeof(PPCB_DATA_timestamp) : 0
+    };
+    batch->vectors[3 * i + 2] = (struct iovec) {
+        .iov_base = (void *) payload,
+        .iov_len = payload_length
+    };
+
+    if (batch->count == BATCH_SIZE) {
+        send_batch_flush(batch);
+    }
+}
+
+static size_t packet_length(
+        PPCB_send_batch     *batch,
+        size_t              i
+) {
+    return batch->vectors[3 * i].iov_len + batch->vectors[3 * i + 1].iov_len +
+           batch->vectors[3 * i + 2].iov_len;
+}
+
+// Segments must all have the size of the first one, except for a shorter last one.
+static size_t gso_segment_size(
+        PPCB_send_batch     *batch
+) {
+    size_t segment_size = packet_length(batch, 0);
+    size_t total = 0;
+
+    for (size_t i = 0; i < batch->count; i++) {
+        size_t length = packet_length(batch, i);
+        if (length > segment_size || (length < segment_size && i + 1 < batch->count)) {
+            return 0;
+        }
+        total += length;
+    }
+
+    return (batch->count > 1 && total <= MAX_UDP_PAYLOAD) ? segment_size : 0;
+}
+
+// Sends the batch as one datagram which the kernel (or the NIC) cuts into segments.
+static bool send_gso(
+        PPCB_send_batch     *batch,
+        size_t              segment_size
+) {
+    char control[CMSG_SPACE(sizeof(uint16_t))] = {0};
+    struct msghdr message = {
+        .msg_name                       = &batch->address,
+        .msg_namelen                    = sizeof(batch->address),
+        .msg_iov                        = batch->vectors,
+        .msg_iovlen                     = 3 * batch->count,
+        .msg_control                    = control,
+        .msg_controllen                 = sizeof(control)
+    };
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_UDP;
+    header->cmsg_type = UDP_SEGMENT;
+    header->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t gso_size = (uint16_t) segment_size;
+    memcpy(CMSG_DATA(header), &gso_size, sizeof(gso_size));
+
+    size_t expected_length = 0;
+    for (size_t i = 0; i < batch->count; i++) {
+        expected_length += packet_length(batch, i);
+    }
+
+    ssize_t sent_length = sendmsg(batch->socket_fd, &message, 0);
+    if (sent_length < 0 && errno == EMSGSIZE) {
+        return false; // The path MTU dropped, which the datagrams one by one deal with.
+    }
+    if (sent_length < 0 && (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT)) {
+        // Segments larger than the path allows, or no GSO in the device; don't try again.
+        batch->gso = false;
+        return false;
+    }
+
+    validate_send(sent_length, expected_length, true, batch->protocol, "sending DATA");
+    stats_sent(expected_length, batch->count);
+    return true;
+}
+
+// Sends datagram i, cut before the path MTU dropped, with fragmentation allowed just for it.
+static void send_fragmented(
+        PPCB_send_batch     *batch,
+        size_t              i
+) {
+    int discover = IP_PMTUDISC_DONT;
+    setsockopt(batch->socket_fd, IPPROTO_IP, IP_MTU_DISCOVER, &discover, sizeof(discover));
+    ssize_t sent_length = sendmsg(batch->socket_fd, &batch->messages[i].msg_hdr, 0);
+    discover = IP_PMTUDISC_DO;
+    setsockopt(batch->socket_fd, IPPROTO_IP, IP_MTU_DISCOVER, &discover, sizeof(discover));
+
+    size_t expected_length = packet_length(batch, i);
+    validate_send(sent_length, expected_length, true, batch->protocol, "sending DATA");
+    stats_sent(expected_length, 1);
+    batch->mtu_exceeded = true;
+}
+
+void send_batch_flush(
+        PPCB_send_batch     *batch
+) {
+    if (batch->count == 0) {
+        return;
+    }
+    TRACE_SPAN("send_batch_flush", batch->count);
+
+    uint64_t sent_at = 0;
+    if (batch->timestamps) {
+        sent_at = realtime_nsec();
+        for (size_t i = 0; i < batch->count; i++) {
+            batch->stamps[i].sent_at = htobe64(sent_at);
+        }
+    }
+
+    size_t segment_size = batch->gso ? gso_segment_size(batch) : 0;
+    if (segment_size > 0 && send_gso(batch, segment_size)) {
+        if (batch->timestamps) {
+            timestamp_sent(sent_at, 1);
+            timestamp_collect(batch->socket_fd);
+        }
+        batch->count = 0;
+        return;
+    }
+
+    for (size_t i = 0; i < batch->count; i++) {
+        batch->messages[i] = (struct mmsghdr) {
+            .msg_hdr = {
+                .msg_name               = &batch->address,
+                .msg_namelen            = sizeof(batch->address),
+                .msg_iov                = &batch->vectors[3 * i],
+                .msg_iovlen             = 3
+            }
+        };
+    }
+
+    // sendmmsg stops early when the socket buffer is full.
+    size_t sent = 0;
+    while (sent < batch->count) {
+        int sent_count = sendmmsg(batch->socket_fd, batch->messages + sent,
+                                  batch->count - sent, 0);
+        if (sent_count < 0 && errno == EMSGSIZE) {
+            send_fragmented(batch, sent++);
+            continue;
+        }
+        if (sent_count <= 0) {
+            validate_send(-1, 0, true, batch->protocol, "sending DATA");
+        }
+
+        for (int i = 0; i < sent_count; i++, sent++) {
+            size_t expected_length = packet_length(batch, sent);
+            validate_send(batch->messages[sent].msg_len, expected_length, true,
+                          batch->protocol, "sending DATA");
+            stats_sent(expected_length, 1);
+        }
+    }
+
+    if (batch->timestamps) {
+        timestamp_sent(sent_at, (uint32_t) batch->count);
+        timestamp_collect(batch->socket_fd);
+    }
+    batch->count = 0;
+}
+
+uint32_t send_batch_fit(
+        PPCB_send_batch     *batch,
+        uint32_t            payload_size
+) {
+    if (!batch->mtu_exceeded) {
+        return payload_size;
+    }
+
+    batch->mtu_exceeded = false;
+    uint32_t path_payload_size = path_payload_size_udp(batch->socket_fd, batch->address,
+                                                       batch->timestamps);
+    return (path_payload_size > 0) ? min(payload_size, path_payload_size) : payload_size;
+}
+
+/// BATCHED RECEIVING ///
+
+void receive_batch_init(
+        PPCB_receive_batch  *batch,
+        int                 socket_fd,
+        bool                use_uring
+) {
+    batch->socket_fd = socket_fd;
+    batch->count = 0;
+    batch->current = 0;
+    batch->offset = 0;
+    batch->gro = false;
+    batch->timestamps = false;
+    batch->arrived_at = 0;
+    batch->ring = NULL;
+    batch->buffers = NULL;
+
+    // Both are only hints; the kernel may cap the buffer or not know GRO at all.
+    int buffer_size = RECEIVE_SOCKET_BUFFER;
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+    if (use_uring) {
+        batch->ring = malloc(sizeof(PPCB_uring));
+        ASSERT_MALLOC(batch->ring);
+
+        if (uring_init(batch->ring, socket_fd)) {
+            return;
+        }
+
+        sys_error("io_uring unavailable, using recvmmsg");
+        free(batch->ring);
+        batch->ring = NULL;
+    }
+
+    batch->buffers = malloc((size_t) BATCH_SIZE * RECEIVE_BUFFER_SIZE);
+    ASSERT_MALLOC(batch->buffers);
+
+    int enable = 1;
+    batch->gro = setsockopt(socket_fd, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == 0;
+
+    // A GRO train carries the stamp of its first segment.
+    if (timestamp_used()) {
+        batch->timestamps = timestamp_receive(socket_fd);
+    }
+}
+
+// Segment size of a received GRO train, or the whole length for a plain datagram.
+static size_t gro_segment_size(
+        struct msghdr   *message,
+        size_t          length
+) {
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(message); header != NULL;
+         header = CMSG_NXTHDR(message, header)) {
+        if (header->cmsg_level == SOL_UDP && header->cmsg_type == UDP_GRO) {
+            int segment_size;
+            memcpy(&segment_size, CMSG_DATA(header), sizeof(segment_size));
+            if (segment_size > 0) {
+                return (size_t) segment_size;
+            }
+        }
+    }
+
+    return length;
+}
+
+// Waits for the socket with poll rather than SO_RCVTIMEO, so a changing timeout
+// costs no setsockopt. Returns the number of datagrams, 0 on timeout, -1 on error.
+static int receive_batch_fill(
+        PPCB_receive_batch  *batch,
+        uint64_t            timeout
+) {
+    TRACE_SPAN("receive_batch_fill", 0);
+
+    bool control = batch->gro || batch->timestamps;
+
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        batch->vectors[i] = (struct iovec) {
+            .iov_base = batch->buffers + (size_t) i * RECEIVE_BUFFER_SIZE,
+            .iov_len = RECEIVE_BUFFER_SIZE
+        };
+        batch->messages[i] = (struct mmsghdr) {
+            .msg_hdr = {
+                .msg_name               = &batch->addresses[i],
+                .msg_namelen            = sizeof(batch->addresses[i]),
+                .msg_iov                = &batch->vectors[i],
+                .msg_iovlen             = 1,
+                .msg_control            = control ? batch->controls[i] : NULL,
+                .msg_controllen         = control ? sizeof(batch->controls[i]) : 0
+            }
+        };
+    }
+
+    uint64_t deadline = (timeout > 0) ? monotonic_usec() + timeout : 0;
+
+    for (;;) {
+        int count = recvmmsg(batch->socket_fd, batch->messages, BATCH_SIZE, MSG_DONTWAIT, NULL);
+        if (count > 0) {
+            TRACE_RESULT(count);
+            return count;
+        }
+        if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+
+        if (deadline > 0 && monotonic_usec() >= deadline) {
+            return 0;
+        }
+
+        uint64_t left = (deadline > 0) ? usec_until(deadline) : 0;
+        struct timespec wait = {
+            .tv_sec = left / USEC_PER_SEC,
+            .tv_nsec = (left % USEC_PER_SEC) * 1000
+        };
+        struct pollfd socket_poll = {.fd = batch->socket_fd, .events = POLLIN};
+
+        int ready = ppoll(&socket_poll, 1, (deadline > 0) ? &wait : NULL, NULL);
+        if (ready < 0 && errno != EINTR) {
+            return -1;
+        }
+        else if (ready == 0) {
+            return 0;
+        }
+    }
+}
+
+// Datagrams written out from the last batch are waited for, so its buffers can go back.
+static int receive_batch_fill_uring(
+        PPCB_receive_batch  *batch,
+        uint64_t            timeout
+) {
+    uring_drain_writes(batch->ring);
+    for (int i = 0; i < batch->count; i++) {
+        uring_recycle(batch->ring, batch->buffer_ids[i]);
+    }
+    batch->count = 0;
+
+    int received = uring_wait_received(batch->ring, timeout);
+    if (received <= 0) {
+        return received;
+    }
+
+    int count = 0;
+    size_t length;
+    char *datagram;
+    while (count < BATCH_SIZE &&
+           uring_take_received(batch->ring, &batch->addresses[count], &datagram, &length,
+                               &batch->buffer_ids[count])) {
+        batch->vectors[count].iov_base = datagram;
+        batch->messages[count] = (struct mmsghdr) {.msg_len = length};
+        count++;
+    }
+
+    return count;
+}
+
+ssize_t receive_batch_next(
+        PPCB_receive_batch  *batch,
+        struct sockaddr_in  *receive_address,
+        char                **datagram,
+        uint64_t            timeout
+) {
+    if (!receive_batch_pending(batch)) {
+        int count = (batch->ring != NULL) ? receive_batch_fill_uring(batch, timeout)
+                                          : receive_batch_fill(batch, timeout);
+        if (count <= 0) {
+            batch->count = 0;
+            batch->current = 0;
+            return count;
+        }
+
+        batch->count = count;
+        batch->current = 0;
+        batch->offset = 0;
+        for (int i = 0; i < count; i++) {
+            batch->segment_sizes[i] = gro_segment_size(&batch->messages[i].msg_hdr,
+                                                       batch->messages[i].msg_len);
+        }
+    }
+
+    int i = batch->current;
+    size_t length = min(batch->segment_sizes[i], batch->messages[i].msg_len - batch->offset);
+
+    *receive_address = batch->addresses[i];
+    *datagram = (char *) batch->vectors[i].iov_base + batch->offset;
+    batch->arrived_at = batch->timestamps ? timestamp_arrival(&batch->messages[i].msg_hdr) : 0;
+
+    batch->offset += length;
+    if (batch->offset >= batch->messages[i].msg_len) {
+        batch->current++;
+        batch->offset = 0;
+    }
+
+    return (ssize_t) length;
+}
+
+uint64_t receive_batch_arrival(
+        PPCB_receive_batch  *batch
+) {
+    return batch->arrived_at;
+}
+
+bool receive_batch_pending(
+        PPCB_receive_batch  *batch
+) {
+    return batch->current < batch->count;
+}
+
+void receive_batch_destroy(
+        PPCB_receive_batch  *batch
+) {
+    if (batch->ring != NULL) {
+        uring_drain_writes(batch->ring);
+        uring_destroy(batch->ring);
+        free(batch->ring);
+    }
+    free(batch->buffers);
+}
@@ -0,0 +1,726 @@
+#include <sys/types.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "ppcb-common.h"
+#include "ppcb-rtt.h"
+#include "err.h"
+
+// Sweep run when no other is given; -n takes the sizes up to several GiB.
+#define DEFAULT_PROTOCOLS "tcp,udp,udpr"
+#define DEFAULT_SIZES "1,64K,16M,1G"
+#define DEFAULT_PAYLOADS "1400,64000,1M"
+#define DEFAULT_RUNS 3
+// Percent by which a median may get worse than the baseline before it counts as a regression.
+#define DEFAULT_THRESHOLD 10.0
+// How long the server is given to bind its port, in microseconds.
+#define SERVER_START_USEC (2 * USEC_PER_SEC)
+#define MAX_CONFIGURATIONS 1024
+#define MAX_RUNS 100
+
+/// RESULTS ///
+
+typedef struct {
+    char        protocol[8];
+    uint64_t    size;
+    uint32_t    payload_size;
+    int         run;
+    int         status;             // Exit status of the client, 0 for a complete transfer.
+    uint64_t    wall_usec;          // From starting the client until it exits.
+    double      throughput;         // MiB/s.
+    uint64_t    client_cpu_usec;    // User and system time.
+    uint64_t    server_cpu_usec;
+    int64_t     client_syscalls;    // -1 when not counted.
+    int64_t     server_syscalls;
+    long        client_rss_kib;     // Peak resident set size.
+    long        server_rss_kib;
+} PPCB_bench_result;
+
+static const char *const result_header =
+    "protocol\tsize\tpayload_size\trun\tstatus\twall_usec\tthroughput_mibps\t"
+    "client_cpu_usec\tserver_cpu_usec\tclient_syscalls\tserver_syscalls\t"
+    "client_rss_kib\tserver_rss_kib";
+
+static void print_result(
+        FILE                        *stream,
+        const PPCB_bench_result     *result
+) {
+    fprintf(stream, "%s\t%" PRIu64 "\t%" PRIu32 "\t%d\t%d\t%" PRIu64 "\t%.2f\t%" PRIu64 "\t%"
+            PRIu64 "\t%" PRId64 "\t%" PRId64 "\t%ld\t%ld\n",
+            result->protocol, result->size, result->payload_size, result->run, result->status,
+            result->wall_usec, result->throughput, result->client_cpu_usec,
+            result->server_cpu_usec, result->client_syscalls, result->server_syscalls,
+            result->client_rss_kib, result->server_rss_kib);
+}
+
+static bool parse_result(
+        const char          *line,
+        PPCB_bench_result   *result
+) {
+    return sscanf(line, "%7s\t%" SCNu64 "\t%" SCNu32 "\t%d\t%d\t%" SCNu64 "\t%lf\t%" SCNu64 "\t%"
+                  SCNu64 "\t%" SCNd64 "\t%" SCNd64 "\t%ld\t%ld",
+                  result->protocol, &result->size, &result->payload_size, &result->run,
+                  &result->status, &result->wall_usec, &result->throughput,
+                  &result->client_cpu_usec, &result->server_cpu_usec, &result->client_syscalls,
+                  &result->server_syscalls, &result->client_rss_kib,
+                  &result->server_rss_kib) == 13;
+}
+
+/// ARGUMENTS ///
+
+// Parses a size with an optional binary suffix (K, M or G).
+static uint64_t parse_size(
+        const char  *string
+) {
+    char *endptr;
+    errno = 0;
+    uint64_t value = strtoull(string, &endptr, 10);
+    int shift = 0;
+
+    if (*endptr == 'K' || *endptr == 'k') {
+        shift = 10;
+    } else if (*endptr == 'M' || *endptr == 'm') {
+        shift = 20;
+    } else if (*endptr == 'G' || *endptr == 'g') {
+        shift = 30;
+    }
+    if (shift > 0) {
+        endptr++;
+    }
+
+    if (errno != 0 || endptr == string || *endptr != 0 || value == 0 ||
+        value > (UINT64_MAX >> shift)) {
+        fatal("%s is not a valid size", string);
+    }
+    return value << shift;
+}
+
+// Splits a comma-separated list of sizes. Returns how many there are.
+static size_t parse_sizes(
+        const char  *list,
+        uint64_t    *sizes,
+        size_t      capacity
+) {
+    char *copy = strdup(list);
+    ASSERT_MALLOC(copy);
+
+    size_t count = 0;
+    for (char *item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+        if (count == capacity) {
+            fatal("too many sizes in %s", list);
+        }
+        sizes[count++] = parse_size(item);
+    }
+
+    free(copy);
+    return count;
+}
+
+/// PROCESSES ///
+
+static uint64_t cpu_usec(
+        const struct rusage     *usage
+) {
+    return (uint64_t) (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * USEC_PER_SEC +
+           (uint64_t) (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec);
+}
+
+// Starts a program with its output discarded. A traced one stops before exec, so the tracer
+// sees every system call it makes.
+static pid_t spawn(
+        char *const     argv[],
+        bool            traced
+) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        sys_fatal("fork");
+    }
+
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd < 0 || dup2(null_fd, STDIN_FILENO) < 0 || dup2(null_fd, STDOUT_FILENO) < 0 ||
+            dup2(null_fd, STDERR_FILENO) < 0) {
+            _exit(127);
+        }
+        if (traced && (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0 || raise(SIGSTOP) != 0)) {
+            _exit(127);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    if (traced) {
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+            fatal("cannot trace %s", argv[0]);
+        }
+        long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC |
+                       PTRACE_O_EXITKILL;
+        if (ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *) options) < 0 ||
+            ptrace(PTRACE_SYSCALL, pid, NULL, NULL) < 0) {
+            sys_fatal("ptrace");
+        }
+    }
+
+    return pid;
+}
+
+// Whether something listens on the TCP port, or is bound to the UDP one, as /proc/net tells.
+// Binding the port ourselves to find out could take it from the server.
+static bool port_bound(
+        bool        tcp,
+        uint16_t    port
+) {
+    FILE *table = fopen(tcp ? "/proc/net/tcp" : "/proc/net/udp", "r");
+    if (table == NULL) {
+        sys_fatal("cannot read the socket table");
+    }
+
+    char line[512];
+    bool bound = false;
+    while (!bound && fgets(line, sizeof(line), table) != NULL) {
+        unsigned local_port, state;
+        if (sscanf(line, " %*d: %*x:%x %*x:%*x %x", &local_port, &state) == 2) {
+            bound = local_port == port && (!tcp || state == 0x0A); // TCP_LISTEN
+        }
+    }
+
+    fclose(table);
+    return bound;
+}
+
+// A port nobody uses right now, as picked by the kernel.
+static uint16_t free_port(void) {
+    int socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t length = sizeof(address);
+
+    if (socket_fd < 0 || bind(socket_fd, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+        getsockname(socket_fd, (struct sockaddr *) &address, &length) < 0) {
+        sys_fatal("cannot find a free port");
+    }
+
+    close(socket_fd);
+    return ntohs(address.sin_port);
+}
+
+/// SYSTEM CALL COUNTING ///
+
+// Threads of the traced client and server, each counted for its process.
+typedef struct {
+    pid_t       tid;
+    int         owner;
+} PPCB_tracee;
+
+typedef struct {
+    PPCB_tracee     *tracees;
+    size_t          count;
+    size_t          capacity;
+    pid_t           leaders[2];
+    int64_t         stops[2];   // Syscall stops, one on entry and one on exit of each call.
+    bool            exited[2];
+} PPCB_tracer;
+
+enum { CLIENT = 0, SERVER = 1 };
+
+static void tracer_add(
+        PPCB_tracer     *tracer,
+        pid_t           tid,
+        int             owner
+) {
+    if (tracer->count == tracer->capacity) {
+        tracer->capacity = (tracer->capacity == 0) ? 8 : 2 * tracer->capacity;
+        tracer->tracees = realloc(tracer->tracees, tracer->capacity * sizeof(PPCB_tracee));
+        ASSERT_MALLOC(tracer->tracees);
+    }
+    tracer->tracees[tracer->count++] = (PPCB_tracee) {.tid = tid, .owner = owner};
+}
+
+static int tracer_owner(
+        PPCB_tracer     *tracer,
+        pid_t           tid
+) {
+    for (size_t i = 0; i < tracer->count; i++) {
+        if (tracer->tracees[i].tid == tid) {
+            return tracer->tracees[i].owner;
+        }
+    }
+    return -1;
+}
+
+// Handles one event of a tracee and lets it go on. Returns false when there was none to
+// handle without blocking (with WNOHANG).
+static bool tracer_step(
+        PPCB_tracer     *tracer,
+        int             flags
+) {
+    int status;
+    pid_t tid = waitpid(-1, &status, __WALL | flags);
+    if (tid < 0) {
+        sys_fatal("waitpid");
+    }
+    if (tid == 0) {
+        return false;
+    }
+
+    int owner = tracer_owner(tracer, tid);
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        for (int i = CLIENT; i <= SERVER; i++) {
+            if (tid == tracer->leaders[i]) {
+                tracer->exited[i] = true;
+            }
+        }
+        return true;
+    }
+
+    int signal = 0;
+    int event = status >> 16;
+    if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+        if (owner >= 0) {
+            tracer->stops[owner]++;
+        }
+    }
+    else if (event == PTRACE_EVENT_CLONE) {
+        unsigned long new_tid;
+        ptrace(PTRACE_GETEVENTMSG, tid, NULL, &new_tid);
+        tracer_add(tracer, (pid_t) new_tid, owner);
+    }
+    else if (event == 0 && WSTOPSIG(status) != SIGSTOP) {
+        signal = WSTOPSIG(status); // A real signal, which is delivered.
+    }
+
+    ptrace(PTRACE_SYSCALL, tid, NULL, (void *) (long) signal);
+    return true;
+}
+
+/// RUNS ///
+
+typedef struct {
+    char        client_path[PATH_MAX];
+    char        server_path[PATH_MAX];
+    const char  *window;    // For udpr, NULL for the client's default.
+    bool        event_driven;
+} PPCB_bench_setup;
+
+typedef struct {
+    int             status;
+    uint64_t        wall_usec;
+    struct rusage   client_usage;
+    struct rusage   server_usage;
+    int64_t         syscalls[2];
+} PPCB_run;
+
+// Starts the server, and once it is bound, the client; the server is stopped after the client
+// is done. With tracing the run is slowed down, so only the system calls count.
+static void run_transfer(
+        const PPCB_bench_setup  *setup,
+        const char              *protocol,
+        const char              *input_path,
+        uint32_t                payload_size,
+        bool                    traced,
+        PPCB_run                *run
+) {
+    bool tcp = strcmp(protocol, "tcp") == 0;
+    char port[8], payload[16];
+    snprintf(port, sizeof(port), "%" PRIu16, free_port());
+    snprintf(payload, sizeof(payload), "%" PRIu32, payload_size);
+
+    char *server_argv[5], *client_argv[12];
+    size_t argc = 0;
+    server_argv[argc++] = (char *) setup->server_path;
+    if (setup->event_driven) {
+        server_argv[argc++] = "-e";
+    }
+    server_argv[argc++] = tcp ? "tcp" : "udp";
+    server_argv[argc++] = port;
+    server_argv[argc] = NULL;
+
+    argc = 0;
+    client_argv[argc++] = (char *) setup->client_path;
+    client_argv[argc++] = "-s";
+    client_argv[argc++] = payload;
+    if (setup->window != NULL && strcmp(protocol, "udpr") == 0) {
+        client_argv[argc++] = "-w";
+        client_argv[argc++] = (char *) setup->window;
+    }
+    client_argv[argc++] = (char *) protocol;
+    client_argv[argc++] = "127.0.0.1";
+    client_argv[argc++] = port;
+    client_argv[argc++] = (char *) input_path;
+    client_argv[argc] = NULL;
+
+    PPCB_tracer tracer = {0};
+    *run = (PPCB_run) {.syscalls = {-1, -1}};
+
+    pid_t server = spawn(server_argv, traced);
+    tracer.leaders[SERVER] = server;
+    tracer_add(&tracer, server, SERVER);
+
+    uint64_t deadline = monotonic_usec() + SERVER_START_USEC;
+    while (!port_bound(tcp, (uint16_t) atoi(port))) {
+        if (monotonic_usec() > deadline) {
+            kill(server, SIGKILL);
+            fatal("%s didn't bind port %s", setup->server_path, port);
+        }
+        // A traced server only gets on while its stops are handled.
+        if (!traced || !tracer_step(&tracer, WNOHANG)) {
+            usleep(1000);
+        }
+    }
+
+    uint64_t started_at = monotonic_usec();
+    pid_t client = spawn(client_argv, traced);
+    tracer.leaders[CLIENT] = client;
+    tracer_add(&tracer, client, CLIENT);
+
+    if (traced) {
+        while (!tracer.exited[CLIENT]) {
+            tracer_step(&tracer, 0);
+        }
+        run->wall_usec = monotonic_usec() - started_at;
+        kill(server, SIGTERM);
+        while (!tracer.exited[SERVER]) {
+            tracer_step(&tracer, 0);
+        }
+
+        run->syscalls[CLIENT] = tracer.stops[CLIENT] / 2;
+        run->syscalls[SERVER] = tracer.stops[SERVER] / 2;
+        free(tracer.tracees);
+        return;
+    }
+
+    int status;
+    if (wait4(client, &status, 0, &run->client_usage) < 0) {
+        sys_fatal("wait4");
+    }
+    run->wall_usec = monotonic_usec() - started_at;
+    run->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    kill(server, SIGTERM);
+    if (wait4(server, &status, 0, &run->server_usage) < 0) {
+        sys_fatal("wait4");
+    }
+    free(tracer.tracees);
+}
+
+// An input of the given size whose pages cost nothing to create: a sparse file in $TMPDIR.
+static int create_input(
+        uint64_t    size,
+        char        *path,
+        size_t      path_size
+) {
+    const char *directory = getenv("TMPDIR");
+    snprintf(path, path_size, "%s/ppcb-bench-XXXXXX", (directory != NULL) ? directory : "/tmp");
+
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        sys_fatal("mkstemp %s", path);
+    }
+    if (ftruncate(fd, (off_t) size) < 0) {
+        sys_fatal("ftruncate %s", path);
+    }
+    return fd;
+}
+
+/// BASELINE ///
+
+static int compare_doubles(
+        const void  *lhs,
+        const void  *rhs
+) {
+    double a = *(const double *) lhs, b = *(const double *) rhs;
+    return (a > b) - (a < b);
+}
+
+static bool same_configuration(
+        const PPCB_bench_result     *lhs,
+        const PPCB_bench_result     *rhs
+) {
+    return strcmp(lhs->protocol, rhs->protocol) == 0 && lhs->size == rhs->size &&
+           lhs->payload_size == rhs->payload_size;
+}
+
+// Medians of a configuration over its complete runs. Returns false when there is none.
+static bool configuration_medians(
+        const PPCB_bench_result     *results,
+        size_t                      count,
+        const PPCB_bench_result     *configuration,
+        double                      *throughput,
+        double                      *cpu,
+        double                      *syscalls
+) {
+    static double values[3][MAX_RUNS * MAX_CONFIGURATIONS];
+    size_t runs = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (results[i].status != 0 || !same_configuration(&results[i], configuration) ||
+            runs == MAX_RUNS * MAX_CONFIGURATIONS) {
+            continue;
+        }
+        values[0][runs] = results[i].throughput;
+        values[1][runs] = (double) (results[i].client_cpu_usec + results[i].server_cpu_usec);
+        values[2][runs] = (double) (results[i].client_syscalls + results[i].server_syscalls);
+        runs++;
+    }
+    if (runs == 0) {
+        return false;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        qsort(values[i], runs, sizeof(double), compare_doubles);
+    }
+    *throughput = values[0][runs / 2];
+    *cpu = values[1][runs / 2];
+    *syscalls = values[2][runs / 2];
+    return true;
+}
+
+static size_t read_baseline(
+        const char          *path,
+        PPCB_bench_result   **results
+) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        sys_fatal("%s", path);
+    }
+
+    size_t count = 0, capacity = 64;
+    *results = malloc(capacity * sizeof(PPCB_bench_result));
+    ASSERT_MALLOC(*results);
+
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        PPCB_bench_result result;
+        if (!parse_result(line, &result)) {
+            continue; // The header, or something else than a result.
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            *results = realloc(*results, capacity * sizeof(PPCB_bench_result));
+            ASSERT_MALLOC(*results);
+        }
+        (*results)[count++] = result;
+    }
+
+    fclose(file);
+    return count;
+}
+
+// Reports every configuration whose median throughput fell, or whose median CPU time or
+// system call count grew, by more than threshold percent. Returns the number reported.
+static size_t compare_with_baseline(
+        const PPCB_bench_result     *results,
+        size_t                      count,
+        const PPCB_bench_result     *baseline,
+        size_t                      baseline_count,
+        double                      threshold
+) {
+    size_t regressions = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (results[i].run != 0) {
+            continue; // Each configuration once.
+        }
+
+        double throughput, cpu, syscalls, base_throughput, base_cpu, base_syscalls;
+        if (!configuration_medians(results, count, &results[i], &throughput, &cpu, &syscalls) ||
+            !configuration_medians(baseline, baseline_count, &results[i], &base_throughput,
+                                   &base_cpu, &base_syscalls)) {
+            continue;
+        }
+
+        struct {
+            const char  *name;
+            double      change;     // In percent; positive is worse.
+            double      from, to;
+        } metrics[] = {
+            {"throughput_mibps", 100.0 * (base_throughput - throughput) / base_throughput,
+             base_throughput, throughput},
+            {"cpu_usec", (base_cpu > 0) ? 100.0 * (cpu - base_cpu) / base_cpu : 0, base_cpu, cpu},
+            {"syscalls", (base_syscalls > 0 && syscalls >= 0)
+                         ? 100.0 * (syscalls - base_syscalls) / base_syscalls : 0,
+             base_syscalls, syscalls}
+        };
+
+        for (size_t j = 0; j < sizeof(metrics) / sizeof(metrics[0]); j++) {
+            if (metrics[j].change > threshold) {
+                fprintf(stderr, "REGRESSION %s size=%" PRIu64 " payload_size=%" PRIu32
+                        " %s: %.2f -> %.2f (%.1f%% worse)\n",
+                        results[i].protocol, results[i].size, results[i].payload_size,
+                        metrics[j].name, metrics[j].from, metrics[j].to, metrics[j].change);
+                regressions++;
+            }
+        }
+    }
+
+    return regressions;
+}
+
+/// MAIN ///
+
+static void usage(char const *program) {
+    fatal("usage: %s [-p protocols] [-n sizes] [-s payload_sizes] [-w window] [-r runs] [-e] "
+          "[-N] [-b baseline [-t percent]]\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    const char *protocols = DEFAULT_PROTOCOLS;
+    const char *size_list = DEFAULT_SIZES, *payload_list = DEFAULT_PAYLOADS;
+    const char *baseline_path = NULL;
+    int runs = DEFAULT_RUNS;
+    double threshold = DEFAULT_THRESHOLD;
+    bool count_syscalls = true;
+    PPCB_bench_setup setup = {.window = NULL, .event_driven = false};
+
+    int option;
+    while ((option = getopt(argc, argv, "p:n:s:w:r:eNb:t:")) != -1) {
+        if (option == 'p') {
+            protocols = optarg;
+        } else if (option == 'n') {
+            size_list = optarg;
+        } else if (option == 's') {
+            payload_list = optarg;
+        } else if (option == 'w') {
+            setup.window = optarg;
+        } else if (option == 'r') {
+            runs = atoi(optarg);
+            if (runs < 1 || runs > MAX_RUNS) {
+                fatal("%s is not a valid number of runs", optarg);
+            }
+        } else if (option == 'e') {
+            setup.event_driven = true;
+        } else if (option == 'N') {
+            count_syscalls = false;
+        } else if (option == 'b') {
+            baseline_path = optarg;
+        } else if (option == 't') {
+            threshold = atof(optarg);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+
+    // The programs under test are the ones built next to this one.
+    char directory[PATH_MAX - sizeof("/ppcbc")];
+    ssize_t length = readlink("/proc/self/exe", directory, sizeof(directory) - 1);
+    if (length < 0) {
+        sys_fatal("readlink");
+    }
+    directory[length] = 0;
+    *strrchr(directory, '/') = 0;
+    snprintf(setup.client_path, sizeof(setup.client_path), "%s/ppcbc", directory);
+    snprintf(setup.server_path, sizeof(setup.server_path), "%s/ppcbs", directory);
+
+    uint64_t sizes[64], payload_sizes[64];
+    size_t size_count = parse_sizes(size_list, sizes, 64);
+    size_t payload_count = parse_sizes(payload_list, payload_sizes, 64);
+
+    PPCB_bench_result *results = malloc(MAX_CONFIGURATIONS * MAX_RUNS * sizeof(PPCB_bench_result));
+    ASSERT_MALLOC(results);
+    size_t result_count = 0;
+
+    printf("%s\n", result_header);
+    fflush(stdout);
+
+    char *protocol_copy = strdup(protocols);
+    ASSERT_MALLOC(protocol_copy);
+    char *save;
+    size_t configurations = 0;
+
+    for (char *protocol = strtok_r(protocol_copy, ",", &save); protocol != NULL;
+         protocol = strtok_r(NULL, ",", &save)) {
+        if (strcmp(protocol, "tcp") != 0 && strcmp(protocol, "udp") != 0 &&
+            strcmp(protocol, "udpr") != 0) {
+            fatal("inappropriate protocol: %s", protocol);
+        }
+        uint64_t max_payload = (strcmp(protocol, "tcp") == 0) ? MAX_TCP_PAYLOAD : MAX_PACKET_SIZE;
+
+        for (size_t i = 0; i < size_count; i++) {
+            char input_path[PATH_MAX];
+            int input_fd = create_input(sizes[i], input_path, sizeof(input_path));
+
+            for (size_t j = 0; j < payload_count; j++) {
+                // A payload size beyond what the protocol carries adds nothing to the sweep,
+                // nor does one after a smaller size which already took the input whole.
+                if (payload_sizes[j] > max_payload ||
+                    (j > 0 && payload_sizes[j - 1] >= sizes[i])) {
+                    continue;
+                }
+                if (++configurations > MAX_CONFIGURATIONS) {
+                    fatal("too many configurations");
+                }
+
+                int64_t syscalls[2] = {-1, -1};
+                if (count_syscalls) {
+                    PPCB_run traced;
+                    run_transfer(&setup, protocol, input_path, (uint32_t) payload_sizes[j],
+                                 true, &traced);
+                    syscalls[CLIENT] = traced.syscalls[CLIENT];
+                    syscalls[SERVER] = traced.syscalls[SERVER];
+                }
+
+                for (int run_index = 0; run_index < runs; run_index++) {
+                    PPCB_run run;
+                    run_transfer(&setup, protocol, input_path, (uint32_t) payload_sizes[j],
+                                 false, &run);
+
+                    PPCB_bench_result *result = &results[result_count++];
+                    *result = (PPCB_bench_result) {
+                        .size                   = sizes[i],
+                        .payload_size           = (uint32_t) payload_sizes[j],
+                        .run                    = run_index,
+                        .status                 = run.status,
+                        .wall_usec              = run.wall_usec,
+                        .throughput             = (double) sizes[i] / (1 << 20) /
+                                                  ((double) run.wall_usec / USEC_PER_SEC),
+                        .client_cpu_usec        = cpu_usec(&run.client_usage),
+                        .server_cpu_usec        = cpu_usec(&run.server_usage),
+                        .client_syscalls        = syscalls[CLIENT],
+                        .server_syscalls        = syscalls[SERVER],
+                        .client_rss_kib         = run.client_usage.ru_maxrss,
+                        .server_rss_kib         = run.server_usage.ru_maxrss
+                    };
+                    snprintf(result->protocol, sizeof(result->protocol), "%s", protocol);
+
+                    print_result(stdout, result);
+                    fflush(stdout);
+                }
+            }
+
+            close(input_fd);
+            unlink(input_path);
+        }
+    }
+    free(protocol_copy);
+
+    size_t regressions = 0;
+    if (baseline_path != NULL) {
+        PPCB_bench_result *baseline;
+        size_t baseline_count = read_baseline(baseline_path, &baseline);
+        regressions = compare_with_baseline(results, result_count, baseline, baseline_count,
+                                            threshold);
+        fprintf(stderr, "%zu regression%s against %s\n", regressions,
+                (regressions == 1) ? "" : "s", baseline_path);
+        free(baseline);
+    }
+
+    free(results);
+    return (regressions > 0) ? 1 : 0;
+}
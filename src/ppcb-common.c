@@ -3,13 +3,22 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
 
 #include "ppcb-common.h"
+#include "ppcb-metrics.h"
+#include "ppcb-rtt.h"
+#include "ppcb-stats.h"
+#include "ppcb-timestamp.h"
+#include "ppcb-trace.h"
 #include "err.h"
 #include "protconst.h"
 
@@ -30,6 +39,54 @@ void set_CONN(
     };
 }
 
+void set_CONN_extension(
+        PPCB_CONN_extension     *extension,
+        uint16_t                window,
+        uint32_t                payload_size,
+        uint8_t                 flags
+) {
+    *extension = (PPCB_CONN_extension) {
+        .window                         = htobe16(window),
+        .payload_size                   = htobe32(payload_size),
+        .flags                          = flags
+    };
+}
+
+// Copies CONN (and its extension, if present) out of the buffer and converts to host order.
+// Without an extension the legacy values are filled in.
+bool read_CONN(
+        const char              *buffer,
+        size_t                  received_length,
+        PPCB_CONN_packet        *packet,
+        PPCB_CONN_extension     *extension,
+        bool                    *extended
+) {
+    if (received_length < sizeof(PPCB_CONN_packet)) {
+        return false;
+    }
+
+    memcpy(packet, buffer, sizeof(PPCB_CONN_packet));
+    packet->byte_sequence_length = be64toh(packet->byte_sequence_length);
+
+    *extended = (packet->protocol_id & PPCB_EXTENDED) != 0;
+    packet->protocol_id &= ~PPCB_EXTENDED;
+
+    if (!*extended) {
+        *extension = (PPCB_CONN_extension) {.window = 1, .payload_size = MAX_PACKET_SIZE, .flags = 0};
+        return received_length == sizeof(PPCB_CONN_packet);
+    }
+
+    if (received_length != sizeof(PPCB_CONN_packet) + sizeof(PPCB_CONN_extension)) {
+        return false;
+    }
+
+    memcpy(extension, buffer + sizeof(PPCB_CONN_packet), sizeof(PPCB_CONN_extension));
+    extension->window = be16toh(extension->window);
+    extension->payload_size = be32toh(extension->payload_size);
+
+    return true;
+}
+
 void set_RESPONSE(
         PPCB_RESPONSE_packet    *packet,
         uint8_t                 packet_id,
@@ -68,44 +125,152 @@ void set_PACKET_RESPONSE(
     };
 }
 
+void set_ACC_selective(
+        PPCB_ACC_selective  *selective,
+        uint64_t            first,
+        uint16_t            count
+) {
+    *selective = (PPCB_ACC_selective) {
+        .first                          = htobe64(first),
+        .count                          = htobe16(count)
+    };
+}
+
 /// SENDING UDP PACKETS ///
 
+ssize_t send_vector_udp(
+        int                 socket_fd,
+        struct sockaddr_in  server_address,
+        struct iovec        *vector,
+        size_t              vector_length
+) {
+    TRACE_SPAN("send_vector_udp", 0);
+
+    struct msghdr message = {
+        .msg_name                       = &server_address,
+        .msg_namelen                    = (socklen_t) sizeof(server_address),
+        .msg_iov                        = vector,
+        .msg_iovlen                     = vector_length
+    };
+
+    ssize_t sent_length = sendmsg(socket_fd, &message, 0);
+    if (sent_length > 0) {
+        stats_sent((size_t) sent_length, 1);
+    }
+    TRACE_RESULT(sent_length);
+    return sent_length;
+}
+
 ssize_t send_packet_udp(
         int                 socket_fd,
         struct sockaddr_in  server_address,
         size_t              data_length,
         void                *buffer
 ) {
-    int send_flags = 0;
-    socklen_t address_length = (socklen_t) sizeof(server_address);
-    return sendto(socket_fd, buffer, data_length, send_flags,
-                                    (struct sockaddr *) &server_address, address_length);
+    struct iovec vector = {.iov_base = buffer, .iov_len = data_length};
+    return send_vector_udp(socket_fd, server_address, &vector, 1);
+}
+
+ssize_t send_DATA_udp(
+        int                 socket_fd,
+        struct sockaddr_in  server_address,
+        uint64_t            session_id,
+        uint64_t            packet_number,
+        const char          *payload,
+        uint32_t            payload_length
+) {
+    PPCB_DATA_packet data_packet;
+    set_DATA(&data_packet, session_id, packet_number, payload_length);
+
+    struct iovec vector[] = {
+        {.iov_base = &data_packet, .iov_len = sizeof(PPCB_DATA_packet)},
+        {.iov_base = (void *) payload, .iov_len = payload_length}
+    };
+    return send_vector_udp(socket_fd, server_address, vector, 2);
 }
 
 ssize_t receive_packet_udp(
         int                   socket_fd,
         struct sockaddr_in    *receive_address,
         void                  *buffer,
-        bool                  connection_initialize
+        uint64_t              timeout
 ) {
-    // Set timeouts for the client socket.
-    struct timeval to = {.tv_sec = (connection_initialize ? 0 : MAX_WAIT), .tv_usec = 0};
-    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof to);
+    TRACE_SPAN("receive_packet_udp", 0);
 
-    size_t max_length = BUFFER_SIZE;
+    // A queued datagram is taken at once; only an empty socket is waited for, with a poll
+    // bounded by the deadline rather than an SO_RCVTIMEO set before every receive.
+    uint64_t deadline = (timeout > 0) ? monotonic_usec() + timeout : 0;
 
-    int receive_flags = 0;
-    socklen_t address_length = (socklen_t) sizeof(*receive_address);
-    ssize_t read_length = recvfrom(socket_fd, buffer, max_length, receive_flags,
+    for (;;) {
+        socklen_t address_length = (socklen_t) sizeof(*receive_address);
+        ssize_t read_length = recvfrom(socket_fd, buffer, BUFFER_SIZE, MSG_DONTWAIT,
                                        (struct sockaddr *) receive_address, &address_length);
+        if (read_length >= 0) {
+            stats_received((size_t) read_length, 1);
+            TRACE_RESULT(read_length);
+            return read_length;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
 
-    if (read_length < 0) {
-        if (errno != EAGAIN) {
+        if (deadline > 0 && monotonic_usec() >= deadline) {
+            return 0;
+        }
+
+        uint64_t left = (deadline > 0) ? usec_until(deadline) : 0;
+        struct timespec wait = {
+            .tv_sec = left / USEC_PER_SEC,
+            .tv_nsec = (left % USEC_PER_SEC) * 1000
+        };
+        struct pollfd socket_poll = {.fd = socket_fd, .events = POLLIN};
+
+        int ready = ppoll(&socket_poll, 1, (deadline > 0) ? &wait : NULL, NULL);
+        if (ready < 0 && errno != EINTR) {
             return -1;
         }
+        else if (ready == 0) {
+            return 0;
+        }
+
+        // Transmit stamps wake the poll up until they are taken from the error queue.
+        if ((socket_poll.revents & POLLERR) && timestamp_used()) {
+            timestamp_collect(socket_fd);
+        }
+    }
+}
+
+uint32_t path_payload_size_udp(
+        int                 socket_fd,
+        struct sockaddr_in  server_address,
+        bool                timestamps
+) {
+    int discover = IP_PMTUDISC_DO;
+    if (setsockopt(socket_fd, IPPROTO_IP, IP_MTU_DISCOVER, &discover, sizeof(discover)) < 0) {
+        return 0;
+    }
+
+    // The MTU of a path is only reported for a connected socket, so a separate one asks.
+    int probe_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (probe_fd < 0) {
+        return 0;
+    }
+
+    int mtu = 0;
+    socklen_t mtu_length = sizeof(mtu);
+    if (setsockopt(probe_fd, IPPROTO_IP, IP_MTU_DISCOVER, &discover, sizeof(discover)) < 0 ||
+        connect(probe_fd, (struct sockaddr *) &server_address, sizeof(server_address)) < 0 ||
+        getsockopt(probe_fd, IPPROTO_IP, IP_MTU, &mtu, &mtu_length) < 0) {
+        mtu = 0;
+    }
+    close(probe_fd);
+
+    size_t headers = sizeof(struct iphdr) + sizeof(struct udphdr) + sizeof(PPCB_DATA_packet) +
+                     (timestamps ? sizeof(PPCB_DATA_timestamp) : 0);
+    if ((size_t) mtu <= headers) {
         return 0;
     }
-    return read_length;
+    return (uint32_t) min((size_t) mtu - headers, (size_t) MAX_PACKET_SIZE);
 }
 
 void server_sends_RESPONSE_udp(
@@ -121,7 +286,14 @@ void server_sends_RESPONSE_udp(
 
     ssize_t sent_length = send_packet_udp(socket_fd, client_address,
                                           sizeof(PPCB_RESPONSE_packet), &data_response);
-    validate_send(sent_length, sizeof(PPCB_RESPONSE_packet), false, protocol, error_message);
+    if (validate_send(sent_length, sizeof(PPCB_RESPONSE_packet), false, protocol, error_message)) {
+        if (sending == PPCB_CONRJT) {
+            stats_rejected();
+            metrics_add(METRIC_CONN_REJECTED, 1);
+        } else {
+            stats_completed();
+        }
+    }
 }
 
 
@@ -136,7 +308,48 @@ void server_sends_RJT_udp(
     set_PACKET_RESPONSE(&reject_packet, PPCB_RJT, session_id, packet_number);
     ssize_t sent_length = send_packet_udp(socket_fd, client_address,
                                           sizeof(PPCB_PACKET_RESPONSE_packet),&reject_packet);
-    validate_send(sent_length, sizeof(PPCB_PACKET_RESPONSE_packet), false, protocol, "sending RJT");
+    if (validate_send(sent_length, sizeof(PPCB_PACKET_RESPONSE_packet), false, protocol,
+                      "sending RJT")) {
+        stats_rejected();
+        metrics_add(METRIC_RJT_SENT, 1);
+    }
+}
+
+void server_rejects_stranger(
+        int                 socket_fd,
+        struct sockaddr_in  address,
+        const char          *datagram,
+        uint64_t            packet_number,
+        PPCB_Protocol       protocol
+) {
+    uint8_t packet_id;
+    memcpy(&packet_id, datagram, sizeof(uint8_t));
+
+    // What goes to a stranger doesn't count toward the session being served.
+    PPCB_stats *session_stats = stats_attach(NULL);
+
+    if (packet_id == PPCB_CONN) {
+        server_sends_RESPONSE_udp(socket_fd, address, 0, protocol, PPCB_CONRJT);
+    }
+    else if (packet_id == PPCB_DATA) {
+        server_sends_RJT_udp(socket_fd, address, 0, packet_number, protocol);
+    }
+
+    stats_attach(session_stats);
+}
+
+uint16_t receive_window_udp(
+        int                 socket_fd,
+        uint32_t            payload_size
+) {
+    int buffer_size;
+    socklen_t option_length = sizeof(buffer_size);
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, &option_length) < 0) {
+        return 1;
+    }
+
+    size_t window = (size_t) buffer_size / (payload_size + sizeof(PPCB_DATA_packet));
+    return (uint16_t) ((window < 1) ? 1 : min(window, MAX_WINDOW));
 }
 
 /// COMPARE ADDRESS ///
@@ -156,11 +369,14 @@ bool validate_data_packet(
         uint64_t            session_id,
         uint64_t            packet_number,
         uint64_t            bytes_received,
-        uint64_t            byte_sequence_length
+        uint64_t            byte_sequence_length,
+        uint32_t            payload_size
 ) {
+    TRACE_SPAN("validate_data_packet", packet->packet_number);
+
     if (packet->session_id != session_id ||
         packet->packet_byte_sequence_length < 1 ||
-        packet->packet_byte_sequence_length > MAX_PACKET_SIZE) {
+        packet->packet_byte_sequence_length > payload_size) {
         return false;
     }
 
@@ -246,6 +462,9 @@ void validate_response_packet(
         uint64_t                expected_session_id
 ) {
     if (packet->id != expected_id) {
+        if (packet->id == PPCB_RJT || packet->id == PPCB_CONRJT) {
+            stats_rejected();
+        }
         fatal("incorrect packet id");
     }
     if (packet->session_id != expected_session_id) {
@@ -305,6 +524,8 @@ ssize_t readn(
         void      *vptr,
         size_t    n
 ) {
+    TRACE_SPAN("readn", n);
+
     ssize_t nleft, nread;
     char *ptr;
 
@@ -328,6 +549,8 @@ ssize_t writen(
         const void    *vptr,
         size_t        n
 ) {
+    TRACE_SPAN("writen", n);
+
     ssize_t nleft, nwritten;
     const char *ptr;
 
@@ -342,3 +565,69 @@ ssize_t writen(
     }
     return n;
 }
+
+// Skips n bytes of the vector: whole pieces are dropped, a partial one is shortened.
+static void advance_vector(
+        struct iovec    **vector,
+        int             *count,
+        size_t          n
+) {
+    while (*count > 0 && n >= (*vector)->iov_len) {
+        n -= (*vector)->iov_len;
+        (*vector)++;
+        (*count)--;
+    }
+    if (*count > 0) {
+        (*vector)->iov_base = (char *) (*vector)->iov_base + n;
+        (*vector)->iov_len -= n;
+    }
+}
+
+ssize_t writevn(
+        int             fd,
+        struct iovec    *vector,
+        int             count
+) {
+    TRACE_SPAN("writevn", count);
+
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += vector[i].iov_len;
+    }
+
+    size_t nleft = total;
+    while (nleft > 0) {
+        ssize_t nwritten = writev(fd, vector, count);
+        if (nwritten <= 0)
+            return nwritten;  // error
+
+        nleft -= nwritten;
+        advance_vector(&vector, &count, nwritten);
+    }
+    return total;
+}
+
+ssize_t pwritevn(
+        int             fd,
+        struct iovec    *vector,
+        int             count,
+        off_t           offset
+) {
+    TRACE_SPAN("pwritevn", count);
+
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += vector[i].iov_len;
+    }
+
+    size_t nleft = total;
+    while (nleft > 0) {
+        ssize_t nwritten = pwritev(fd, vector, count, offset + (off_t) (total - nleft));
+        if (nwritten <= 0)
+            return nwritten;  // error
+
+        nleft -= nwritten;
+        advance_vector(&vector, &count, nwritten);
+    }
+    return total;
+}
@@ -0,0 +1,106 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ppcb-histogram.h"
+#include "ppcb-common.h"
+
+
+/// BUCKETS ///
+
+#define SUB_BUCKETS (1 << (HISTOGRAM_SUB_BITS - 1))
+
+// Values below 2 * SUB_BUCKETS have a bucket each. Above, every power of two is split into
+// SUB_BUCKETS buckets, found from the leading bits of the value.
+static size_t bucket_of(
+        uint64_t    value
+) {
+    if (value >= (UINT64_C(1) << HISTOGRAM_MAX_BITS)) {
+        value = (UINT64_C(1) << HISTOGRAM_MAX_BITS) - 1;
+    }
+    if (value < 2 * SUB_BUCKETS) {
+        return (size_t) value;
+    }
+
+    int shift = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BITS - 1);
+    return ((size_t) shift << (HISTOGRAM_SUB_BITS - 1)) + (size_t) (value >> shift);
+}
+
+// The largest value which falls into bucket.
+static uint64_t bucket_end(
+        size_t      bucket
+) {
+    if (bucket < 2 * SUB_BUCKETS) {
+        return bucket;
+    }
+
+    int shift = (int) (bucket >> (HISTOGRAM_SUB_BITS - 1)) - 1;
+    uint64_t leading = bucket - ((size_t) shift << (HISTOGRAM_SUB_BITS - 1));
+    return ((leading + 1) << shift) - 1;
+}
+
+/// LATENCY HISTOGRAM ///
+
+void histogram_init(
+        PPCB_histogram  *histogram
+) {
+    memset(histogram, 0, sizeof(PPCB_histogram));
+}
+
+void histogram_record(
+        PPCB_histogram  *histogram,
+        uint64_t        value
+) {
+    histogram->buckets[bucket_of(value)]++;
+    histogram->min = (histogram->count == 0) ? value : min(histogram->min, value);
+    histogram->max = (value > histogram->max) ? value : histogram->max;
+    histogram->count++;
+}
+
+uint64_t histogram_percentile(
+        const PPCB_histogram    *histogram,
+        double                  percentile
+) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    // The rank of the value, counted from 1 and rounded up.
+    double exact_rank = percentile / 100 * (double) histogram->count;
+    uint64_t rank = (uint64_t) exact_rank;
+    rank += (rank == 0 || (double) rank < exact_rank) ? 1 : 0;
+
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += histogram->buckets[bucket];
+        if (seen >= rank) {
+            return min(bucket_end(bucket), histogram->max);
+        }
+    }
+
+    return histogram->max;
+}
+
+void histogram_print(
+        const PPCB_histogram    *histogram,
+        const char              *name,
+        FILE                    *stream
+) {
+    fprintf(stream, "%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+            name, histogram->count, histogram_percentile(histogram, 50),
+            histogram_percentile(histogram, 99), histogram_percentile(histogram, 99.9),
+            histogram->max);
+}
+
+int histogram_format(
+        const PPCB_histogram    *histogram,
+        char                    *buffer,
+        size_t                  size
+) {
+    return snprintf(buffer, size,
+                    "{\"samples\":%" PRIu64 ",\"p50\":%" PRIu64 ",\"p99\":%" PRIu64
+                    ",\"p99.9\":%" PRIu64 ",\"max\":%" PRIu64 "}",
+                    histogram->count, histogram_percentile(histogram, 50),
+                    histogram_percentile(histogram, 99), histogram_percentile(histogram, 99.9),
+                    histogram->max);
+}
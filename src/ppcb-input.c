@@ -0,0 +1,224 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ppcb-input.h"
+#include "ppcb-common.h"
+#include "err.h"
+
+
+/// MAPPING REGULAR FILES ///
+
+static bool map_byte_sequence(
+        PPCB_input  *input,
+        int         fd
+) {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0) {
+        sys_fatal("fstat");
+    }
+
+    // Whatever was already consumed from stdin is not part of the sequence.
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if (!S_ISREG(file_stat.st_mode) || start < 0 || file_stat.st_size <= start) {
+        return false;
+    }
+
+    size_t mapping_length = (size_t) file_stat.st_size;
+    char *mapping = mmap(NULL, mapping_length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    madvise(mapping, mapping_length, MADV_SEQUENTIAL);
+
+    *input = (PPCB_input) {
+        .data                           = mapping + start,
+        .length                         = (uint64_t) (file_stat.st_size - start),
+        .fd                             = fd,
+        .mapping                        = mapping,
+        .mapping_length                 = mapping_length,
+        .released                       = 0
+    };
+    return true;
+}
+
+/// SPOOLING PIPED INPUT ///
+
+static int create_spool_file(void) {
+    const char *directory = getenv("TMPDIR");
+    if (directory == NULL) {
+        directory = "/tmp";
+    }
+
+    int fd = open(directory, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd >= 0) {
+        return fd;
+    }
+
+    // File systems without O_TMPFILE: create a file and unlink it right away.
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/ppcbc-XXXXXX", directory);
+    if ((fd = mkstemp(path)) < 0) {
+        sys_fatal("cannot create a spool file in %s", directory);
+    }
+    unlink(path);
+
+    return fd;
+}
+
+// Reads fd until EOF. Returns the length; the bytes are either in *byte_sequence or, when
+// there were more than spool_threshold of them, in the file *spool_fd.
+static uint64_t read_byte_sequence(
+        int         fd,
+        uint64_t    spool_threshold,
+        char        **byte_sequence,
+        int         *spool_fd
+) {
+    uint64_t byte_sequence_length = 0, current_size = SEQUENCE_SIZE;
+
+    *spool_fd = -1;
+    *byte_sequence = (char *)malloc(current_size * sizeof(char));
+    ASSERT_MALLOC(*byte_sequence);
+
+    for (;;) {
+        // Spilled bytes don't stay in the buffer, which serves as a read block from then on.
+        uint64_t buffered = (*spool_fd < 0) ? byte_sequence_length : 0;
+
+        if (buffered == current_size) {
+            current_size *= 2;
+
+            *byte_sequence = realloc(*byte_sequence, current_size);
+            ASSERT_MALLOC(*byte_sequence);
+        }
+
+        ssize_t read_length = read(fd, *byte_sequence + buffered,
+                                   min(current_size - buffered, (uint64_t) SPOOL_BLOCK));
+        if (read_length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            sys_fatal("read");
+        }
+        if (read_length == 0) {
+            break; // EOF
+        }
+
+        byte_sequence_length += (uint64_t) read_length;
+
+        if (*spool_fd < 0 && byte_sequence_length <= spool_threshold) {
+            continue;
+        }
+
+        if (*spool_fd < 0) {
+            *spool_fd = create_spool_file();
+            read_length = (ssize_t) byte_sequence_length;
+        }
+
+        if (writen(*spool_fd, *byte_sequence, read_length) != read_length) {
+            sys_fatal("cannot write to the spool file");
+        }
+
+        if (current_size != SPOOL_BLOCK) {
+            current_size = SPOOL_BLOCK;
+            *byte_sequence = realloc(*byte_sequence, current_size);
+            ASSERT_MALLOC(*byte_sequence);
+        }
+    }
+
+    if (*spool_fd >= 0) {
+        free(*byte_sequence);
+        *byte_sequence = NULL;
+    }
+
+    return byte_sequence_length;
+}
+
+/// BYTE SEQUENCE ///
+
+void input_open(
+        PPCB_input  *input,
+        const char  *path,
+        uint64_t    spool_threshold
+) {
+    int fd = STDIN_FILENO;
+    if (path != NULL && (fd = open(path, O_RDONLY)) < 0) {
+        sys_fatal("cannot open %s", path);
+    }
+
+    if (map_byte_sequence(input, fd)) {
+        return;
+    }
+
+    char *byte_sequence;
+    int spool_fd;
+    uint64_t byte_sequence_length = read_byte_sequence(fd, spool_threshold, &byte_sequence,
+                                                       &spool_fd);
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+
+    if (spool_fd >= 0) {
+        if (lseek(spool_fd, 0, SEEK_SET) < 0) {
+            sys_fatal("lseek");
+        }
+        if (!map_byte_sequence(input, spool_fd)) {
+            sys_fatal("cannot map the spool file");
+        }
+        return;
+    }
+
+    *input = (PPCB_input) {
+        .data                           = byte_sequence,
+        .length                         = byte_sequence_length,
+        .fd                             = -1,
+        .mapping                        = NULL,
+        .mapping_length                 = 0,
+        .released                       = 0
+    };
+}
+
+void input_release(
+        PPCB_input  *input,
+        uint64_t    offset
+) {
+    if (input->mapping == NULL || offset < input->released + INPUT_RELEASE_CHUNK) {
+        return;
+    }
+
+    // Pages already sent are dropped, so that the resident set doesn't grow with the file.
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = (size_t) (input->data - input->mapping);
+    size_t from = (start + input->released) / page_size * page_size;
+    size_t to = (start + offset) / page_size * page_size;
+    madvise(input->mapping + from, to - from, MADV_DONTNEED);
+
+    // Ask for the next chunk ahead of time.
+    size_t ahead = min(input->mapping_length - to, (size_t) INPUT_RELEASE_CHUNK);
+    madvise(input->mapping + to, ahead, MADV_WILLNEED);
+
+    input->released = offset;
+}
+
+void input_close(
+        PPCB_input  *input
+) {
+    if (input->mapping != NULL) {
+        munmap(input->mapping, input->mapping_length);
+    }
+    else {
+        free(input->data);
+    }
+
+    if (input->fd > STDIN_FILENO) {
+        close(input->fd);
+    }
+}
@@ -0,0 +1,395 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ppcb-metrics.h"
+#include "ppcb-common.h"
+#include "ppcb-rtt.h"
+#include "err.h"
+
+
+/// SHARDS ///
+
+// Upper bounds of the session duration buckets, in microseconds; +Inf follows.
+static const uint64_t duration_bounds[] = {
+    1000, 10000, 100000, 1000000, 10000000, 60000000, 600000000
+};
+#define DURATION_BUCKETS (sizeof(duration_bounds) / sizeof(duration_bounds[0]) + 1)
+
+// Written only by its thread and read by the exporter; aligned so shards share no cache line.
+typedef struct {
+    _Alignas(64) _Atomic uint64_t   counters[METRIC_COUNTERS];
+    _Atomic int64_t                 backlog;
+    _Atomic uint64_t                duration_buckets[DURATION_BUCKETS];
+    _Atomic uint64_t                duration_sum_usec;
+} PPCB_metrics_shard;
+
+static PPCB_metrics_shard *shards[METRICS_MAX_SHARDS];
+static _Atomic size_t shard_count = 0;
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set by metrics_serve before any worker starts, read-only afterwards.
+static bool serving = false;
+
+static __thread PPCB_metrics_shard *shard = NULL;
+
+void metrics_register_thread(void) {
+    if (!serving || shard != NULL) {
+        return;
+    }
+
+    PPCB_metrics_shard *new_shard = aligned_alloc(_Alignof(PPCB_metrics_shard),
+                                                  sizeof(PPCB_metrics_shard));
+    ASSERT_MALLOC(new_shard);
+    memset(new_shard, 0, sizeof(PPCB_metrics_shard));
+
+    pthread_mutex_lock(&shard_lock);
+    size_t index = atomic_load_explicit(&shard_count, memory_order_relaxed);
+    if (index < METRICS_MAX_SHARDS) {
+        shards[index] = new_shard;
+        atomic_store_explicit(&shard_count, index + 1, memory_order_release);
+        shard = new_shard;
+    }
+    pthread_mutex_unlock(&shard_lock);
+
+    if (shard != new_shard) {
+        free(new_shard);
+    }
+}
+
+// Only the owner writes a shard, so no atomic read-modify-write is needed.
+static void shard_add(
+        _Atomic uint64_t    *value,
+        uint64_t            delta
+) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+void metrics_add(
+        PPCB_metric     metric,
+        uint64_t        value
+) {
+    if (shard != NULL) {
+        shard_add(&shard->counters[metric], value);
+    }
+}
+
+void metrics_backlog(
+        int64_t         delta
+) {
+    if (shard != NULL) {
+        atomic_store_explicit(&shard->backlog,
+                              atomic_load_explicit(&shard->backlog, memory_order_relaxed) + delta,
+                              memory_order_relaxed);
+    }
+}
+
+void metrics_session_closed(
+        uint64_t        duration_usec
+) {
+    if (shard == NULL) {
+        return;
+    }
+
+    size_t bucket = 0;
+    while (bucket < DURATION_BUCKETS - 1 && duration_usec > duration_bounds[bucket]) {
+        bucket++;
+    }
+
+    shard_add(&shard->duration_buckets[bucket], 1);
+    shard_add(&shard->duration_sum_usec, duration_usec);
+    shard_add(&shard->counters[METRIC_SESSIONS_CLOSED], 1);
+}
+
+/// EXPORTER ///
+
+// The shards summed up at one moment.
+typedef struct {
+    uint64_t    at;
+    uint64_t    counters[METRIC_COUNTERS];
+    int64_t     backlog;
+    uint64_t    duration_buckets[DURATION_BUCKETS];
+    uint64_t    duration_sum_usec;
+} PPCB_metrics_sample;
+
+static void metrics_sample(
+        PPCB_metrics_sample     *sample
+) {
+    memset(sample, 0, sizeof(*sample));
+    sample->at = monotonic_usec();
+
+    size_t count = atomic_load_explicit(&shard_count, memory_order_acquire);
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < METRIC_COUNTERS; j++) {
+            sample->counters[j] += atomic_load_explicit(&shards[i]->counters[j],
+                                                        memory_order_relaxed);
+        }
+        sample->backlog += atomic_load_explicit(&shards[i]->backlog, memory_order_relaxed);
+        for (size_t j = 0; j < DURATION_BUCKETS; j++) {
+            sample->duration_buckets[j] += atomic_load_explicit(&shards[i]->duration_buckets[j],
+                                                                memory_order_relaxed);
+        }
+        sample->duration_sum_usec += atomic_load_explicit(&shards[i]->duration_sum_usec,
+                                                          memory_order_relaxed);
+    }
+}
+
+typedef struct {
+    char        text[8192];
+    size_t      length;
+} PPCB_metrics_text;
+
+static void text_append(
+        PPCB_metrics_text   *text,
+        const char          *format,
+        ...
+) {
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(text->text + text->length, sizeof(text->text) - text->length,
+                           format, arguments);
+    va_end(arguments);
+
+    if (length > 0) {
+        text->length = min(text->length + (size_t) length, sizeof(text->text) - 1);
+    }
+}
+
+static void text_metric(
+        PPCB_metrics_text   *text,
+        const char          *name,
+        const char          *type,
+        const char          *help
+) {
+    text_append(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Rates over the last interval between samples, in bytes per second.
+typedef struct {
+    double      received;
+    double      sent;
+} PPCB_metrics_rates;
+
+static void metrics_rates(
+        PPCB_metrics_rates          *rates,
+        const PPCB_metrics_sample   *now,
+        const PPCB_metrics_sample   *previous
+) {
+    double interval = (double) (now->at - previous->at) / USEC_PER_SEC;
+    if (interval <= 0) {
+        return;
+    }
+
+    rates->received = (double) (now->counters[METRIC_BYTES_RECEIVED] -
+                                previous->counters[METRIC_BYTES_RECEIVED]) / interval;
+    rates->sent = (double) (now->counters[METRIC_BYTES_SENT] -
+                            previous->counters[METRIC_BYTES_SENT]) / interval;
+}
+
+static void metrics_render(
+        PPCB_metrics_text           *text,
+        const PPCB_metrics_sample   *sample,
+        const PPCB_metrics_rates    *rates
+) {
+    static const struct {
+        PPCB_metric     metric;
+        const char      *name;
+        const char      *help;
+    } counters[] = {
+        {METRIC_CONN_ACCEPTED, "ppcb_conn_accepted_total", "CONNs which opened a session."},
+        {METRIC_CONN_REJECTED, "ppcb_conn_rejected_total", "CONNs answered with CONRJT."},
+        {METRIC_BYTES_RECEIVED, "ppcb_received_bytes_total", "Bytes of packets received."},
+        {METRIC_BYTES_SENT, "ppcb_sent_bytes_total", "Bytes of packets sent."},
+        {METRIC_RJT_SENT, "ppcb_rjt_sent_total", "RJTs sent."},
+        {METRIC_TIMEOUTS, "ppcb_timeouts_total", "Waits for a client which expired."}
+    };
+
+    text->length = 0;
+
+    text_metric(text, "ppcb_sessions_active", "gauge", "Sessions being served.");
+    // The two counters are read one after the other, so a session may look closed first.
+    uint64_t accepted = sample->counters[METRIC_CONN_ACCEPTED];
+    uint64_t closed = sample->counters[METRIC_SESSIONS_CLOSED];
+    text_append(text, "ppcb_sessions_active %" PRIu64 "\n", (accepted > closed) ? accepted - closed : 0);
+
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        text_metric(text, counters[i].name, "counter", counters[i].help);
+        text_append(text, "%s %" PRIu64 "\n", counters[i].name,
+                    sample->counters[counters[i].metric]);
+    }
+
+    text_metric(text, "ppcb_received_bytes_per_second", "gauge",
+                "Bytes of packets received per second over the last interval.");
+    text_append(text, "ppcb_received_bytes_per_second %.0f\n", rates->received);
+    text_metric(text, "ppcb_sent_bytes_per_second", "gauge",
+                "Bytes of packets sent per second over the last interval.");
+    text_append(text, "ppcb_sent_bytes_per_second %.0f\n", rates->sent);
+
+    text_metric(text, "ppcb_output_backlog_bytes", "gauge",
+                "Bytes gathered or queued in the output stage, not written yet.");
+    text_append(text, "ppcb_output_backlog_bytes %" PRId64 "\n", sample->backlog);
+
+    text_metric(text, "ppcb_session_duration_seconds", "histogram", "Duration of sessions.");
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < DURATION_BUCKETS; i++) {
+        cumulative += sample->duration_buckets[i];
+        if (i < DURATION_BUCKETS - 1) {
+            text_append(text, "ppcb_session_duration_seconds_bucket{le=\"%g\"} %" PRIu64 "\n",
+                        (double) duration_bounds[i] / USEC_PER_SEC, cumulative);
+        } else {
+            text_append(text, "ppcb_session_duration_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n",
+                        cumulative);
+        }
+    }
+    text_append(text, "ppcb_session_duration_seconds_sum %.6f\n",
+                (double) sample->duration_sum_usec / USEC_PER_SEC);
+    text_append(text, "ppcb_session_duration_seconds_count %" PRIu64 "\n", cumulative);
+}
+
+// Replaces the file at once, so a reader never sees half of it.
+static void metrics_rewrite(
+        const char                  *path,
+        const PPCB_metrics_text     *text
+) {
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        sys_error("open %s", temporary);
+        return;
+    }
+    if (writen(fd, text->text, text->length) != (ssize_t) text->length) {
+        sys_error("write %s", temporary);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    if (rename(temporary, path) < 0) {
+        sys_error("rename %s", temporary);
+    }
+}
+
+static int metrics_listen(
+        const char  *path
+) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fatal("%s is too long for a UNIX socket", path);
+    }
+    strcpy(address.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        sys_fatal("socket");
+    }
+
+    // A socket left behind by an earlier server is replaced.
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+        listen(listen_fd, METRICS_QUEUE_LENGTH) < 0) {
+        sys_fatal("bind %s", path);
+    }
+
+    return listen_fd;
+}
+
+// Answers one scraper with the current text; a slow one is given up on after a second.
+static void metrics_answer(
+        int                         listen_fd,
+        const PPCB_metrics_text     *text
+) {
+    int client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client_fd < 0) {
+        return;
+    }
+
+    struct timeval timeout = {.tv_sec = 1, .tv_usec = 0};
+    setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    writen(client_fd, text->text, text->length);
+    close(client_fd);
+}
+
+// Set by metrics_serve for the exporter: the file to rewrite, or the socket to serve.
+static const char *export_path = NULL;
+static int export_fd = -1;
+
+static void *metrics_export(
+        void    *argument
+) {
+    (void) argument;
+
+    static PPCB_metrics_text text;
+    PPCB_metrics_rates rates = {.received = 0, .sent = 0};
+    PPCB_metrics_sample previous, now;
+    metrics_sample(&previous);
+    uint64_t next_sample = previous.at + METRICS_INTERVAL_USEC;
+
+    for (;;) {
+        uint64_t left = usec_until(next_sample);
+
+        // A scraper gets the counters as they are, with the rates of the last interval.
+        if (export_fd >= 0) {
+            struct pollfd listen_poll = {.fd = export_fd, .events = POLLIN};
+            if (poll(&listen_poll, 1, (int) ((left + 999) / 1000)) > 0) {
+                metrics_sample(&now);
+                metrics_render(&text, &now, &rates);
+                metrics_answer(export_fd, &text);
+                continue;
+            }
+        } else {
+            usleep((useconds_t) left);
+        }
+
+        if (monotonic_usec() < next_sample) {
+            continue;
+        }
+
+        metrics_sample(&now);
+        metrics_rates(&rates, &now, &previous);
+        previous = now;
+        next_sample = now.at + METRICS_INTERVAL_USEC;
+
+        if (export_fd < 0) {
+            metrics_render(&text, &now, &rates);
+            metrics_rewrite(export_path, &text);
+        }
+    }
+
+    return NULL;
+}
+
+void metrics_serve(
+        const char  *target
+) {
+    if (strncmp(target, "unix:", strlen("unix:")) == 0) {
+        export_fd = metrics_listen(target + strlen("unix:"));
+    } else {
+        export_path = target;
+    }
+    serving = true;
+
+    pthread_t thread;
+    int result = pthread_create(&thread, NULL, metrics_export, NULL);
+    if (result != 0) {
+        errno = result;
+        sys_fatal("pthread_create");
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,325 @@
+#include <sys/types.h>
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ppcb-common.h"
+#include "ppcb-histogram.h"
+#include "ppcb-input.h"
+#include "err.h"
+
+// Packets of the synthetic stream, a power of two; their headers stay in the L1 cache, so the
+// functions are timed rather than memory.
+#define STREAM_PACKETS 4096
+#define DEFAULT_OPERATIONS 20000000
+#define DEFAULT_INPUT_SIZE (256 << 20)
+// Repeats of each benchmark; the fastest one is reported.
+#define DEFAULT_REPEATS 5
+
+/// MEASUREMENT ///
+
+// Keeps the compiler from dropping a computation whose result is otherwise unused.
+#define KEEP(pointer) __asm__ volatile("" : : "r"(pointer) : "memory")
+
+static uint64_t monotonic_nsec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+// A benchmark does operations ops over the stream and returns the wire bytes they handled.
+typedef uint64_t (*PPCB_benchmark)(uint64_t operations);
+
+static void report(
+        const char      *name,
+        PPCB_benchmark  benchmark,
+        uint64_t        operations,
+        int             repeats
+) {
+    uint64_t best = UINT64_MAX, bytes = 0;
+
+    for (int i = 0; i < repeats; i++) {
+        uint64_t started_at = monotonic_nsec();
+        bytes = benchmark(operations);
+        uint64_t elapsed = monotonic_nsec() - started_at;
+        best = min(best, elapsed);
+    }
+
+    best = (best > 0) ? best : 1;
+    printf("%s\t%" PRIu64 "\t%.2f\t%.1f\n", name, operations, (double) best / operations,
+           (double) bytes / (1 << 20) / ((double) best / 1e9));
+    fflush(stdout);
+}
+
+/// SYNTHETIC STREAM ///
+
+// DATA of one session as it comes off the wire, and what the server expects before each.
+static struct {
+    uint64_t            session_id;
+    PPCB_DATA_packet    wire[STREAM_PACKETS];
+    uint64_t            bytes_before[STREAM_PACKETS];
+    uint64_t            length;
+} stream;
+
+static void stream_init(void) {
+    uint64_t state = 0x9E3779B97F4A7C15ULL; // xorshift64, seeded for the same stream each time
+    stream.session_id = state;
+    stream.length = 0;
+
+    for (uint64_t i = 0; i < STREAM_PACKETS; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        // Mostly full packets, as a sender produces them, with a short one now and then.
+        uint32_t payload = (state % 8 == 0) ? (uint32_t) (1 + state % MAX_PACKET_SIZE)
+                                            : MAX_PACKET_SIZE;
+        set_DATA(&stream.wire[i], stream.session_id, i, payload);
+        stream.bytes_before[i] = stream.length;
+        stream.length += payload;
+    }
+}
+
+static uint64_t wire_length(
+        uint64_t    index
+) {
+    return sizeof(PPCB_DATA_packet) + be32toh(stream.wire[index].packet_byte_sequence_length);
+}
+
+/// BENCHMARKS ///
+
+static uint64_t bench_set_DATA(
+        uint64_t    operations
+) {
+    PPCB_DATA_packet packet;
+    uint64_t bytes = 0;
+
+    for (uint64_t i = 0; i < operations; i++) {
+        uint64_t index = i & (STREAM_PACKETS - 1);
+        uint32_t payload = (uint32_t) (wire_length(index) - sizeof(PPCB_DATA_packet));
+        set_DATA(&packet, stream.session_id, i, payload);
+        KEEP(&packet);
+        bytes += sizeof(PPCB_DATA_packet) + payload;
+    }
+
+    return bytes;
+}
+
+static uint64_t bench_set_PACKET_RESPONSE(
+        uint64_t    operations
+) {
+    PPCB_PACKET_RESPONSE_packet packet;
+
+    for (uint64_t i = 0; i < operations; i++) {
+        set_PACKET_RESPONSE(&packet, PPCB_ACC, stream.session_id, i);
+        KEEP(&packet);
+    }
+
+    return operations * sizeof(PPCB_PACKET_RESPONSE_packet);
+}
+
+// Decodes each header the way the servers do and validates it against the session.
+static uint64_t validate_stream(
+        uint64_t        operations,
+        PPCB_Protocol   protocol
+) {
+    uint64_t bytes = 0, rejected = 0;
+
+    for (uint64_t i = 0; i < operations; i++) {
+        uint64_t index = i & (STREAM_PACKETS - 1);
+
+        PPCB_DATA_packet packet;
+        memcpy(&packet, &stream.wire[index], sizeof(PPCB_DATA_packet));
+        packet.packet_number = be64toh(packet.packet_number);
+        packet.packet_byte_sequence_length = be32toh(packet.packet_byte_sequence_length);
+
+        bool valid = validate_data_packet(&packet, protocol, stream.session_id, index,
+                                          stream.bytes_before[index], stream.length,
+                                          MAX_PACKET_SIZE);
+        rejected += !valid;
+        bytes += sizeof(PPCB_DATA_packet) + packet.packet_byte_sequence_length;
+    }
+
+    if (rejected > 0) {
+        fatal("%" PRIu64 " packets of the stream were rejected", rejected);
+    }
+    return bytes;
+}
+
+static uint64_t bench_validate_data_packet_udp(
+        uint64_t    operations
+) {
+    return validate_stream(operations, PPCB_UDP);
+}
+
+static uint64_t bench_validate_data_packet_udpr(
+        uint64_t    operations
+) {
+    return validate_stream(operations, PPCB_UDPR);
+}
+
+static uint64_t bench_validate_receive(
+        uint64_t    operations
+) {
+    uint64_t bytes = 0;
+
+    for (uint64_t i = 0; i < operations; i++) {
+        uint64_t index = i & (STREAM_PACKETS - 1);
+        ssize_t length = (ssize_t) wire_length(index);
+        bool valid = validate_receive(length, (size_t) length, false, PPCB_UDP, "receiving DATA");
+        KEEP(&valid);
+        bytes += (uint64_t) length;
+    }
+
+    return bytes;
+}
+
+// Records a latency per packet, as the udpr client does for every ACC; the wire lengths of
+// the stream stand in for latencies spread over many buckets.
+static uint64_t bench_histogram_record(
+        uint64_t    operations
+) {
+    static PPCB_histogram histogram;
+    histogram_init(&histogram);
+
+    for (uint64_t i = 0; i < operations; i++) {
+        histogram_record(&histogram, wire_length(i & (STREAM_PACKETS - 1)));
+    }
+    KEEP(&histogram);
+
+    return operations * sizeof(uint64_t);
+}
+
+/// INGESTION ///
+
+static uint64_t input_size = DEFAULT_INPUT_SIZE;
+static uint64_t input_threshold;
+
+static void *write_input(
+        void    *argument
+) {
+    int fd = *(int *) argument;
+    static char block[SPOOL_BLOCK];
+    memset(block, 'x', sizeof(block));
+
+    for (uint64_t written = 0; written < input_size; ) {
+        size_t length = (size_t) min((uint64_t) sizeof(block), input_size - written);
+        if (writen(fd, block, length) != (ssize_t) length) {
+            sys_fatal("write");
+        }
+        written += length;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+// Reads input_size bytes from a pipe on stdin, as ppcbc takes piped input, and walks them
+// the way they are sent.
+static uint64_t ingest_pipe(void) {
+    int pipe_fds[2];
+    int saved_stdin = dup(STDIN_FILENO);
+    if (saved_stdin < 0 || pipe(pipe_fds) < 0 || dup2(pipe_fds[0], STDIN_FILENO) < 0) {
+        sys_fatal("pipe");
+    }
+    close(pipe_fds[0]);
+
+    pthread_t writer;
+    int result = pthread_create(&writer, NULL, write_input, &pipe_fds[1]);
+    if (result != 0) {
+        errno = result;
+        sys_fatal("pthread_create");
+    }
+
+    PPCB_input input;
+    input_open(&input, NULL, input_threshold);
+
+    uint64_t sum = 0;
+    for (uint64_t offset = 0; offset < input.length; offset += PACKET_SIZE) {
+        sum += (unsigned char) input.data[offset];
+        input_release(&input, offset);
+    }
+    KEEP(&sum);
+
+    uint64_t length = input.length;
+    input_close(&input);
+    pthread_join(writer, NULL);
+
+    if (dup2(saved_stdin, STDIN_FILENO) < 0) {
+        sys_fatal("dup2");
+    }
+    close(saved_stdin);
+    return length;
+}
+
+// Operations of an ingestion benchmark are packets worth of input.
+static uint64_t bench_read_byte_sequence_memory(
+        uint64_t    operations
+) {
+    (void) operations;
+    input_threshold = UINT64_MAX;
+    return ingest_pipe();
+}
+
+static uint64_t bench_read_byte_sequence_spool(
+        uint64_t    operations
+) {
+    (void) operations;
+    input_threshold = 0;
+    return ingest_pipe();
+}
+
+/// MAIN ///
+
+static void usage(char const *program) {
+    fatal("usage: %s [-n operations] [-s input_size] [-r repeats]\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t operations = DEFAULT_OPERATIONS;
+    int repeats = DEFAULT_REPEATS;
+
+    int option;
+    while ((option = getopt(argc, argv, "n:s:r:")) != -1) {
+        char *endptr;
+        errno = 0;
+        if (option == 'n') {
+            operations = strtoull(optarg, &endptr, 10);
+        } else if (option == 's') {
+            input_size = strtoull(optarg, &endptr, 10);
+        } else if (option == 'r') {
+            repeats = (int) strtol(optarg, &endptr, 10);
+        } else {
+            usage(argv[0]);
+        }
+        if (errno != 0 || *endptr != 0 || operations == 0 || input_size == 0 || repeats < 1) {
+            fatal("%s is not a valid value of -%c", optarg, option);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+
+    stream_init();
+
+    printf("benchmark\tops\tns_per_op\tmib_per_s\n");
+    report("set_DATA", bench_set_DATA, operations, repeats);
+    report("set_PACKET_RESPONSE", bench_set_PACKET_RESPONSE, operations, repeats);
+    report("validate_data_packet/udp", bench_validate_data_packet_udp, operations, repeats);
+    report("validate_data_packet/udpr", bench_validate_data_packet_udpr, operations, repeats);
+    report("validate_receive", bench_validate_receive, operations, repeats);
+    report("histogram_record", bench_histogram_record, operations, repeats);
+
+    uint64_t input_packets = (input_size + PACKET_SIZE - 1) / PACKET_SIZE;
+    report("read_byte_sequence/memory", bench_read_byte_sequence_memory, input_packets, repeats);
+    report("read_byte_sequence/spool", bench_read_byte_sequence_spool, input_packets, repeats);
+
+    return 0;
+}
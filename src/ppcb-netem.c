@@ -0,0 +1,548 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "ppcb-common.h"
+#include "ppcb-rtt.h"
+#include "err.h"
+
+// Clients relayed at once, each through a socket of its own towards the server.
+#define MAX_FLOWS 64
+// A client silent for this long is forgotten, in microseconds.
+#define FLOW_IDLE_USEC (60 * USEC_PER_SEC)
+#define DATAGRAM_SIZE 65536
+
+/// IMPAIRMENTS ///
+
+// Applied to each direction separately. Probabilities are in percent, times in microseconds.
+typedef struct {
+    double      loss;
+    double      duplicate;
+    double      reorder;
+    uint64_t    reorder_gap;    // Extra delay of a reordered datagram.
+    uint64_t    delay;
+    uint64_t    jitter;         // Delay varies uniformly within +-jitter.
+    uint64_t    rate;           // Bits per second, 0 - unlimited.
+    uint64_t    queue;          // Longest backlog of the rate limit, beyond which it drops.
+} PPCB_impairments;
+
+typedef struct {
+    uint64_t    forwarded;
+    uint64_t    lost;
+    uint64_t    duplicated;
+    uint64_t    reordered;
+    uint64_t    overflowed;     // Dropped by the rate limit's queue.
+    uint64_t    kernel_dropped; // Dropped by the kernel before the proxy read them.
+    uint64_t    failed;         // Sends which failed.
+} PPCB_link_stats;
+
+// One direction of the emulated path.
+typedef struct {
+    const char          *name;
+    uint64_t            free_at;    // When the rate limit has sent what it was given.
+    PPCB_link_stats     stats;
+} PPCB_link;
+
+// xorshift64*, so the same seed gives the same impairments.
+static uint64_t random_state;
+
+static uint64_t random_next(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+static bool random_chance(
+        double      percent
+) {
+    return percent > 0 && (double) (random_next() >> 11) * 0x1.0p-53 * 100.0 < percent;
+}
+
+/// DELAYED DATAGRAMS ///
+
+typedef struct {
+    uint64_t            departure;
+    uint64_t            sequence;   // Keeps datagrams due at once in the order they came.
+    int                 fd;
+    struct sockaddr_in  to;
+    size_t              length;
+    char                data[];
+} PPCB_delayed;
+
+// A binary min-heap of datagrams by departure.
+typedef struct {
+    PPCB_delayed    **items;
+    size_t          count;
+    size_t          capacity;
+    uint64_t        sequence;
+} PPCB_delay_queue;
+
+static bool departs_before(
+        const PPCB_delayed  *lhs,
+        const PPCB_delayed  *rhs
+) {
+    return lhs->departure < rhs->departure ||
+           (lhs->departure == rhs->departure && lhs->sequence < rhs->sequence);
+}
+
+static void queue_push(
+        PPCB_delay_queue    *queue,
+        PPCB_delayed        *item
+) {
+    if (queue->count == queue->capacity) {
+        queue->capacity = (queue->capacity == 0) ? 256 : 2 * queue->capacity;
+        queue->items = realloc(queue->items, queue->capacity * sizeof(PPCB_delayed *));
+        ASSERT_MALLOC(queue->items);
+    }
+
+    item->sequence = queue->sequence++;
+    size_t index = queue->count++;
+    while (index > 0 && departs_before(item, queue->items[(index - 1) / 2])) {
+        queue->items[index] = queue->items[(index - 1) / 2];
+        index = (index - 1) / 2;
+    }
+    queue->items[index] = item;
+}
+
+static PPCB_delayed *queue_pop(
+        PPCB_delay_queue    *queue
+) {
+    PPCB_delayed *top = queue->items[0];
+    PPCB_delayed *last = queue->items[--queue->count];
+
+    size_t index = 0;
+    for (;;) {
+        size_t child = 2 * index + 1;
+        if (child >= queue->count) {
+            break;
+        }
+        if (child + 1 < queue->count && departs_before(queue->items[child + 1], queue->items[child])) {
+            child++;
+        }
+        if (!departs_before(queue->items[child], last)) {
+            break;
+        }
+        queue->items[index] = queue->items[child];
+        index = child;
+    }
+    if (queue->count > 0) {
+        queue->items[index] = last;
+    }
+
+    return top;
+}
+
+// Decides the fate of a datagram on a link: it is lost, or delayed (possibly twice).
+static void impair(
+        PPCB_delay_queue            *queue,
+        PPCB_link                   *link,
+        const PPCB_impairments      *impairments,
+        int                         fd,
+        struct sockaddr_in          to,
+        const char                  *data,
+        size_t                      length
+) {
+    if (random_chance(impairments->loss)) {
+        link->stats.lost++;
+        return;
+    }
+
+    int copies = random_chance(impairments->duplicate) ? 2 : 1;
+    link->stats.duplicated += (uint64_t) (copies - 1);
+
+    for (int i = 0; i < copies; i++) {
+        uint64_t now = monotonic_usec();
+        uint64_t sent = now;
+
+        // The rate limit sends one datagram after another, and drops what would wait too long.
+        if (impairments->rate > 0) {
+            uint64_t start = (link->free_at > now) ? link->free_at : now;
+            if (start - now > impairments->queue) {
+                link->stats.overflowed++;
+                continue;
+            }
+            sent = start + (uint64_t) length * 8 * USEC_PER_SEC / impairments->rate;
+            link->free_at = sent;
+        }
+
+        uint64_t departure = sent + impairments->delay;
+        if (impairments->jitter > 0) {
+            uint64_t offset = random_next() % (2 * impairments->jitter + 1);
+            departure = (departure + offset > sent + impairments->jitter)
+                        ? departure + offset - impairments->jitter : sent;
+        }
+        if (random_chance(impairments->reorder)) {
+            departure += impairments->reorder_gap;
+            link->stats.reordered++;
+        }
+
+        PPCB_delayed *item = malloc(sizeof(PPCB_delayed) + length);
+        ASSERT_MALLOC(item);
+        item->departure = departure;
+        item->fd = fd;
+        item->to = to;
+        item->length = length;
+        memcpy(item->data, data, length);
+        queue_push(queue, item);
+    }
+}
+
+/// SOCKETS ///
+
+// A window of DATA reaches the proxy in a burst and leaves it in one, so both buffers are raised.
+// Only hints, the kernel may cap them. The kernel's drops are reported with every datagram.
+static void setup_socket(
+        int     fd
+) {
+    int buffer_size = RECEIVE_SOCKET_BUFFER;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+    int enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable));
+}
+
+// Receives one datagram without blocking. The drop counter of the socket, which only grows, is
+// left in *drops; it is sent only once something was dropped, so it stays as it was before.
+static ssize_t receive_datagram(
+        int                 fd,
+        char                *data,
+        size_t              size,
+        struct sockaddr_in  *from,
+        uint32_t            *drops
+) {
+    struct iovec vector = {.iov_base = data, .iov_len = size};
+    char control[CMSG_SPACE(sizeof(uint32_t))];
+    struct msghdr message = {
+        .msg_name                       = from,
+        .msg_namelen                    = sizeof(*from),
+        .msg_iov                        = &vector,
+        .msg_iovlen                     = 1,
+        .msg_control                    = control,
+        .msg_controllen                 = sizeof(control)
+    };
+
+    ssize_t length = recvmsg(fd, &message, MSG_DONTWAIT);
+    if (length < 0) {
+        return length;
+    }
+
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL;
+         header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(drops, CMSG_DATA(header), sizeof(*drops));
+        }
+    }
+
+    return length;
+}
+
+/// FLOWS ///
+
+typedef struct {
+    bool                used;
+    struct sockaddr_in  client;
+    int                 upstream_fd;    // Connected to the server.
+    uint32_t            drops;          // Last drop counter of upstream_fd.
+    uint64_t            last_seen;
+} PPCB_flow;
+
+static PPCB_flow *flow_find(
+        PPCB_flow           *flows,
+        struct sockaddr_in  client
+) {
+    for (size_t i = 0; i < MAX_FLOWS; i++) {
+        if (flows[i].used && !different_addresses(flows[i].client, client)) {
+            return &flows[i];
+        }
+    }
+    return NULL;
+}
+
+static PPCB_flow *flow_open(
+        PPCB_flow           *flows,
+        struct sockaddr_in  client,
+        struct sockaddr_in  server_address
+) {
+    uint64_t now = monotonic_usec();
+
+    for (size_t i = 0; i < MAX_FLOWS; i++) {
+        if (flows[i].used && now - flows[i].last_seen > FLOW_IDLE_USEC) {
+            close(flows[i].upstream_fd);
+            flows[i].used = false;
+        }
+    }
+
+    for (size_t i = 0; i < MAX_FLOWS; i++) {
+        if (flows[i].used) {
+            continue;
+        }
+
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *) &server_address, sizeof(server_address)) < 0) {
+            sys_error("cannot open a socket towards the server");
+            if (fd >= 0) {
+                close(fd);
+            }
+            return NULL;
+        }
+        setup_socket(fd);
+
+        flows[i] = (PPCB_flow) {
+            .used                       = true,
+            .client                     = client,
+            .upstream_fd                = fd,
+            .drops                      = 0,
+            .last_seen                  = now
+        };
+        return &flows[i];
+    }
+
+    error("too many clients");
+    return NULL;
+}
+
+/// MAIN ///
+
+static volatile sig_atomic_t stopping = false;
+
+static void stop(int signal) {
+    (void) signal;
+    stopping = true;
+}
+
+static void print_stats(
+        const PPCB_link     *link
+) {
+    fprintf(stderr, "%s: forwarded %" PRIu64 ", lost %" PRIu64 ", duplicated %" PRIu64
+            ", reordered %" PRIu64 ", overflowed %" PRIu64 ", dropped by the kernel %" PRIu64
+            ", failed to send %" PRIu64 "\n", link->name,
+            link->stats.forwarded, link->stats.lost, link->stats.duplicated,
+            link->stats.reordered, link->stats.overflowed, link->stats.kernel_dropped,
+            link->stats.failed);
+}
+
+static double read_percent(
+        const char  *string
+) {
+    char *endptr;
+    double value = strtod(string, &endptr);
+    if (*endptr != 0 || value < 0 || value > 100) {
+        fatal("%s is not a valid percentage", string);
+    }
+    return value;
+}
+
+// Reads a time in milliseconds (fractions allowed) as microseconds.
+static uint64_t read_msec(
+        const char  *string
+) {
+    char *endptr;
+    double value = strtod(string, &endptr);
+    if (*endptr != 0 || value < 0) {
+        fatal("%s is not a valid time", string);
+    }
+    return (uint64_t) (value * 1000);
+}
+
+// Reads a rate in kbit/s as bits per second.
+static uint64_t read_rate(
+        const char  *string
+) {
+    char *endptr;
+    double value = strtod(string, &endptr);
+    if (*endptr != 0 || value <= 0) {
+        fatal("%s is not a valid rate", string);
+    }
+    return (uint64_t) (value * 1000);
+}
+
+static void usage(char const *program) {
+    fatal("usage: %s [-l loss%%] [-D duplicate%%] [-R reorder%% [-g gap_ms]] [-d delay_ms] "
+          "[-J jitter_ms] [-b rate_kbit [-q queue_ms]] [-S seed] "
+          "<listen_port> <server_host> <server_port>\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    PPCB_impairments impairments = {
+        .reorder_gap                    = 1000,
+        .queue                          = 100000
+    };
+    uint64_t seed = 1;
+
+    int option;
+    while ((option = getopt(argc, argv, "l:D:R:g:d:J:b:q:S:")) != -1) {
+        if (option == 'l') {
+            impairments.loss = read_percent(optarg);
+        } else if (option == 'D') {
+            impairments.duplicate = read_percent(optarg);
+        } else if (option == 'R') {
+            impairments.reorder = read_percent(optarg);
+        } else if (option == 'g') {
+            impairments.reorder_gap = read_msec(optarg);
+        } else if (option == 'd') {
+            impairments.delay = read_msec(optarg);
+        } else if (option == 'J') {
+            impairments.jitter = read_msec(optarg);
+        } else if (option == 'b') {
+            impairments.rate = read_rate(optarg);
+        } else if (option == 'q') {
+            impairments.queue = read_msec(optarg);
+        } else if (option == 'S') {
+            char *endptr;
+            seed = strtoull(optarg, &endptr, 10);
+            if (*endptr != 0) {
+                fatal("%s is not a valid seed", optarg);
+            }
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3) {
+        usage(argv[0]);
+    }
+
+    // A zero state would stay zero.
+    random_state = seed ^ 0x9E3779B97F4A7C15ULL;
+    random_state = (random_state == 0) ? 1 : random_state;
+
+    uint16_t listen_port = read_port(argv[optind]);
+    struct sockaddr_in server_address = get_server_address(argv[optind + 1],
+                                                           read_port(argv[optind + 2]), PPCB_UDP);
+
+    int listen_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in listen_address = {
+        .sin_family                     = AF_INET,
+        .sin_addr.s_addr                = htonl(INADDR_ANY),
+        .sin_port                       = htons(listen_port)
+    };
+    if (listen_fd < 0 ||
+        bind(listen_fd, (struct sockaddr *) &listen_address, sizeof(listen_address)) < 0) {
+        sys_fatal("bind");
+    }
+    setup_socket(listen_fd);
+
+    struct sigaction action = {.sa_handler = stop};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    static PPCB_flow flows[MAX_FLOWS];
+    PPCB_delay_queue queue = {0};
+    PPCB_link upstream = {.name = "client -> server"}, downstream = {.name = "server -> client"};
+    static char datagram[DATAGRAM_SIZE];
+    uint32_t listen_drops = 0;
+
+    while (!stopping) {
+        struct pollfd polls[MAX_FLOWS + 1];
+        PPCB_flow *polled[MAX_FLOWS + 1];
+        nfds_t poll_count = 0;
+
+        polls[poll_count] = (struct pollfd) {.fd = listen_fd, .events = POLLIN};
+        polled[poll_count++] = NULL;
+        for (size_t i = 0; i < MAX_FLOWS; i++) {
+            if (flows[i].used) {
+                polls[poll_count] = (struct pollfd) {.fd = flows[i].upstream_fd, .events = POLLIN};
+                polled[poll_count++] = &flows[i];
+            }
+        }
+
+        uint64_t now = monotonic_usec();
+        struct timespec wait, *timeout = NULL;
+        if (queue.count > 0) {
+            uint64_t left = (queue.items[0]->departure > now) ? queue.items[0]->departure - now : 0;
+            wait = (struct timespec) {
+                .tv_sec = left / USEC_PER_SEC,
+                .tv_nsec = (left % USEC_PER_SEC) * 1000
+            };
+            timeout = &wait;
+        }
+
+        if (ppoll(polls, poll_count, timeout, NULL) < 0 && errno != EINTR) {
+            sys_fatal("ppoll");
+        }
+
+        for (nfds_t i = 0; i < poll_count; i++) {
+            if (!(polls[i].revents & POLLIN)) {
+                continue;
+            }
+
+            // Datagrams coming to the proxy's port go upstream, those from the server downstream.
+            PPCB_link *link = (polled[i] == NULL) ? &upstream : &downstream;
+            uint32_t *drops = (polled[i] == NULL) ? &listen_drops : &polled[i]->drops;
+
+            for (;;) {
+                struct sockaddr_in from;
+                uint32_t dropped_before = *drops;
+                ssize_t length = receive_datagram(polls[i].fd, datagram, sizeof(datagram), &from,
+                                                  drops);
+                if (length < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+                        sys_error("recvmsg");
+                    }
+                    break;
+                }
+                link->stats.kernel_dropped += (uint32_t) (*drops - dropped_before);
+
+                if (polled[i] == NULL) {
+                    PPCB_flow *flow = flow_find(flows, from);
+                    if (flow == NULL && (flow = flow_open(flows, from, server_address)) == NULL) {
+                        continue;
+                    }
+                    flow->last_seen = monotonic_usec();
+                    impair(&queue, &upstream, &impairments, flow->upstream_fd, server_address,
+                           datagram, (size_t) length);
+                } else {
+                    impair(&queue, &downstream, &impairments, listen_fd, polled[i]->client,
+                           datagram, (size_t) length);
+                }
+            }
+        }
+
+        // Everything due goes out, in the order of departure.
+        now = monotonic_usec();
+        while (queue.count > 0 && queue.items[0]->departure <= now) {
+            PPCB_delayed *item = queue_pop(&queue);
+            PPCB_link *link = (item->fd == listen_fd) ? &downstream : &upstream;
+
+            ssize_t sent = (item->fd == listen_fd)
+                           ? sendto(item->fd, item->data, item->length, 0,
+                                    (struct sockaddr *) &item->to, sizeof(item->to))
+                           : send(item->fd, item->data, item->length, 0);
+            if (sent == (ssize_t) item->length) {
+                link->stats.forwarded++;
+            } else {
+                link->stats.failed++;
+            }
+            free(item);
+        }
+    }
+
+    print_stats(&upstream);
+    print_stats(&downstream);
+
+    while (queue.count > 0) {
+        free(queue_pop(&queue));
+    }
+    free(queue.items);
+    for (size_t i = 0; i < MAX_FLOWS; i++) {
+        if (flows[i].used) {
+            close(flows[i].upstream_fd);
+        }
+    }
+    close(listen_fd);
+
+    return 0;
+}
@@ -0,0 +1,342 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ppcb-output.h"
+#include "ppcb-common.h"
+#include "ppcb-metrics.h"
+#include "err.h"
+
+
+/// OUTPUT STAGE ///
+
+// Outputs of concurrent workers share stdout; each write goes out whole.
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set before any worker starts, read-only afterwards.
+static bool shared_descriptor = false;
+
+// Set by output_use_directory before any worker starts, read-only afterwards.
+static const char *session_directory = NULL;
+static bool session_direct = false;
+
+static ssize_t locked_writevn(
+        int             fd,
+        struct iovec    *vector,
+        int             count
+) {
+    pthread_mutex_lock(&write_lock);
+    ssize_t written = writevn(fd, vector, count);
+    pthread_mutex_unlock(&write_lock);
+
+    return written;
+}
+
+void output_use_directory(
+        const char      *directory,
+        bool            direct
+) {
+    session_directory = directory;
+    session_direct = direct;
+}
+
+void output_share_descriptor(void) {
+    shared_descriptor = true;
+}
+
+void output_init(
+        PPCB_output         *output,
+        int                 fd,
+        PPCB_flush_policy   policy
+) {
+    *output = (PPCB_output) {
+        .fd                             = fd,
+        .policy                         = policy,
+        .buffer                         = NULL,
+        .length                         = 0,
+        .ring                           = NULL,
+        .file_fd                        = -1,
+        .offset                         = 0,
+        .direct                         = false
+    };
+
+    // O_DIRECT files are always written from the buffer, in aligned blocks.
+    if (policy == PPCB_FLUSH_THROUGHPUT || (session_directory != NULL && session_direct)) {
+        int result = posix_memalign((void **) &output->buffer, OUTPUT_ALIGNMENT,
+                                    OUTPUT_BUFFER_SIZE);
+        if (result != 0) {
+            errno = result;
+            sys_fatal("posix_memalign");
+        }
+    }
+}
+
+void output_attach_ring(
+        PPCB_output     *output,
+        PPCB_uring      *ring
+) {
+    if (output->policy == PPCB_FLUSH_LATENCY) {
+        output->ring = ring;
+    }
+}
+
+// Changes how much is gathered in the buffer, which the backlog metric follows.
+static void set_gathered(
+        PPCB_output     *output,
+        size_t          length
+) {
+    metrics_backlog((int64_t) length - (int64_t) output->length);
+    output->length = length;
+}
+
+// Writes to the file of the session at its offset, or to the shared descriptor.
+static bool write_out(
+        PPCB_output     *output,
+        struct iovec    *vector,
+        int             count,
+        size_t          expected_length
+) {
+    ssize_t written = (output->file_fd >= 0)
+                      ? pwritevn(output->file_fd, vector, count, (off_t) output->offset)
+                      : locked_writevn(output->fd, vector, count);
+    if ((size_t) written != expected_length) {
+        sys_error("write");
+        return false;
+    }
+
+    output->offset += expected_length;
+    return true;
+}
+
+// Writes whatever was gathered together with the new bytes in one call.
+static bool write_gathered(
+        PPCB_output     *output,
+        const char      *data,
+        size_t          length
+) {
+    struct iovec vector[] = {
+        {.iov_base = output->buffer, .iov_len = output->length},
+        {.iov_base = (void *) data, .iov_len = length}
+    };
+    size_t expected_length = output->length + length;
+    set_gathered(output, 0);
+
+    return write_out(output, vector, 2, expected_length);
+}
+
+// Writes the whole blocks gathered so far and keeps the rest at the front of the buffer.
+static bool write_aligned(
+        PPCB_output     *output
+) {
+    size_t aligned_length = output->length - output->length % OUTPUT_ALIGNMENT;
+    if (aligned_length == 0) {
+        return true;
+    }
+
+    struct iovec vector = {.iov_base = output->buffer, .iov_len = aligned_length};
+    if (!write_out(output, &vector, 1, aligned_length)) {
+        set_gathered(output, 0);
+        return false;
+    }
+
+    set_gathered(output, output->length - aligned_length);
+    memmove(output->buffer, output->buffer + aligned_length, output->length);
+    return true;
+}
+
+static bool write_direct(
+        PPCB_output     *output,
+        const char      *data,
+        size_t          length
+) {
+    while (length > 0) {
+        size_t part = min(length, OUTPUT_BUFFER_SIZE - output->length);
+        memcpy(output->buffer + output->length, data, part);
+        set_gathered(output, output->length + part);
+        data += part;
+        length -= part;
+
+        if (output->length == OUTPUT_BUFFER_SIZE && !write_aligned(output)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool output_write(
+        PPCB_output     *output,
+        const char      *data,
+        size_t          length
+) {
+    if (output->direct) {
+        return write_direct(output, data, length);
+    }
+    if (output->policy == PPCB_FLUSH_THROUGHPUT && output->length + length <= OUTPUT_BUFFER_SIZE) {
+        memcpy(output->buffer + output->length, data, length);
+        set_gathered(output, output->length + length);
+        return true;
+    }
+    if (output->ring != NULL && output->file_fd >= 0) {
+        uring_queue_write(output->ring, output, output->file_fd, data, length, output->offset);
+        output->offset += length;
+        return true;
+    }
+    if (output->ring != NULL && !shared_descriptor) {
+        uring_queue_write(output->ring, output, output->fd, data, length, (uint64_t) -1);
+        return true;
+    }
+
+    return write_gathered(output, data, length);
+}
+
+bool output_write_vector(
+        PPCB_output     *output,
+        struct iovec    *vector,
+        size_t          count
+) {
+    bool queued = output->ring != NULL && (output->file_fd >= 0 || !shared_descriptor);
+    if (output->policy == PPCB_FLUSH_THROUGHPUT || queued || output->direct) {
+        for (size_t i = 0; i < count; i++) {
+            if (!output_write(output, vector[i].iov_base, vector[i].iov_len)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t expected_length = 0;
+    for (size_t i = 0; i < count; i++) {
+        expected_length += vector[i].iov_len;
+    }
+    if (expected_length == 0) {
+        return true;
+    }
+
+    return write_out(output, vector, (int) count, expected_length);
+}
+
+bool output_drain(
+        PPCB_output     *output
+) {
+    if (output->ring != NULL && !uring_drain_writes(output->ring)) {
+        sys_error("write");
+        return false;
+    }
+    return true;
+}
+
+bool output_flush(
+        PPCB_output     *output
+) {
+    if (!output_drain(output)) {
+        return false;
+    }
+
+    if (output->direct) {
+        if (!write_aligned(output)) {
+            return false;
+        }
+        if (output->length == 0) {
+            return true;
+        }
+
+        // A partial block can't be written directly, so the rest of the file goes through
+        // the page cache.
+        int flags = fcntl(output->file_fd, F_GETFL);
+        if (flags < 0 || fcntl(output->file_fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+            sys_error("fcntl");
+            return false;
+        }
+        output->direct = false;
+    }
+
+    if (output->length == 0) {
+        return true;
+    }
+
+    return write_gathered(output, NULL, 0);
+}
+
+bool output_open_session(
+        PPCB_output     *output,
+        uint64_t        session_id,
+        uint64_t        byte_sequence_length
+) {
+    if (session_directory == NULL) {
+        return true;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%016" PRIx64, session_directory, session_id);
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int file_fd = -1;
+    bool direct = false;
+    if (session_direct) {
+        file_fd = open(path, flags | O_DIRECT, 0644);
+        direct = file_fd >= 0;
+    }
+    // Not every file system takes O_DIRECT; there the file goes through the page cache.
+    if (file_fd < 0) {
+        file_fd = open(path, flags, 0644);
+    }
+    if (file_fd < 0) {
+        sys_error("open %s", path);
+        return false;
+    }
+
+    // The space is taken at once, so the file doesn't fragment as it grows.
+    if (fallocate(file_fd, 0, 0, (off_t) byte_sequence_length) < 0 &&
+        errno != EOPNOTSUPP && errno != ENOSYS) {
+        sys_error("fallocate %s", path);
+        close(file_fd);
+        return false;
+    }
+
+    output->file_fd = file_fd;
+    output->offset = 0;
+    output->direct = direct;
+    return true;
+}
+
+bool output_close_session(
+        PPCB_output     *output
+) {
+    bool written = output_flush(output);
+    if (output->file_fd < 0) {
+        return written;
+    }
+
+    // A session cut short leaves none of the preallocated space behind.
+    if (ftruncate(output->file_fd, (off_t) output->offset) < 0) {
+        sys_error("ftruncate");
+        written = false;
+    }
+    if (close(output->file_fd) < 0) {
+        sys_error("close");
+        written = false;
+    }
+
+    output->file_fd = -1;
+    output->offset = 0;
+    output->direct = false;
+    set_gathered(output, 0);
+    return written;
+}
+
+void output_destroy(
+        PPCB_output     *output
+) {
+    output_close_session(output);
+    free(output->buffer);
+}
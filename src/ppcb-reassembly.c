@@ -0,0 +1,129 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ppcb-reassembly.h"
+#include "ppcb-common.h"
+#include "err.h"
+
+
+/// REASSEMBLY BUFFER ///
+
+void reassembly_init(
+        PPCB_reassembly *reassembly,
+        uint16_t        window,
+        uint32_t        payload_size
+) {
+    memset(reassembly, 0, sizeof(PPCB_reassembly));
+    if (window <= 1 || payload_size == 0) {
+        return;
+    }
+
+    reassembly->capacity = min((size_t) window - 1, REASSEMBLY_BYTES / payload_size);
+    reassembly->payload_size = payload_size;
+}
+
+uint16_t reassembly_window(
+        uint32_t        payload_size
+) {
+    return min(UINT16_MAX, REASSEMBLY_BYTES / payload_size + 1);
+}
+
+PPCB_reassembly_result reassembly_hold(
+        PPCB_reassembly *reassembly,
+        uint64_t        awaited,
+        uint64_t        packet_number,
+        const char      *payload,
+        uint32_t        length
+) {
+    if (packet_number <= awaited || packet_number - awaited > reassembly->capacity ||
+        length == 0 || length > reassembly->payload_size) {
+        return REASSEMBLY_BEYOND;
+    }
+
+    // Most sessions never see DATA out of order, so they never pay for the buffer.
+    if (reassembly->payloads == NULL) {
+        reassembly->lengths = calloc(reassembly->capacity, sizeof(uint32_t));
+        ASSERT_MALLOC(reassembly->lengths);
+        reassembly->payloads = malloc(reassembly->capacity * reassembly->payload_size);
+        ASSERT_MALLOC(reassembly->payloads);
+    }
+
+    size_t slot = packet_number % reassembly->capacity;
+    if (reassembly->lengths[slot] != 0) {
+        return REASSEMBLY_DUPLICATE;
+    }
+
+    memcpy(reassembly->payloads + slot * reassembly->payload_size, payload, length);
+    reassembly->lengths[slot] = length;
+    reassembly->held++;
+    return REASSEMBLY_HELD;
+}
+
+uint32_t reassembly_take(
+        PPCB_reassembly *reassembly,
+        uint64_t        packet_number,
+        const char      **payload
+) {
+    if (reassembly->held == 0) {
+        return 0;
+    }
+
+    size_t slot = packet_number % reassembly->capacity;
+    uint32_t length = reassembly->lengths[slot];
+    if (length == 0) {
+        return 0;
+    }
+
+    *payload = reassembly->payloads + slot * reassembly->payload_size;
+    reassembly->lengths[slot] = 0;
+    reassembly->held--;
+    return length;
+}
+
+// Whether DATA packet_number, ahead of awaited, is held.
+static bool reassembly_holds(
+        const PPCB_reassembly   *reassembly,
+        uint64_t                awaited,
+        uint64_t                packet_number
+) {
+    return packet_number > awaited && packet_number - awaited <= reassembly->capacity &&
+           reassembly->lengths[packet_number % reassembly->capacity] != 0;
+}
+
+uint16_t reassembly_run(
+        const PPCB_reassembly   *reassembly,
+        uint64_t                awaited,
+        uint64_t                packet_number,
+        uint64_t                *first
+) {
+    if (reassembly->held == 0) {
+        return 0;
+    }
+
+    uint64_t last = packet_number;
+    while (last - awaited <= reassembly->capacity && !reassembly_holds(reassembly, awaited, last)) {
+        last++;
+    }
+    if (!reassembly_holds(reassembly, awaited, last)) {
+        return 0;
+    }
+
+    *first = last;
+    while (reassembly_holds(reassembly, awaited, *first - 1)) {
+        (*first)--;
+    }
+    while (reassembly_holds(reassembly, awaited, last + 1)) {
+        last++;
+    }
+    return last - *first + 1;
+}
+
+void reassembly_destroy(
+        PPCB_reassembly *reassembly
+) {
+    free(reassembly->lengths);
+    free(reassembly->payloads);
+    memset(reassembly, 0, sizeof(PPCB_reassembly));
+}
@@ -0,0 +1,82 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "ppcb-rtt.h"
+#include "ppcb-common.h"
+#include "protconst.h"
+
+
+/// RETRANSMISSION TIMEOUT ///
+
+static uint64_t clamp_rto(
+        uint64_t    rto
+) {
+    return min(MAX_RTO, rto < MIN_RTO ? MIN_RTO : rto);
+}
+
+void rtt_init(
+        PPCB_rtt    *rtt
+) {
+    *rtt = (PPCB_rtt) {
+        .srtt                           = 0,
+        .rttvar                         = 0,
+        .rto                            = INITIAL_RTO,
+        .silent_since                   = monotonic_usec()
+    };
+}
+
+void rtt_sample(
+        PPCB_rtt    *rtt,
+        uint64_t    sample
+) {
+    if (rtt->srtt == 0) {
+        rtt->srtt = sample;
+        rtt->rttvar = sample / 2;
+    }
+    else {
+        uint64_t deviation = (rtt->srtt > sample) ? rtt->srtt - sample : sample - rtt->srtt;
+        rtt->rttvar = (3 * rtt->rttvar + deviation) / 4;
+        rtt->srtt = (7 * rtt->srtt + sample) / 8;
+    }
+
+    // A zero srtt marks "no sample yet", so keep it positive.
+    if (rtt->srtt == 0) {
+        rtt->srtt = 1;
+    }
+
+    rtt->rto = clamp_rto(rtt->srtt + 4 * rtt->rttvar);
+}
+
+void rtt_backoff(
+        PPCB_rtt    *rtt
+) {
+    rtt->rto = clamp_rto(2 * rtt->rto);
+}
+
+void rtt_progress(
+        PPCB_rtt    *rtt
+) {
+    rtt->silent_since = monotonic_usec();
+}
+
+bool rtt_expired(
+        const PPCB_rtt  *rtt
+) {
+    return monotonic_usec() - rtt->silent_since > MAX_SILENCE;
+}
+
+/// CLOCK ///
+
+uint64_t monotonic_usec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * USEC_PER_SEC + (uint64_t) now.tv_nsec / 1000;
+}
+
+uint64_t usec_until(
+        uint64_t    deadline
+) {
+    uint64_t now = monotonic_usec();
+    return (deadline > now) ? deadline - now : 1;
+}
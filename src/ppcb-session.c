@@ -0,0 +1,127 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "ppcb-session.h"
+#include "ppcb-common.h"
+#include "ppcb-output.h"
+#include "ppcb-rtt.h"
+#include "ppcb-stats.h"
+#include "ppcb-timer.h"
+#include "err.h"
+
+
+/// SESSION TABLE ///
+
+void session_table_init(
+        PPCB_session_table  *table
+) {
+    memset(table, 0, sizeof(*table));
+    timer_wheel_init(&table->timers, monotonic_usec());
+}
+
+// Session ids are chosen by clients, so the key is mixed rather than trusted to be random.
+static size_t session_hash(
+        struct sockaddr_in  address,
+        uint64_t            session_id
+) {
+    uint64_t key = ((uint64_t) address.sin_addr.s_addr << 16) | address.sin_port;
+    key = session_id ^ (key * 0x9E3779B97F4A7C15ULL);
+    key ^= key >> 31;
+    key *= 0xBF58476D1CE4E5B9ULL;
+    key ^= key >> 29;
+
+    return (size_t) (key & (SESSION_BUCKETS - 1));
+}
+
+PPCB_session *session_find(
+        PPCB_session_table  *table,
+        struct sockaddr_in  address,
+        uint64_t            session_id
+) {
+    PPCB_session *session = table->buckets[session_hash(address, session_id)];
+
+    while (session != NULL &&
+           (session->session_id != session_id || different_addresses(session->address, address))) {
+        session = session->next;
+    }
+
+    return session;
+}
+
+/// SESSIONS ///
+
+PPCB_session *session_add(
+        PPCB_session_table  *table,
+        struct sockaddr_in  address,
+        uint64_t            session_id,
+        PPCB_Protocol       protocol,
+        PPCB_flush_policy   policy
+) {
+    if (table->count == MAX_SESSIONS) {
+        return NULL;
+    }
+
+    PPCB_session *session = calloc(1, sizeof(PPCB_session));
+    ASSERT_MALLOC(session);
+
+    session->address = address;
+    session->session_id = session_id;
+    session->protocol = protocol;
+    output_init(&session->output, STDOUT_FILENO, policy);
+    stats_init(&session->stats, "server", protocol);
+
+    size_t bucket = session_hash(address, session_id);
+    session->next = table->buckets[bucket];
+    table->buckets[bucket] = session;
+    table->count++;
+
+    // Scheduled once the protocol sets a deadline.
+    timer_init(&session->timer, session);
+
+    return session;
+}
+
+void session_remove(
+        PPCB_session_table  *table,
+        PPCB_session        *session
+) {
+    PPCB_session **link = &table->buckets[session_hash(session->address, session->session_id)];
+    while (*link != session) {
+        link = &(*link)->next;
+    }
+    *link = session->next;
+    table->count--;
+
+    timer_cancel(&table->timers, &session->timer);
+
+    output_destroy(&session->output);
+    reassembly_destroy(&session->reassembly);
+    stats_report(&session->stats);
+    free(session);
+}
+
+void session_update(
+        PPCB_session_table  *table,
+        PPCB_session        *session
+) {
+    timer_schedule(&table->timers, &session->timer, session->deadline);
+}
+
+PPCB_session *session_expired(
+        PPCB_session_table  *table,
+        uint64_t            now
+) {
+    PPCB_timer *timer = timer_wheel_expire(&table->timers, now);
+    return (timer != NULL) ? timer->data : NULL;
+}
+
+uint64_t session_timeout(
+        PPCB_session_table  *table,
+        uint64_t            now
+) {
+    return timer_wheel_timeout(&table->timers, now);
+}
@@ -0,0 +1,259 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ppcb-stats.h"
+#include "ppcb-common.h"
+#include "ppcb-metrics.h"
+#include "ppcb-rtt.h"
+#include "ppcb-timestamp.h"
+#include "err.h"
+
+
+/// REPORTS ///
+
+// Set by stats_use_file before any session starts, read-only afterwards.
+static int report_fd = -1;
+
+// Each thread serves one session at a time.
+static __thread PPCB_stats *current = NULL;
+
+void stats_use_file(
+        const char      *path
+) {
+    if (strcmp(path, "-") == 0) {
+        report_fd = STDERR_FILENO;
+        return;
+    }
+
+    report_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (report_fd < 0) {
+        sys_fatal("open %s", path);
+    }
+}
+
+void stats_init(
+        PPCB_stats      *stats,
+        const char      *role,
+        PPCB_Protocol   protocol
+) {
+    *stats = (PPCB_stats) {
+        .role                           = role,
+        .protocol                       = protocol,
+        .started_at                     = monotonic_usec()
+    };
+}
+
+PPCB_stats *stats_attach(
+        PPCB_stats      *stats
+) {
+    PPCB_stats *previous = current;
+    current = stats;
+    return previous;
+}
+
+static const char *protocol_name(
+        PPCB_Protocol   protocol
+) {
+    switch (protocol) {
+        case PPCB_TCP:
+            return "tcp";
+        case PPCB_UDP:
+            return "udp";
+        default:
+            return "udpr";
+    }
+}
+
+// The delays of timestamped DATA, or nothing for a session without them.
+static void format_delay(
+        const PPCB_delay    *delay,
+        char                *buffer,
+        size_t              size
+) {
+    buffer[0] = 0;
+    if (delay == NULL) {
+        return;
+    }
+
+    char one_way_delay[160], jitter[160], receive_stack[160];
+    histogram_format(&delay->one_way_delay, one_way_delay, sizeof(one_way_delay));
+    histogram_format(&delay->jitter, jitter, sizeof(jitter));
+    histogram_format(&delay->receive_stack, receive_stack, sizeof(receive_stack));
+
+    snprintf(buffer, size,
+             ",\"one_way_delay_nsec\":%s,\"jitter_nsec\":%s,\"interarrival_jitter_nsec\":%" PRIu64
+             ",\"receive_stack_nsec\":%s",
+             one_way_delay, jitter, delay->interarrival_jitter, receive_stack);
+}
+
+static void write_report(
+        PPCB_stats      *stats
+) {
+    uint64_t wall_usec = monotonic_usec() - stats->started_at;
+    metrics_session_closed(wall_usec);
+    if (report_fd < 0) {
+        return;
+    }
+    double goodput = (wall_usec > 0)
+                     ? (double) stats->payload_bytes / (1 << 20) / ((double) wall_usec / USEC_PER_SEC)
+                     : 0;
+
+    // Sessions without a round trip measured have no RTT to tell.
+    char rtt[128] = "\"rtt_min_usec\":null,\"rtt_avg_usec\":null,\"rtt_max_usec\":null";
+    if (stats->rtt_samples > 0) {
+        snprintf(rtt, sizeof(rtt),
+                 "\"rtt_min_usec\":%" PRIu64 ",\"rtt_avg_usec\":%" PRIu64
+                 ",\"rtt_max_usec\":%" PRIu64,
+                 stats->rtt_min, stats->rtt_sum / stats->rtt_samples, stats->rtt_max);
+    }
+
+    char delay[640];
+    format_delay(stats->delay, delay, sizeof(delay));
+
+    char line[1536];
+    int length = snprintf(line, sizeof(line),
+        "{\"role\":\"%s\",\"protocol\":\"%s\",\"session_id\":\"%016" PRIx64 "\","
+        "\"completed\":%s,\"wall_usec\":%" PRIu64 ","
+        "\"bytes_sent\":%" PRIu64 ",\"bytes_received\":%" PRIu64 ","
+        "\"packets_sent\":%" PRIu64 ",\"packets_received\":%" PRIu64 ","
+        "\"payload_bytes\":%" PRIu64 ",\"goodput_mibps\":%.2f,"
+        "\"retransmissions\":%" PRIu64 ",\"duplicate_data\":%" PRIu64 ","
+        "\"duplicate_acc\":%" PRIu64 ",\"rejects\":%" PRIu64 ",\"timeouts\":%" PRIu64 ",%s%s}\n",
+        stats->role, protocol_name(stats->protocol), stats->session_id,
+        stats->completed ? "true" : "false", wall_usec,
+        stats->bytes_sent, stats->bytes_received, stats->packets_sent, stats->packets_received,
+        stats->payload_bytes, goodput,
+        stats->retransmissions, stats->duplicate_data, stats->duplicate_acc, stats->rejects,
+        stats->timeouts, rtt, delay);
+
+    // A single write keeps lines of concurrent sessions apart, even in a shared file.
+    if (write(report_fd, line, (size_t) length) != length) {
+        sys_error("write stats");
+    }
+}
+
+void stats_report(
+        PPCB_stats      *stats
+) {
+    if (stats->opened) {
+        write_report(stats);
+    }
+
+    free(stats->delay);
+    stats->delay = NULL;
+}
+
+/// COUNTING FOR THE ATTACHED SESSION ///
+
+void stats_session(
+        uint64_t        session_id
+) {
+    metrics_add(METRIC_CONN_ACCEPTED, 1);
+    if (current != NULL) {
+        current->session_id = session_id;
+        current->opened = true;
+    }
+}
+
+void stats_sent(
+        size_t          length,
+        uint64_t        packets
+) {
+    metrics_add(METRIC_BYTES_SENT, length);
+    if (current != NULL) {
+        current->bytes_sent += length;
+        current->packets_sent += packets;
+    }
+}
+
+void stats_received(
+        size_t          length,
+        uint64_t        packets
+) {
+    metrics_add(METRIC_BYTES_RECEIVED, length);
+    if (current != NULL) {
+        current->bytes_received += length;
+        current->packets_received += packets;
+    }
+}
+
+void stats_delivered(
+        uint64_t        length
+) {
+    if (current != NULL) {
+        current->payload_bytes += length;
+    }
+}
+
+void stats_completed(void) {
+    if (current != NULL) {
+        current->completed = true;
+    }
+}
+
+void stats_retransmitted(
+        uint64_t        packets
+) {
+    if (current != NULL) {
+        current->retransmissions += packets;
+    }
+}
+
+void stats_duplicate_data(void) {
+    if (current != NULL) {
+        current->duplicate_data++;
+    }
+}
+
+void stats_duplicate_acc(void) {
+    if (current != NULL) {
+        current->duplicate_acc++;
+    }
+}
+
+void stats_rejected(void) {
+    if (current != NULL) {
+        current->rejects++;
+    }
+}
+
+void stats_timed_out(void) {
+    metrics_add(METRIC_TIMEOUTS, 1);
+    if (current != NULL) {
+        current->timeouts++;
+    }
+}
+
+void stats_rtt(
+        uint64_t        sample
+) {
+    if (current == NULL) {
+        return;
+    }
+
+    current->rtt_min = (current->rtt_samples == 0) ? sample : min(current->rtt_min, sample);
+    current->rtt_max = (sample > current->rtt_max) ? sample : current->rtt_max;
+    current->rtt_sum += sample;
+    current->rtt_samples++;
+}
+
+void stats_delay(
+        uint64_t        sent_at,
+        uint64_t        arrived_at
+) {
+    if (current == NULL) {
+        return;
+    }
+
+    if (current->delay == NULL) {
+        current->delay = malloc(sizeof(PPCB_delay));
+        ASSERT_MALLOC(current->delay);
+        delay_init(current->delay);
+    }
+    delay_record(current->delay, sent_at, arrived_at, realtime_nsec());
+}
@@ -3,25 +3,55 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
 
 #include "ppcb-tcp.h"
 #include "err.h"
 #include "ppcb-common.h"
+#include "ppcb-input.h"
+#include "ppcb-metrics.h"
+#include "ppcb-output.h"
+#include "ppcb-rtt.h"
+#include "ppcb-stats.h"
 #include "protconst.h"
 
 
 /// COMMUNICATION FUNCTIONS ///
 
+static ssize_t send_vector_tcp(
+        int             socket_fd,
+        struct iovec    *vector,
+        int             vector_length
+) {
+    ssize_t sent_length = writevn(socket_fd, vector, vector_length);
+    if (sent_length > 0) {
+        stats_sent((size_t) sent_length, 1);
+    }
+    return sent_length;
+}
+
 static ssize_t send_packet_tcp(
         int         socket_fd,
         size_t      data_length,
         void        *data
 ) {
-    return writen(socket_fd, data, data_length);
+    struct iovec vector = {.iov_base = data, .iov_len = data_length};
+    return send_vector_tcp(socket_fd, &vector, 1);
+}
+
+// The timeout never changes, so it is set once for the socket rather than before every read.
+static void set_timeout_tcp(
+        int         socket_fd
+) {
+    struct timeval to = {.tv_sec = MAX_WAIT, .tv_usec = 0};
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof to);
 }
 
 static ssize_t receive_packet_tcp(
@@ -29,21 +59,52 @@ static ssize_t receive_packet_tcp(
         size_t      data_length,
         void        *data
 ) {
-    // Set timeouts for the client socket.
-    struct timeval to = {.tv_sec = MAX_WAIT, .tv_usec = 0};
-    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof to);
-
     ssize_t read_length = readn(client_fd, data, data_length);
 
     if (read_length < 0) {
         if (errno != EAGAIN) {
             return -1;
         }
+        stats_timed_out();
         return 0;
     }
     return read_length;
 }
 
+// Writes the header and has the kernel move the payload from the file to the socket.
+// MSG_MORE keeps the header from going out in a segment of its own.
+static ssize_t send_file_tcp(
+        int         socket_fd,
+        size_t      header_length,
+        void        *header,
+        int         file_fd,
+        off_t       offset,
+        size_t      length
+) {
+    char *header_left = header;
+    size_t nleft = header_length;
+    while (nleft > 0) {
+        ssize_t nwritten = send(socket_fd, header_left, nleft, MSG_MORE);
+        if (nwritten <= 0)
+            return nwritten;
+
+        nleft -= nwritten;
+        header_left += nwritten;
+    }
+
+    nleft = length;
+    while (nleft > 0) {
+        ssize_t nwritten = sendfile(socket_fd, file_fd, &offset, nleft);
+        if (nwritten <= 0)
+            return nwritten;
+
+        nleft -= nwritten;
+    }
+
+    stats_sent(header_length + length, 1);
+    return header_length + length;
+}
+
 /// TCP CLIENT HELPER FUNCTIONS ///
 
 static void client_receives_RESPONSE(
@@ -58,61 +119,108 @@ static void client_receives_RESPONSE(
                                                  &data_received);
     validate_receive(received_length, sizeof(PPCB_RESPONSE_packet), true,
                      PPCB_TCP, error_message);
+    stats_received(sizeof(PPCB_RESPONSE_packet), 1);
     validate_response_packet(&data_received, waiting_for, session_id);
 }
 
 
+// Payloads above MAX_PACKET_SIZE need an agreement, so only then CONN carries the extension;
+// payload_size is replaced with the size granted by the server.
 static void client_initialise_connection(
     int                     socket_fd,
     struct sockaddr_in      server_address,
     uint64_t                session_id,
-    uint64_t                byte_sequence_length
+    uint64_t                byte_sequence_length,
+    uint32_t                *payload_size
 ) {
     // Connect to the server.
     if (connect(socket_fd, (struct sockaddr *) &server_address,
                 (socklen_t) sizeof(server_address)) < 0) {
         sys_fatal("connect");
     }
+    set_timeout_tcp(socket_fd);
 
     // Establishing a connection.
+    bool extended = *payload_size > MAX_PACKET_SIZE;
+    size_t conn_length = sizeof(PPCB_CONN_packet) + (extended ? sizeof(PPCB_CONN_extension) : 0);
+
     PPCB_CONN_packet data_to_send;
-    set_CONN(&data_to_send, session_id,PPCB_TCP, byte_sequence_length);
-    ssize_t sent_length = send_packet_tcp(socket_fd, sizeof(PPCB_CONN_packet), &data_to_send);
-    validate_send(sent_length, sizeof(PPCB_CONN_packet), true, PPCB_TCP, "sending CONN");
+    set_CONN(&data_to_send, session_id, PPCB_TCP | (extended ? PPCB_EXTENDED : 0),
+             byte_sequence_length);
+    PPCB_CONN_extension extension;
+    set_CONN_extension(&extension, 1, *payload_size, 0);
+
+    struct iovec vector[] = {
+        {.iov_base = &data_to_send, .iov_len = sizeof(PPCB_CONN_packet)},
+        {.iov_base = &extension, .iov_len = sizeof(PPCB_CONN_extension)}
+    };
+    ssize_t sent_length = send_vector_tcp(socket_fd, vector, extended ? 2 : 1);
+    validate_send(sent_length, conn_length, true, PPCB_TCP, "sending CONN");
+    uint64_t sent_at = monotonic_usec();
 
     client_receives_RESPONSE(socket_fd, session_id, PPCB_CONACC);
+    stats_rtt(monotonic_usec() - sent_at);
+    if (!extended) {
+        return;
+    }
+
+    PPCB_CONN_extension granted;
+    ssize_t received_length = receive_packet_tcp(socket_fd, sizeof(PPCB_CONN_extension),
+                                                 &granted);
+    validate_receive(received_length, sizeof(PPCB_CONN_extension), true,
+                     PPCB_TCP, "receiving CONACC");
+    stats_received(sizeof(PPCB_CONN_extension), 0);
+    granted.payload_size = be32toh(granted.payload_size);
+    if (granted.payload_size == 0 || granted.payload_size > *payload_size || granted.flags != 0) {
+        fatal("receiving CONACC");
+    }
+
+    *payload_size = granted.payload_size;
 }
 
 
 static void client_send_bytes_to_server(
         int                   socket_fd,
         uint64_t              session_id,
-        uint64_t              byte_sequence_length,
-        char*                 byte_sequence
+        PPCB_input            *input,
+        bool                  use_sendfile,
+        uint32_t              payload_size
 ) {
-    static char buffer[BUFFER_SIZE];
-
     // Data exchange.
     ssize_t sent_length;
     uint64_t bytes_send = 0, packet_number = 0;
-    uint32_t max_size = min(PACKET_SIZE, MAX_PACKET_SIZE);
+    uint64_t byte_sequence_length = input->length;
+    char *byte_sequence = input->data;
+
+    // Only mapped files have a descriptor to send from.
+    use_sendfile = use_sendfile && input->fd >= 0;
+    off_t file_offset = input->data - input->mapping;
 
     while (bytes_send < byte_sequence_length) {
-        uint32_t current_send = min((uint64_t)max_size, byte_sequence_length - bytes_send);
+        uint32_t current_send = min((uint64_t)payload_size, byte_sequence_length - bytes_send);
         uint32_t message_length = sizeof(PPCB_DATA_packet) + current_send;
 
-        // Coping packet to the buffer.
         PPCB_DATA_packet data_packet;
         set_DATA(&data_packet, session_id, packet_number, current_send);
-        memcpy(buffer, &data_packet, sizeof(PPCB_DATA_packet));
-        memcpy(buffer + sizeof(PPCB_DATA_packet), byte_sequence + bytes_send, current_send);
 
         // Sending packet.
-        sent_length = send_packet_tcp(socket_fd, message_length, buffer);
+        if (use_sendfile) {
+            sent_length = send_file_tcp(socket_fd, sizeof(PPCB_DATA_packet), &data_packet,
+                                        input->fd, file_offset + bytes_send, current_send);
+        }
+        else {
+            // Header and payload go out together, the payload straight from the byte sequence.
+            struct iovec vector[] = {
+                {.iov_base = &data_packet, .iov_len = sizeof(PPCB_DATA_packet)},
+                {.iov_base = byte_sequence + bytes_send, .iov_len = current_send}
+            };
+            sent_length = send_vector_tcp(socket_fd, vector, 2);
+        }
         validate_send(sent_length, message_length, true, PPCB_TCP, "sending DATA");
 
         bytes_send += (uint64_t) current_send;
         packet_number++;
+        input_release(input, bytes_send);
     }
 }
 
@@ -122,12 +230,14 @@ void send_bytes_tcp(
         int                   socket_fd,
         struct sockaddr_in    server_address,
         uint64_t              session_id,
-        uint64_t              byte_sequence_length,
-        char*                 byte_sequence
+        PPCB_input            *input,
+        bool                  use_sendfile,
+        uint32_t              payload_size
 ) {
-    client_initialise_connection(socket_fd, server_address, session_id, byte_sequence_length);
+    client_initialise_connection(socket_fd, server_address, session_id, input->length,
+                                 &payload_size);
 
-    client_send_bytes_to_server(socket_fd, session_id, byte_sequence_length, byte_sequence);
+    client_send_bytes_to_server(socket_fd, session_id, input, use_sendfile, payload_size);
 
     client_receives_RESPONSE(socket_fd, session_id, PPCB_RCVD);
 }
@@ -143,7 +253,11 @@ static void server_sends_RJT_tcp(
     set_PACKET_RESPONSE(&reject_packet, PPCB_RJT, session_id, packet_number);
     ssize_t sent_length = send_packet_tcp(client_fd, sizeof(PPCB_PACKET_RESPONSE_packet),
                                           &reject_packet);
-    validate_send(sent_length, sizeof(PPCB_PACKET_RESPONSE_packet), false, PPCB_TCP, "sending RJT");
+    if (validate_send(sent_length, sizeof(PPCB_PACKET_RESPONSE_packet), false, PPCB_TCP,
+                      "sending RJT")) {
+        stats_rejected();
+        metrics_add(METRIC_RJT_SENT, 1);
+    }
 }
 
 static void server_sends_RESPONSE(
@@ -155,14 +269,116 @@ static void server_sends_RESPONSE(
     PPCB_RESPONSE_packet data_response;
     set_RESPONSE(&data_response, sending, session_id);
     ssize_t sent_length = send_packet_tcp(socket_fd, sizeof(PPCB_RESPONSE_packet), &data_response);
-    validate_send(sent_length, sizeof(PPCB_RESPONSE_packet), false, PPCB_TCP, error_message);
+    if (validate_send(sent_length, sizeof(PPCB_RESPONSE_packet), false, PPCB_TCP, error_message)) {
+        if (sending == PPCB_CONRJT) {
+            stats_rejected();
+            metrics_add(METRIC_CONN_REJECTED, 1);
+        } else {
+            stats_completed();
+        }
+    }
+}
+
+// Checks the header of DATA, rejecting the packet when it doesn't fit the session.
+static bool server_accepts_DATA(
+        int                 client_fd,
+        PPCB_DATA_packet    *data_packet,
+        uint64_t            session_id,
+        uint64_t            packet_number,
+        uint64_t            bytes_received,
+        uint64_t            byte_sequence_length,
+        uint32_t            payload_size
+) {
+    data_packet->packet_number = be64toh(data_packet->packet_number);
+    data_packet->packet_byte_sequence_length = be32toh(data_packet->packet_byte_sequence_length);
+
+    if (data_packet->id != PPCB_DATA ||
+        !validate_data_packet(data_packet, PPCB_TCP, session_id, packet_number,
+                              bytes_received, byte_sequence_length, payload_size)
+        ) {
+        error("invalid DATA");
+        if (data_packet->id == PPCB_DATA) {
+            server_sends_RJT_tcp(client_fd, session_id, packet_number);
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+// Whether CONN announces an extension, which is read right after it.
+static bool CONN_extended(
+        const PPCB_CONN_packet  *data_received
+) {
+    return data_received->id == PPCB_CONN && (data_received->protocol_id & PPCB_EXTENDED) != 0;
+}
+
+// Checks CONN and answers it with CONACC, or with CONRJT when it is invalid or the session
+// can't be written out. The extension, if CONN has one (NULL otherwise), holds the granted
+// values afterwards; payload_size is set to the largest payload DATA may carry.
+static bool server_accepts_CONN(
+        int                     client_fd,
+        PPCB_CONN_packet        *data_received,
+        PPCB_CONN_extension     *extension,
+        uint32_t                *payload_size,
+        PPCB_output             *output
+) {
+    size_t conn_length = sizeof(PPCB_CONN_packet) +
+                         ((extension != NULL) ? sizeof(PPCB_CONN_extension) : 0);
+    stats_received(conn_length, 1);
+
+    data_received->byte_sequence_length = be64toh(data_received->byte_sequence_length);
+    data_received->protocol_id &= ~PPCB_EXTENDED;
+    *payload_size = MAX_PACKET_SIZE;
+
+    if (extension != NULL) {
+        extension->payload_size = be32toh(extension->payload_size);
+        *payload_size = min(extension->payload_size, MAX_TCP_PAYLOAD);
+        // No options are granted over TCP.
+        set_CONN_extension(extension, 1, *payload_size, 0);
+    }
+
+    if (data_received->id != PPCB_CONN || data_received->protocol_id != PPCB_TCP ||
+        data_received->byte_sequence_length == 0 || *payload_size == 0) {
+        error("invalid CONN");
+
+        if (data_received->id == PPCB_CONN) {
+            server_sends_RESPONSE(client_fd, data_received->session_id, PPCB_CONRJT);
+        }
+
+        return false;
+    }
+
+    if (!output_open_session(output, data_received->session_id,
+                             data_received->byte_sequence_length)) {
+        server_sends_RESPONSE(client_fd, data_received->session_id, PPCB_CONRJT);
+        return false;
+    }
+    stats_session(data_received->session_id);
+
+    // Responding to client.
+    PPCB_RESPONSE_packet data_to_send;
+    set_RESPONSE(&data_to_send, PPCB_CONACC, data_received->session_id);
+
+    struct iovec vector[] = {
+        {.iov_base = &data_to_send, .iov_len = sizeof(PPCB_RESPONSE_packet)},
+        {.iov_base = extension, .iov_len = sizeof(PPCB_CONN_extension)}
+    };
+    int vector_length = (extension != NULL) ? 2 : 1;
+    size_t expected_length = sizeof(PPCB_RESPONSE_packet) +
+                             ((extension != NULL) ? sizeof(PPCB_CONN_extension) : 0);
+    ssize_t sent_length = send_vector_tcp(client_fd, vector, vector_length);
+    return validate_send(sent_length, expected_length, false, PPCB_TCP, "sending CONACC");
 }
 
 static bool server_receive_bytes(
-        int         client_fd,
-        uint64_t    session_id,
-        uint64_t    byte_sequence_length,
-        char        *buffer
+        int             client_fd,
+        uint64_t        session_id,
+        uint64_t        byte_sequence_length,
+        uint32_t        payload_size,
+        PPCB_output     *output,
+        char            *buffer
 ) {
     uint64_t bytes_received = 0, packet_number = 0;
     ssize_t received_length;
@@ -175,18 +391,8 @@ static bool server_receive_bytes(
             return false;
         }
 
-        data_packet.packet_number = be64toh(data_packet.packet_number);
-        data_packet.packet_byte_sequence_length = be32toh(data_packet.packet_byte_sequence_length);
-
-        if (data_packet.id != PPCB_DATA ||
-            !validate_data_packet(&data_packet, PPCB_TCP, session_id, packet_number,
-                                  bytes_received, byte_sequence_length)
-            ) {
-            error("invalid DATA");
-            if (data_packet.id == PPCB_DATA) {
-                server_sends_RJT_tcp(client_fd, session_id, packet_number);
-            }
-
+        if (!server_accepts_DATA(client_fd, &data_packet, session_id, packet_number,
+                                 bytes_received, byte_sequence_length, payload_size)) {
             return false;
         }
 
@@ -198,9 +404,13 @@ static bool server_receive_bytes(
             server_sends_RJT_tcp(client_fd, session_id, packet_number);
             return false;
         }
+        stats_received(sizeof(PPCB_DATA_packet) + data_packet.packet_byte_sequence_length, 1);
 
-        printf("%.*s", data_packet.packet_byte_sequence_length, buffer + sizeof(PPCB_DATA_packet));
-        fflush(stdout);
+        if (!output_write(output, buffer + sizeof(PPCB_DATA_packet),
+                          data_packet.packet_byte_sequence_length)) {
+            return false;
+        }
+        stats_delivered(data_packet.packet_byte_sequence_length);
 
         bytes_received += (uint64_t) data_packet.packet_byte_sequence_length;
         packet_number++;
@@ -212,44 +422,218 @@ static bool server_receive_bytes(
 /// TCP SERVER FUNCTION ///
 
 void handle_connection_tcp(
-        int     client_fd,
-        char    *buffer
+        int             client_fd,
+        PPCB_output     *output,
+        char            *buffer
 ) {
+    set_timeout_tcp(client_fd);
+
     // Receiving CONN packet.
     PPCB_CONN_packet data_received;
-    ssize_t sent_length;
+    PPCB_CONN_extension extension;
+    uint32_t payload_size;
     ssize_t received_length = receive_packet_tcp(client_fd, sizeof(PPCB_CONN_packet), &data_received);
     if (!validate_receive(received_length, sizeof(PPCB_CONN_packet), false,
                           PPCB_TCP,"receiving CONN")) {
+        output_close_session(output);
+        return;
+    }
+
+    bool extended = CONN_extended(&data_received);
+    if (extended) {
+        received_length = receive_packet_tcp(client_fd, sizeof(PPCB_CONN_extension), &extension);
+    }
+    if ((extended && !validate_receive(received_length, sizeof(PPCB_CONN_extension), false,
+                                       PPCB_TCP, "receiving CONN")) ||
+        !server_accepts_CONN(client_fd, &data_received, extended ? &extension : NULL,
+                             &payload_size, output)) {
+        output_close_session(output);
         return;
     }
 
     uint64_t session_id = data_received.session_id;
-    uint64_t byte_sequence_length = be64toh(data_received.byte_sequence_length);
+    uint64_t byte_sequence_length = data_received.byte_sequence_length;
 
-    if (data_received.id != PPCB_CONN || data_received.protocol_id != PPCB_TCP ||
-        byte_sequence_length == 0) {
-        error("invalid CONN");
+    bool received = server_receive_bytes(client_fd, session_id, byte_sequence_length,
+                                         payload_size, output, buffer);
+    if (!output_close_session(output) || !received) {
+        return;
+    }
 
-        if (data_received.id == PPCB_CONN) {
-            server_sends_RESPONSE(client_fd, session_id, PPCB_CONRJT);
-        }
+    server_sends_RESPONSE(client_fd, session_id, PPCB_RCVD);
+}
 
-        return;
+/// EVENT-DRIVEN TCP SERVER ///
+
+void connection_tcp_init(
+        PPCB_tcp_connection     *connection,
+        int                     client_fd,
+        PPCB_flush_policy       policy
+) {
+    *connection = (PPCB_tcp_connection) {
+        .fd                             = client_fd,
+        .state                          = PPCB_TCP_READING_CONN,
+        .payload                        = malloc(MAX_PACKET_SIZE)
+    };
+    ASSERT_MALLOC(connection->payload);
+
+    output_init(&connection->output, STDOUT_FILENO, policy);
+    stats_init(&connection->stats, "server", PPCB_TCP);
+    timer_init(&connection->timer, connection);
+}
+
+// Where the part of the packet awaited in the current state goes, and how long it is.
+static void connection_tcp_part(
+        PPCB_tcp_connection     *connection,
+        char                    **part,
+        size_t                  *length
+) {
+    switch (connection->state) {
+        case PPCB_TCP_READING_CONN:
+            *part = (char *) &connection->conn_packet;
+            *length = sizeof(PPCB_CONN_packet);
+            break;
+        case PPCB_TCP_READING_EXTENSION:
+            *part = (char *) &connection->extension;
+            *length = sizeof(PPCB_CONN_extension);
+            break;
+        case PPCB_TCP_READING_HEADER:
+            *part = (char *) &connection->data_packet;
+            *length = sizeof(PPCB_DATA_packet);
+            break;
+        default: // PPCB_TCP_READING_PAYLOAD
+            *part = connection->payload;
+            *length = connection->data_packet.packet_byte_sequence_length;
+            break;
     }
+}
 
-    // Responding to client.
-    PPCB_RESPONSE_packet data_to_send;
-    set_RESPONSE(&data_to_send, PPCB_CONACC, session_id);
-    sent_length = send_packet_tcp(client_fd, sizeof(PPCB_RESPONSE_packet), &data_to_send);
-    if (!validate_send(sent_length, sizeof(PPCB_RESPONSE_packet), false,
-                       PPCB_TCP, "sending CONACC")) {
-        return;
+// Acts on a completely read part. Returns whether the connection goes on.
+static bool connection_tcp_advance(
+        PPCB_tcp_connection     *connection
+) {
+    switch (connection->state) {
+        case PPCB_TCP_READING_CONN:
+        case PPCB_TCP_READING_EXTENSION:
+            if (connection->state == PPCB_TCP_READING_CONN &&
+                CONN_extended(&connection->conn_packet)) {
+                connection->state = PPCB_TCP_READING_EXTENSION;
+                return true;
+            }
+
+            if (!server_accepts_CONN(connection->fd, &connection->conn_packet,
+                                     (connection->state == PPCB_TCP_READING_EXTENSION)
+                                     ? &connection->extension : NULL,
+                                     &connection->payload_size, &connection->output)) {
+                return false;
+            }
+
+            // Payloads above the usual size get a buffer to match.
+            if (connection->payload_size > MAX_PACKET_SIZE) {
+                char *payload = realloc(connection->payload, connection->payload_size);
+                ASSERT_MALLOC(payload);
+                connection->payload = payload;
+            }
+
+            connection->session_id = connection->conn_packet.session_id;
+            connection->byte_sequence_length = connection->conn_packet.byte_sequence_length;
+            connection->state = PPCB_TCP_READING_HEADER;
+            return true;
+
+        case PPCB_TCP_READING_HEADER:
+            if (!server_accepts_DATA(connection->fd, &connection->data_packet,
+                                     connection->session_id, connection->packet_number,
+                                     connection->bytes_received,
+                                     connection->byte_sequence_length,
+                                     connection->payload_size)) {
+                return false;
+            }
+            connection->state = PPCB_TCP_READING_PAYLOAD;
+            return true;
+
+        case PPCB_TCP_READING_PAYLOAD:
+            stats_received(sizeof(PPCB_DATA_packet) +
+                           connection->data_packet.packet_byte_sequence_length, 1);
+            if (!output_write(&connection->output, connection->payload,
+                              connection->data_packet.packet_byte_sequence_length)) {
+                return false;
+            }
+            stats_delivered(connection->data_packet.packet_byte_sequence_length);
+            connection->bytes_received += connection->data_packet.packet_byte_sequence_length;
+            connection->packet_number++;
+            connection->state = PPCB_TCP_READING_HEADER;
+
+            if (connection->bytes_received < connection->byte_sequence_length) {
+                return true;
+            }
+
+            if (output_flush(&connection->output)) {
+                server_sends_RESPONSE(connection->fd, connection->session_id, PPCB_RCVD);
+            }
+            return false;
     }
 
-    if (!server_receive_bytes(client_fd, session_id, byte_sequence_length, buffer)) {
-        return;
+    return false;
+}
+
+bool connection_tcp_receive(
+        PPCB_tcp_connection     *connection
+) {
+    static char *const error_messages[] = {
+        [PPCB_TCP_READING_CONN]         = "receiving CONN",
+        [PPCB_TCP_READING_EXTENSION]    = "receiving CONN",
+        [PPCB_TCP_READING_HEADER]       = "receiving DATA",
+        [PPCB_TCP_READING_PAYLOAD]      = "receiving DATA"
+    };
+    size_t budget = CONNECTION_READ_BUDGET;
+
+    while (budget > 0) {
+        char *part;
+        size_t length;
+        connection_tcp_part(connection, &part, &length);
+
+        ssize_t read_length = read(connection->fd, part + connection->received,
+                                   length - connection->received);
+        if (read_length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        else if (read_length < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (read_length <= 0) {
+            if (read_length < 0) {
+                sys_error("read");
+            } else {
+                error(error_messages[connection->state]);
+            }
+
+            if (connection->state == PPCB_TCP_READING_PAYLOAD) {
+                server_sends_RJT_tcp(connection->fd, connection->session_id,
+                                     connection->packet_number);
+            }
+            return false;
+        }
+
+        connection->received += read_length;
+        budget -= min(budget, (size_t) read_length);
+        if (connection->received < length) {
+            continue;
+        }
+
+        connection->received = 0;
+        if (!connection_tcp_advance(connection)) {
+            return false;
+        }
     }
 
-    server_sends_RESPONSE(client_fd, session_id, PPCB_RCVD);
+    // Other connections get their turn; epoll reports the rest again.
+    return true;
+}
+
+void connection_tcp_destroy(
+        PPCB_tcp_connection     *connection
+) {
+    output_destroy(&connection->output);
+    free(connection->payload);
+    close(connection->fd);
 }
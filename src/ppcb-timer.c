@@ -0,0 +1,232 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "ppcb-timer.h"
+#include "ppcb-common.h"
+
+
+/// SLOTS ///
+
+static void slot_push(
+        PPCB_timer  **slot,
+        PPCB_timer  *timer
+) {
+    timer->slot = slot;
+    timer->previous = NULL;
+    timer->next = *slot;
+
+    if (*slot != NULL) {
+        (*slot)->previous = timer;
+    }
+    *slot = timer;
+}
+
+static void slot_unlink(
+        PPCB_timer  *timer
+) {
+    if (timer->previous != NULL) {
+        timer->previous->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+
+    if (timer->next != NULL) {
+        timer->next->previous = timer->previous;
+    }
+    timer->slot = NULL;
+}
+
+/// TIMER WHEEL ///
+
+// Ticks spanned by one slot of a level.
+static uint64_t level_span(
+        int     level
+) {
+    return 1ULL << (TIMER_SLOT_BITS * level);
+}
+
+// Puts the timer on the lowest level whose slots still tell its tick apart from the current one.
+static void timer_place(
+        PPCB_timer_wheel    *wheel,
+        PPCB_timer          *timer
+) {
+    // Rounded up, so a timer never fires early.
+    uint64_t expires = (timer->deadline + TIMER_TICK_USEC - 1) / TIMER_TICK_USEC;
+    if (expires < wheel->tick) {
+        slot_push(&wheel->expired, timer);
+        return;
+    }
+
+    uint64_t delta = expires - wheel->tick;
+    if (delta >= level_span(TIMER_LEVELS)) {
+        expires = wheel->tick + level_span(TIMER_LEVELS) - 1;
+        delta = expires - wheel->tick;
+    }
+
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= level_span(level + 1)) {
+        level++;
+    }
+
+    size_t index = (expires >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+    slot_push(&wheel->slots[level][index], timer);
+}
+
+// Brings the timers of the current slot of a level down to the levels below.
+static void wheel_cascade(
+        PPCB_timer_wheel    *wheel,
+        int                 level
+) {
+    size_t index = (wheel->tick >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+    PPCB_timer *timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+
+    while (timer != NULL) {
+        PPCB_timer *next = timer->next;
+        timer_place(wheel, timer);
+        timer = next;
+    }
+}
+
+// Processes every tick up to now, moving the timers due to the expired list.
+static void wheel_advance(
+        PPCB_timer_wheel    *wheel,
+        uint64_t            now
+) {
+    uint64_t target = now / TIMER_TICK_USEC;
+
+    if (wheel->count == 0) {
+        wheel->tick = (target + 1 > wheel->tick) ? target + 1 : wheel->tick;
+        return;
+    }
+
+    for (; wheel->tick <= target; wheel->tick++) {
+        // Whenever a level wraps around, the next slot of the level above comes down.
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            if ((wheel->tick & (level_span(level) - 1)) != 0) {
+                break;
+            }
+            wheel_cascade(wheel, level);
+        }
+
+        PPCB_timer **slot = &wheel->slots[0][wheel->tick & (TIMER_SLOTS - 1)];
+        while (*slot != NULL) {
+            PPCB_timer *timer = *slot;
+            slot_unlink(timer);
+            slot_push(&wheel->expired, timer);
+        }
+    }
+}
+
+void timer_wheel_init(
+        PPCB_timer_wheel    *wheel,
+        uint64_t            now
+) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->tick = now / TIMER_TICK_USEC;
+}
+
+void timer_init(
+        PPCB_timer  *timer,
+        void        *data
+) {
+    *timer = (PPCB_timer) {
+        .deadline                       = 0,
+        .data                           = data,
+        .slot                           = NULL,
+        .previous                       = NULL,
+        .next                           = NULL
+    };
+}
+
+void timer_schedule(
+        PPCB_timer_wheel    *wheel,
+        PPCB_timer          *timer,
+        uint64_t            deadline
+) {
+    if (timer->slot != NULL) {
+        slot_unlink(timer);
+    } else {
+        wheel->count++;
+    }
+
+    timer->deadline = deadline;
+    timer_place(wheel, timer);
+}
+
+void timer_cancel(
+        PPCB_timer_wheel    *wheel,
+        PPCB_timer          *timer
+) {
+    if (timer->slot == NULL) {
+        return;
+    }
+
+    slot_unlink(timer);
+    wheel->count--;
+}
+
+PPCB_timer *timer_wheel_expire(
+        PPCB_timer_wheel    *wheel,
+        uint64_t            now
+) {
+    wheel_advance(wheel, now);
+
+    while (wheel->expired != NULL) {
+        PPCB_timer *timer = wheel->expired;
+        slot_unlink(timer);
+
+        // Only a deadline beyond the span of the wheel comes down before it is due.
+        if (timer->deadline > now) {
+            timer_place(wheel, timer);
+            continue;
+        }
+
+        wheel->count--;
+        return timer;
+    }
+
+    return NULL;
+}
+
+uint64_t timer_wheel_timeout(
+        const PPCB_timer_wheel  *wheel,
+        uint64_t                now
+) {
+    if (wheel->count == 0) {
+        return 0;
+    }
+    if (wheel->expired != NULL) {
+        return 1;
+    }
+
+    uint64_t wake = UINT64_MAX;
+
+    for (uint64_t i = 0; i < TIMER_SLOTS; i++) {
+        if (wheel->slots[0][(wheel->tick + i) & (TIMER_SLOTS - 1)] != NULL) {
+            wake = wheel->tick + i;
+            break;
+        }
+    }
+
+    // A higher level only needs a look when its next occupied slot comes down.
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+        uint64_t base = wheel->tick >> (TIMER_SLOT_BITS * level);
+
+        for (uint64_t i = 0; i <= TIMER_SLOTS; i++) {
+            uint64_t cascade = (base + i) << (TIMER_SLOT_BITS * level);
+            if (cascade < wheel->tick) {
+                continue;
+            }
+            if (wheel->slots[level][(base + i) & (TIMER_SLOTS - 1)] != NULL) {
+                wake = min(wake, cascade);
+                break;
+            }
+        }
+    }
+
+    uint64_t wake_at = wake * TIMER_TICK_USEC;
+    return (wake != UINT64_MAX && wake_at > now) ? wake_at - now : 1;
+}
@@ -0,0 +1,204 @@
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+#include "ppcb-timestamp.h"
+#include "ppcb-histogram.h"
+
+
+/// KERNEL TIMESTAMPS ///
+
+// Set by timestamp_use before any session starts, read-only afterwards.
+static bool used = false;
+static PPCB_histogram *send_stack = NULL;
+
+void timestamp_use(
+        PPCB_histogram  *histogram
+) {
+    used = true;
+    send_stack = histogram;
+}
+
+bool timestamp_used(void) {
+    return used;
+}
+
+static uint64_t timespec_nsec(
+        const struct timespec   *time
+) {
+    return (uint64_t) time->tv_sec * 1000000000 + (uint64_t) time->tv_nsec;
+}
+
+uint64_t realtime_nsec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return timespec_nsec(&now);
+}
+
+bool timestamp_receive(
+        int     socket_fd
+) {
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE |
+                SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    return setsockopt(socket_fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0;
+}
+
+// The stamp of SCM_TIMESTAMPING: the hardware one if the NIC made it, the software one
+// otherwise, 0 if there's none.
+static uint64_t stamp_of(
+        struct msghdr   *message
+) {
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(message); header != NULL;
+         header = CMSG_NXTHDR(message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping stamps;
+            memcpy(&stamps, CMSG_DATA(header), sizeof(stamps));
+
+            uint64_t hardware = timespec_nsec(&stamps.ts[2]);
+            return (hardware != 0) ? hardware : timespec_nsec(&stamps.ts[0]);
+        }
+    }
+
+    return 0;
+}
+
+uint64_t timestamp_arrival(
+        struct msghdr   *message
+) {
+    return stamp_of(message);
+}
+
+/// TRANSMIT TIMESTAMPS ///
+
+// Times of the sends awaiting their stamps, by the key the kernel numbers the sends with
+// (SOF_TIMESTAMPING_OPT_ID, counted from 0 when it is turned on); 0 once a send is stamped.
+static struct {
+    uint32_t    next_key;
+    uint64_t    sent_at[TIMESTAMP_TX_RING];
+} sends;
+
+bool timestamp_transmit(
+        int     socket_fd
+) {
+    memset(&sends, 0, sizeof(sends));
+
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    return setsockopt(socket_fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0;
+}
+
+void timestamp_sent(
+        uint64_t    sent_at,
+        uint32_t    count
+) {
+    for (uint32_t i = 0; i < count; i++) {
+        sends.sent_at[(sends.next_key + i) % TIMESTAMP_TX_RING] = sent_at;
+    }
+    sends.next_key += count;
+}
+
+// The key of a transmit stamp, false for other messages of the error queue.
+static bool key_of(
+        struct msghdr   *message,
+        uint32_t        *key
+) {
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(message); header != NULL;
+         header = CMSG_NXTHDR(message, header)) {
+        if (header->cmsg_level == IPPROTO_IP && header->cmsg_type == IP_RECVERR) {
+            struct sock_extended_err error;
+            memcpy(&error, CMSG_DATA(header), sizeof(error));
+            if (error.ee_errno == ENOMSG && error.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+                *key = error.ee_data;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void timestamp_collect(
+        int     socket_fd
+) {
+    char control[512];
+    char data[64];
+
+    for (;;) {
+        struct iovec vector = {.iov_base = data, .iov_len = sizeof(data)};
+        struct msghdr message = {
+            .msg_iov                    = &vector,
+            .msg_iovlen                 = 1,
+            .msg_control                = control,
+            .msg_controllen             = sizeof(control)
+        };
+
+        if (recvmsg(socket_fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return;
+        }
+
+        uint32_t key;
+        uint64_t stamp = stamp_of(&message);
+        if (!key_of(&message, &key) || stamp == 0) {
+            continue;
+        }
+
+        // Keys from before the ring wrapped around, or stamped already, are dropped.
+        uint64_t *sent_at = &sends.sent_at[key % TIMESTAMP_TX_RING];
+        if (sends.next_key - key - 1 >= TIMESTAMP_TX_RING || *sent_at == 0) {
+            continue;
+        }
+
+        if (send_stack != NULL) {
+            histogram_record(send_stack, (stamp > *sent_at) ? stamp - *sent_at : 0);
+        }
+        *sent_at = 0;
+    }
+}
+
+/// ONE-WAY DELAY ///
+
+void delay_init(
+        PPCB_delay  *delay
+) {
+    memset(delay, 0, sizeof(PPCB_delay));
+    histogram_init(&delay->one_way_delay);
+    histogram_init(&delay->jitter);
+    histogram_init(&delay->receive_stack);
+}
+
+void delay_record(
+        PPCB_delay  *delay,
+        uint64_t    sent_at,
+        uint64_t    arrived_at,
+        uint64_t    read_at
+) {
+    if (arrived_at != 0) {
+        histogram_record(&delay->receive_stack, (read_at > arrived_at) ? read_at - arrived_at : 0);
+    }
+    else {
+        arrived_at = read_at;
+    }
+
+    // Unsynchronised clocks may put the arrival before the send; the jitter is still right.
+    int64_t one_way_delay = (int64_t) (arrived_at - sent_at);
+    histogram_record(&delay->one_way_delay, (one_way_delay > 0) ? (uint64_t) one_way_delay : 0);
+
+    if (delay->has_previous) {
+        int64_t difference = one_way_delay - delay->previous_delay;
+        uint64_t jitter = (uint64_t) ((difference < 0) ? -difference : difference);
+        histogram_record(&delay->jitter, jitter);
+
+        // J += (|D| - J) / 16
+        int64_t smoothed = (int64_t) delay->interarrival_jitter;
+        delay->interarrival_jitter = (uint64_t) (smoothed + ((int64_t) jitter - smoothed) / 16);
+    }
+    delay->previous_delay = one_way_delay;
+    delay->has_previous = true;
+}
@@ -0,0 +1,327 @@
+#include "ppcb-trace.h"
+
+#ifdef PPCB_TRACE
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+
+
+/// RINGS ///
+
+// Threads which get a ring; the events of later ones are dropped.
+#define TRACE_MAX_THREADS 256
+
+// The value of an instant event's duration.
+#define INSTANT UINT64_MAX
+
+typedef struct {
+    _Atomic uint64_t    sequence;       // Index of the event plus one, 0 while it is written.
+    const char          *name;
+    uint64_t            started_at;
+    uint64_t            duration;       // INSTANT for an event without one.
+    int64_t             value;
+} PPCB_trace_event;
+
+// Written only by its thread, which never waits for the dump: the dump takes an event only
+// if its sequence is the same before and after reading it.
+typedef struct {
+    _Atomic uint64_t    head;           // Events ever recorded.
+    pid_t               thread_id;
+    PPCB_trace_event    events[TRACE_RING_SIZE];
+} PPCB_trace_ring;
+
+static PPCB_trace_ring *rings[TRACE_MAX_THREADS];
+static _Atomic size_t ring_count = 0;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread PPCB_trace_ring *ring = NULL;
+static __thread bool ringless = false;
+
+static pthread_once_t installed = PTHREAD_ONCE_INIT;
+static char trace_file[256];
+
+static uint64_t monotonic_nsec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+static void install(void);
+
+static PPCB_trace_ring *register_thread(void) {
+    pthread_once(&installed, install);
+
+    PPCB_trace_ring *new_ring = calloc(1, sizeof(PPCB_trace_ring));
+    ASSERT_MALLOC(new_ring);
+    new_ring->thread_id = gettid();
+
+    pthread_mutex_lock(&ring_lock);
+    size_t index = atomic_load_explicit(&ring_count, memory_order_relaxed);
+    if (index < TRACE_MAX_THREADS) {
+        rings[index] = new_ring;
+        atomic_store_explicit(&ring_count, index + 1, memory_order_release);
+        ring = new_ring;
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    if (ring != new_ring) {
+        free(new_ring);
+        ringless = true;
+    }
+    return ring;
+}
+
+static void record(
+        const char  *name,
+        uint64_t    started_at,
+        uint64_t    duration,
+        int64_t     value
+) {
+    if (ring == NULL && (ringless || register_thread() == NULL)) {
+        return;
+    }
+
+    uint64_t index = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    PPCB_trace_event *event = &ring->events[index % TRACE_RING_SIZE];
+
+    atomic_store_explicit(&event->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    event->name = name;
+    event->started_at = started_at;
+    event->duration = duration;
+    event->value = value;
+    atomic_store_explicit(&event->sequence, index + 1, memory_order_release);
+    atomic_store_explicit(&ring->head, index + 1, memory_order_release);
+}
+
+/// TRACE POINTS ///
+
+PPCB_trace_span trace_begin(
+        const char  *name,
+        int64_t     value
+) {
+    return (PPCB_trace_span) {.name = name, .started_at = monotonic_nsec(), .value = value};
+}
+
+void trace_end(
+        PPCB_trace_span *span
+) {
+    record(span->name, span->started_at, monotonic_nsec() - span->started_at, span->value);
+}
+
+void trace_instant(
+        const char  *name,
+        int64_t     value
+) {
+    record(name, monotonic_nsec(), INSTANT, value);
+}
+
+/// DUMP ///
+
+// The dump runs in signal handlers, so it formats by hand and only calls write.
+typedef struct {
+    int     fd;
+    size_t  length;
+    char    buffer[8192];
+} PPCB_trace_output;
+
+static void trace_output_flush(
+        PPCB_trace_output   *output
+) {
+    size_t written = 0;
+    while (written < output->length) {
+        ssize_t result = write(output->fd, output->buffer + written, output->length - written);
+        if (result <= 0) {
+            break;
+        }
+        written += (size_t) result;
+    }
+    output->length = 0;
+}
+
+static void trace_output_string(
+        PPCB_trace_output   *output,
+        const char          *string
+) {
+    for (; *string != '\0'; string++) {
+        if (output->length == sizeof(output->buffer)) {
+            trace_output_flush(output);
+        }
+        output->buffer[output->length++] = *string;
+    }
+}
+
+static void trace_output_unsigned(
+        PPCB_trace_output   *output,
+        uint64_t            value
+) {
+    char digits[21];
+    size_t position = sizeof(digits) - 1;
+    digits[position] = '\0';
+    do {
+        digits[--position] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    trace_output_string(output, digits + position);
+}
+
+static void trace_output_signed(
+        PPCB_trace_output   *output,
+        int64_t             value
+) {
+    if (value < 0) {
+        trace_output_string(output, "-");
+        trace_output_unsigned(output, -(uint64_t) value);
+    }
+    else {
+        trace_output_unsigned(output, (uint64_t) value);
+    }
+}
+
+// Chrome traces count microseconds; the fraction keeps the nanoseconds.
+static void trace_output_usec(
+        PPCB_trace_output   *output,
+        uint64_t            nsec
+) {
+    trace_output_unsigned(output, nsec / 1000);
+    trace_output_string(output, ".");
+    uint64_t fraction = nsec % 1000;
+    trace_output_string(output, (fraction < 100) ? ((fraction < 10) ? "00" : "0") : "");
+    trace_output_unsigned(output, fraction);
+}
+
+static void trace_output_event(
+        PPCB_trace_output       *output,
+        const PPCB_trace_event  *event,
+        pid_t                   thread_id,
+        bool                    first
+) {
+    trace_output_string(output, first ? "\n{\"name\":\"" : ",\n{\"name\":\"");
+    trace_output_string(output, event->name);
+    trace_output_string(output, "\",\"cat\":\"ppcb\",\"ph\":\"");
+    trace_output_string(output, (event->duration == INSTANT) ? "i\",\"s\":\"t" : "X");
+    trace_output_string(output, "\",\"ts\":");
+    trace_output_usec(output, event->started_at);
+    if (event->duration != INSTANT) {
+        trace_output_string(output, ",\"dur\":");
+        trace_output_usec(output, event->duration);
+    }
+    trace_output_string(output, ",\"pid\":");
+    trace_output_unsigned(output, (uint64_t) getpid());
+    trace_output_string(output, ",\"tid\":");
+    trace_output_unsigned(output, (uint64_t) thread_id);
+    trace_output_string(output, ",\"args\":{\"value\":");
+    trace_output_signed(output, event->value);
+    trace_output_string(output, "}}");
+}
+
+static atomic_flag dumping = ATOMIC_FLAG_INIT;
+
+// Writes the events the rings hold now; a dump already running in another thread or handler
+// makes this one return at once.
+static void dump(void) {
+    if (atomic_flag_test_and_set(&dumping)) {
+        return;
+    }
+
+    PPCB_trace_output output = {.length = 0};
+    output.fd = open(trace_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (output.fd < 0) {
+        atomic_flag_clear(&dumping);
+        return;
+    }
+
+    bool first = true;
+    trace_output_string(&output, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    size_t count = atomic_load_explicit(&ring_count, memory_order_acquire);
+    for (size_t i = 0; i < count; i++) {
+        PPCB_trace_ring *traced = rings[i];
+        uint64_t head = atomic_load_explicit(&traced->head, memory_order_acquire);
+        uint64_t index = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+
+        for (; index < head; index++) {
+            PPCB_trace_event *event = &traced->events[index % TRACE_RING_SIZE];
+            if (atomic_load_explicit(&event->sequence, memory_order_acquire) != index + 1) {
+                continue; // Overwritten already.
+            }
+            PPCB_trace_event copy = {
+                .name = event->name,
+                .started_at = event->started_at,
+                .duration = event->duration,
+                .value = event->value
+            };
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&event->sequence, memory_order_relaxed) != index + 1) {
+                continue;
+            }
+
+            trace_output_event(&output, &copy, traced->thread_id, first);
+            first = false;
+        }
+    }
+
+    trace_output_string(&output, "\n]}\n");
+    trace_output_flush(&output);
+    close(output.fd);
+    atomic_flag_clear(&dumping);
+}
+
+static void dump_on_signal(
+        int     signal_number
+) {
+    int saved_errno = errno;
+    dump();
+    errno = saved_errno;
+
+    // SIGINT and SIGTERM got their default action back, which ends the process as it would
+    // have without the trace.
+    if (signal_number != SIGUSR1) {
+        raise(signal_number);
+    }
+}
+
+// Dumps on the signal, unless the program handles or ignores it itself.
+static void handle(
+        int     signal_number,
+        int     flags
+) {
+    struct sigaction current;
+    if (sigaction(signal_number, NULL, &current) < 0 || current.sa_handler != SIG_DFL) {
+        return;
+    }
+
+    struct sigaction action = {.sa_handler = dump_on_signal, .sa_flags = SA_RESTART | flags};
+    sigemptyset(&action.sa_mask);
+    sigaction(signal_number, &action, NULL);
+}
+
+static void install(void) {
+    const char *path = getenv("PPCB_TRACE_FILE");
+    if (path != NULL) {
+        snprintf(trace_file, sizeof(trace_file), "%s", path);
+    }
+    else {
+        snprintf(trace_file, sizeof(trace_file), "ppcb-trace-%d.json", (int) getpid());
+    }
+
+    atexit(dump);
+    handle(SIGUSR1, 0);
+    handle(SIGINT, SA_RESETHAND);
+    handle(SIGTERM, SA_RESETHAND);
+}
+
+#endif // PPCB_TRACE
@@ -8,7 +8,14 @@
 
 #include "ppcb-udp.h"
 #include "err.h"
+#include "ppcb-batch.h"
 #include "ppcb-common.h"
+#include "ppcb-input.h"
+#include "ppcb-output.h"
+#include "ppcb-rtt.h"
+#include "ppcb-session.h"
+#include "ppcb-stats.h"
+#include "protconst.h"
 
 
 /// UDP CLIENT HELPER FUNCTIONS ///
@@ -25,23 +32,29 @@ static void client_receives_RESPONSE(
     char *error_message = (waiting_for == PPCB_CONACC) ? "receiving CONACC" : "receiving RCVD";
 
     do {
-        received_length = receive_packet_udp(socket_fd, &receive_address, buffer, false);
+        received_length = receive_packet_udp(socket_fd, &receive_address, buffer,
+                                             (uint64_t) MAX_WAIT * USEC_PER_SEC);
         if (received_length < 0) {
             sys_fatal("recvfrom");
         }
         else if (received_length == 0) {
+            stats_timed_out();
             sys_fatal("timeout");
         }
     } while (different_addresses(server_address, receive_address));
 
-    if ((size_t)received_length != sizeof(PPCB_RESPONSE_packet)) {
+    if ((size_t)received_length < sizeof(PPCB_RESPONSE_packet)) {
         fatal(error_message);
     }
 
-    // Validating return packet.
+    // Validating return packet; RJT, which is longer, is told apart by its id.
     PPCB_RESPONSE_packet data_received;
     memcpy(&data_received, buffer, sizeof(PPCB_RESPONSE_packet));
     validate_response_packet(&data_received, waiting_for, session_id);
+
+    if ((size_t)received_length != sizeof(PPCB_RESPONSE_packet)) {
+        fatal(error_message);
+    }
 }
 
 static void client_initialise_connection(
@@ -57,39 +70,45 @@ static void client_initialise_connection(
     ssize_t sent_length = send_packet_udp(socket_fd, server_address,
                                           sizeof(PPCB_CONN_packet), &data_to_send);
     validate_send(sent_length, sizeof(PPCB_CONN_packet), true, PPCB_UDP, "sending CONN");
+    uint64_t sent_at = monotonic_usec();
 
     client_receives_RESPONSE(socket_fd, server_address, session_id, buffer, PPCB_CONACC);
+    stats_rtt(monotonic_usec() - sent_at);
 }
 
 static void client_send_bytes_to_server(
         int                   socket_fd,
         struct sockaddr_in    server_address,
         uint64_t              session_id,
-        char*                 byte_sequence,
-        uint64_t              byte_sequence_length,
-        char                  *buffer
+        PPCB_input            *input,
+        uint32_t              payload_size
 ) {
     // Data exchange.
     uint64_t bytes_send = 0, packet_number = 0;
-    uint32_t max_size = min(PACKET_SIZE, MAX_PACKET_SIZE);
+    uint64_t byte_sequence_length = input->length;
+    char *byte_sequence = input->data;
 
-    while (bytes_send < byte_sequence_length) {
-        uint32_t current_send = min((uint64_t)max_size, byte_sequence_length - bytes_send);
-        size_t message_length = sizeof(PPCB_DATA_packet) + current_send;
+    PPCB_send_batch batch;
+    send_batch_init(&batch, socket_fd, server_address, PPCB_UDP);
 
-        // Coping packet to the buffer.
-        PPCB_DATA_packet data_packet;
-        set_DATA(&data_packet, session_id, packet_number, current_send);
-        memcpy(buffer, &data_packet, sizeof(PPCB_DATA_packet));
-        memcpy(buffer + sizeof(PPCB_DATA_packet), byte_sequence + bytes_send, current_send);
+    while (bytes_send < byte_sequence_length) {
+        // The server takes DATA of any size up to MAX_PACKET_SIZE, so it may shrink.
+        payload_size = send_batch_fit(&batch, payload_size);
+        uint32_t current_send = min((uint64_t)payload_size, byte_sequence_length - bytes_send);
 
-        // Sending packet
-        ssize_t sent_length = send_packet_udp(socket_fd, server_address, message_length, buffer);
-        validate_send(sent_length, message_length, true, PPCB_UDP, "sending DATA");
+        // Sending packet, once the batch is full.
+        send_batch_add_DATA(&batch, session_id, packet_number, byte_sequence + bytes_send,
+                            current_send);
 
         bytes_send += (uint64_t) current_send;
         packet_number++;
+
+        if (batch.count == 0) {
+            input_release(input, bytes_send);
+        }
     }
+
+    send_batch_flush(&batch);
 }
 
 /// UDP CLIENT FUNCTION ///
@@ -98,90 +117,141 @@ void send_bytes_udp(
         int                   socket_fd,
         struct sockaddr_in    server_address,
         uint64_t              session_id,
-        uint64_t              byte_sequence_length,
-        char*                 byte_sequence
+        PPCB_input            *input,
+        uint32_t              payload_size
 ) {
     static char buffer[BUFFER_SIZE];
 
-    client_initialise_connection(socket_fd, server_address, session_id, byte_sequence_length, buffer);
+    client_initialise_connection(socket_fd, server_address, session_id, input->length, buffer);
 
-    client_send_bytes_to_server(socket_fd, server_address, session_id, byte_sequence,
-                                byte_sequence_length, buffer);
+    client_send_bytes_to_server(socket_fd, server_address, session_id, input, payload_size);
 
     client_receives_RESPONSE(socket_fd, server_address, session_id, buffer, PPCB_RCVD);
 }
 
 /// UDP SERVER HELPER FUNCTIONS ///
 
+// Checks DATA from the client, rejecting it when it doesn't continue the session.
+// Returns the length of its payload, or -1.
+static ssize_t server_checks_DATA(
+        int                 socket_fd,
+        struct sockaddr_in  client_address,
+        uint64_t            session_id,
+        uint64_t            packet_number,
+        uint64_t            bytes_received,
+        uint64_t            byte_sequence_length,
+        const char          *datagram,
+        size_t              received_length
+) {
+    uint8_t packet_id;
+    memcpy(&packet_id, datagram, sizeof(uint8_t));
+
+    if (packet_id != PPCB_DATA || received_length < sizeof(PPCB_DATA_packet)) {
+        error("invalid DATA");
+        if (packet_id == PPCB_DATA) {
+            server_sends_RJT_udp(socket_fd, client_address, session_id, packet_number, PPCB_UDP);
+        }
+        return -1;
+    }
+
+    PPCB_DATA_packet data_packet;
+    memcpy(&data_packet, datagram, sizeof(PPCB_DATA_packet));
+
+    data_packet.packet_number = be64toh(data_packet.packet_number);
+    data_packet.packet_byte_sequence_length = be32toh(data_packet.packet_byte_sequence_length);
+    size_t message_length = sizeof(PPCB_DATA_packet) + data_packet.packet_byte_sequence_length;
+
+    if (received_length != message_length ||
+        !validate_data_packet(&data_packet, PPCB_UDP, session_id, packet_number,
+                              bytes_received, byte_sequence_length, MAX_PACKET_SIZE)
+    ) {
+        error("invalid DATA");
+        server_sends_RJT_udp(socket_fd, client_address, session_id, packet_number, PPCB_UDP);
+        return -1;
+    }
+
+    return (ssize_t) data_packet.packet_byte_sequence_length;
+}
+
+static bool server_sends_CONACC(
+        int                 socket_fd,
+        struct sockaddr_in  client_address,
+        uint64_t            session_id
+) {
+    PPCB_RESPONSE_packet data_to_send;
+    set_RESPONSE(&data_to_send, PPCB_CONACC, session_id);
+    ssize_t sent_length = send_packet_udp(socket_fd, client_address,
+                                          sizeof(PPCB_RESPONSE_packet), &data_to_send);
+    return validate_send(sent_length, sizeof(PPCB_RESPONSE_packet), false,
+                         PPCB_UDP, "sending CONACC");
+}
+
+// Payloads are kept in the receive batch and written out together once the whole batch is
+// validated, just before it is received again.
 static bool server_receive_bytes(
         int                 socket_fd,
         struct sockaddr_in  client_address,
         uint64_t            session_id,
         uint64_t            byte_sequence_length,
-        char                *buffer
+        PPCB_output         *output,
+        PPCB_receive_batch  *batch
 ) {
     uint64_t bytes_received = 0, packet_number = 0;
     struct sockaddr_in receive_address;
+    struct iovec payloads[BATCH_SIZE];
+    size_t payload_count = 0;
 
     while (bytes_received < byte_sequence_length) {
-        ssize_t received_length = receive_packet_udp(socket_fd, &receive_address, buffer, false);
+        if (payload_count == BATCH_SIZE || (payload_count > 0 && !receive_batch_pending(batch))) {
+            if (!output_write_vector(output, payloads, payload_count)) {
+                return false;
+            }
+            payload_count = 0;
+        }
+
+        char *datagram;
+        ssize_t received_length = receive_batch_next(batch, &receive_address, &datagram,
+                                                     (uint64_t) MAX_WAIT * USEC_PER_SEC);
 
         if (received_length < 0) {
             sys_error("recvfrom");
-            return false;
+            break;
         }
         else if (received_length == 0) {
+            stats_timed_out();
             sys_error("timeout");
-            return false;
+            break;
         }
 
-        uint8_t packet_id;
-        memcpy(&packet_id, buffer, sizeof(uint8_t));
-
         // First we need to check if this is a correct client.
         if (different_addresses(client_address, receive_address)) {
-            if (packet_id == PPCB_CONN) {
-                server_sends_RESPONSE_udp(socket_fd, receive_address, 0, PPCB_UDP, PPCB_CONRJT);
-            }
-            else if (packet_id == PPCB_DATA) {
-                server_sends_RJT_udp(socket_fd, receive_address, 0, packet_number, PPCB_UDP);
-            }
+            server_rejects_stranger(socket_fd, receive_address, datagram, packet_number,
+                                    PPCB_UDP);
             continue;
         }
-
-        if (packet_id != PPCB_DATA || (size_t)received_length < sizeof(PPCB_DATA_packet)) {
-            error("invalid DATA");
-            if (packet_id == PPCB_DATA) {
-                server_sends_RJT_udp(socket_fd, client_address, session_id, packet_number, PPCB_UDP);
-            }
-            return false;
-        }
-
-        PPCB_DATA_packet data_packet;
-        memcpy(&data_packet, buffer, sizeof(PPCB_DATA_packet));
-
-        data_packet.packet_number = be64toh(data_packet.packet_number);
-        data_packet.packet_byte_sequence_length = be32toh(data_packet.packet_byte_sequence_length);
-        size_t message_length = sizeof(PPCB_DATA_packet) + data_packet.packet_byte_sequence_length;
-
-        if ((size_t) received_length != message_length ||
-            !validate_data_packet(&data_packet, PPCB_UDP, session_id, packet_number,
-                                  bytes_received, byte_sequence_length)
-        ) {
-            error("invalid DATA");
-            server_sends_RJT_udp(socket_fd, client_address, session_id, packet_number, PPCB_UDP);
-
-            return false;
+        stats_received((size_t) received_length, 1);
+
+        ssize_t payload_length = server_checks_DATA(socket_fd, client_address, session_id,
+                                                    packet_number, bytes_received,
+                                                    byte_sequence_length, datagram,
+                                                    received_length);
+        if (payload_length < 0) {
+            break;
         }
 
-        printf("%.*s", data_packet.packet_byte_sequence_length, buffer + sizeof(PPCB_DATA_packet));
-        fflush(stdout);
+        payloads[payload_count++] = (struct iovec) {
+            .iov_base = datagram + sizeof(PPCB_DATA_packet),
+            .iov_len = payload_length
+        };
+        stats_delivered((uint64_t) payload_length);
 
-        bytes_received += (uint64_t) data_packet.packet_byte_sequence_length;
+        bytes_received += (uint64_t) payload_length;
         packet_number++;
     }
 
-    return true;
+    // Whatever was valid is written, even when the session failed later on.
+    return output_write_vector(output, payloads, payload_count) &&
+           bytes_received == byte_sequence_length;
 }
 
 /// UDP SERVER FUNCTION ///
@@ -191,21 +261,60 @@ void handle_connection_udp(
         struct sockaddr_in  client_address,
         uint64_t            session_id,
         uint64_t            byte_sequence_length,
-        char                *buffer
+        PPCB_output         *output,
+        PPCB_receive_batch  *batch
 ) {
     // Sending CONACC to client.
-    PPCB_RESPONSE_packet data_to_send;
-    set_RESPONSE(&data_to_send, PPCB_CONACC, session_id);
-    ssize_t sent_length = send_packet_udp(socket_fd, client_address,
-                                          sizeof(PPCB_RESPONSE_packet), &data_to_send);
-    if (!validate_send(sent_length, sizeof(PPCB_RESPONSE_packet), false,
-                       PPCB_UDP, "sending CONACC")) {
+    if (!server_sends_CONACC(socket_fd, client_address, session_id)) {
         return;
     }
 
-    if (!server_receive_bytes(socket_fd, client_address, session_id, byte_sequence_length, buffer)) {
+    bool received = server_receive_bytes(socket_fd, client_address, session_id,
+                                         byte_sequence_length, output, batch);
+    if (!output_flush(output) || !received) {
         return;
     }
 
     server_sends_RESPONSE_udp(socket_fd, client_address, session_id, PPCB_UDP, PPCB_RCVD);
-}
\ No newline at end of file
+}
+
+/// EVENT-DRIVEN UDP SERVER ///
+
+bool session_udp_start(
+        int                 socket_fd,
+        PPCB_session        *session
+) {
+    session->deadline = monotonic_usec() + (uint64_t) MAX_WAIT * USEC_PER_SEC;
+    return server_sends_CONACC(socket_fd, session->address, session->session_id);
+}
+
+bool session_udp_receive(
+        int                 socket_fd,
+        PPCB_session        *session,
+        const char          *datagram,
+        size_t              received_length
+) {
+    ssize_t payload_length = server_checks_DATA(socket_fd, session->address, session->session_id,
+                                                session->packet_number, session->bytes_received,
+                                                session->byte_sequence_length, datagram,
+                                                received_length);
+    if (payload_length < 0 ||
+        !output_write(&session->output, datagram + sizeof(PPCB_DATA_packet), payload_length)) {
+        return false;
+    }
+
+    session->bytes_received += (uint64_t) payload_length;
+    session->packet_number++;
+    stats_delivered((uint64_t) payload_length);
+    session->deadline = monotonic_usec() + (uint64_t) MAX_WAIT * USEC_PER_SEC;
+
+    if (session->bytes_received < session->byte_sequence_length) {
+        return true;
+    }
+
+    if (output_flush(&session->output)) {
+        server_sends_RESPONSE_udp(socket_fd, session->address, session->session_id, PPCB_UDP,
+                                  PPCB_RCVD);
+    }
+    return false;
+}
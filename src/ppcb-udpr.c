@@ -1,39 +1,77 @@
 #include <endian.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
 
 #include "ppcb-udpr.h"
 #include "err.h"
+#include "ppcb-batch.h"
 #include "ppcb-common.h"
+#include "ppcb-input.h"
+#include "ppcb-output.h"
+#include "ppcb-reassembly.h"
+#include "ppcb-rtt.h"
+#include "ppcb-session.h"
+#include "ppcb-stats.h"
+#include "ppcb-timestamp.h"
+#include "ppcb-trace.h"
 #include "protconst.h"
 
 
 /// UDPR CLIENT HELPER FUNCTIONS ///
 
+// Requests the window, payload size and flags, which are replaced with those granted by the
+// server. A plain CONACC grants a window of 1 and no flags; the payload size, which never
+// exceeds MAX_PACKET_SIZE, is valid without an agreement.
 static void client_initialise_connection(
         int                 socket_fd,
         struct sockaddr_in  server_address,
         uint64_t            session_id,
         uint64_t            byte_sequence_length,
-        char                *buffer
+        uint16_t            *window,
+        uint32_t            *payload_size,
+        uint8_t             *flags,
+        PPCB_rtt            *rtt,
+        char                *buffer,
+        PPCB_udpr_latency   *latency
 ) {
     struct sockaddr_in receive_address;
-    PPCB_CONN_packet data_to_send;
-    set_CONN(&data_to_send, session_id, PPCB_UDPR, byte_sequence_length);
 
     ssize_t received_length, sent_length;
+    uint64_t first_sent_at = monotonic_usec();
+
+    for (size_t transmit = 0; !rtt_expired(rtt); transmit++) {
+        // Servers which don't know the extension ignore it, so fall back to a plain CONN.
+        bool extended = (*window > 1 || *payload_size != MAX_PACKET_SIZE || *flags != 0) &&
+                        transmit < CONN_EXTENDED_ATTEMPTS;
+        size_t conn_length = sizeof(PPCB_CONN_packet) + (extended ? sizeof(PPCB_CONN_extension) : 0);
+
+        PPCB_CONN_packet data_to_send;
+        set_CONN(&data_to_send, session_id, PPCB_UDPR | (extended ? PPCB_EXTENDED : 0),
+                 byte_sequence_length);
+        PPCB_CONN_extension extension;
+        set_CONN_extension(&extension, *window, *payload_size, *flags);
+
+        struct iovec vector[] = {
+            {.iov_base = &data_to_send, .iov_len = sizeof(PPCB_CONN_packet)},
+            {.iov_base = &extension, .iov_len = sizeof(PPCB_CONN_extension)}
+        };
+        sent_length = send_vector_udp(socket_fd, server_address, vector, extended ? 2 : 1);
+        validate_send(sent_length, conn_length, true, PPCB_UDPR, "sending CONN");
+        if (transmit > 0) {
+            stats_retransmitted(1);
+            TRACE_INSTANT("retransmit CONN", transmit);
+        }
 
-    for (size_t transmit = 0; transmit < MAX_RETRANSMITS + 1; transmit++) {
-        sent_length = send_packet_udp(socket_fd, server_address,
-                                       sizeof(PPCB_CONN_packet), &data_to_send);
-        validate_send(sent_length, sizeof(PPCB_CONN_packet), true, PPCB_UDPR, "sending CONN");
-
+        uint64_t sent_at = monotonic_usec(), deadline = sent_at + rtt->rto;
         do {
-            received_length = receive_packet_udp(socket_fd, &receive_address, buffer, false);
+            received_length = receive_packet_udp(socket_fd, &receive_address, buffer,
+                                                 usec_until(deadline));
             if (received_length < 0) {
                 sys_fatal("recvfrom");
             } else if (received_length == 0) {
@@ -42,10 +80,21 @@ static void client_initialise_connection(
         } while (different_addresses(server_address, receive_address));
 
         if (received_length == 0) {
+            stats_timed_out();
+            TRACE_INSTANT("CONACC timeout", transmit);
+            rtt_backoff(rtt);
             continue; // timeout
         }
 
-        if ((size_t) received_length != sizeof(PPCB_RESPONSE_packet)) {
+        if (transmit == 0) {
+            uint64_t sample = monotonic_usec() - sent_at;
+            rtt_sample(rtt, sample);
+            stats_rtt(sample);
+        }
+        rtt_progress(rtt);
+
+        if ((size_t) received_length != sizeof(PPCB_RESPONSE_packet) &&
+            (size_t) received_length != sizeof(PPCB_RESPONSE_packet) + sizeof(PPCB_CONN_extension)) {
             fatal("receiving CONACC");
         }
 
@@ -53,47 +102,86 @@ static void client_initialise_connection(
         PPCB_RESPONSE_packet data_received;
         memcpy(&data_received, buffer, sizeof(PPCB_RESPONSE_packet));
         validate_response_packet(&data_received, PPCB_CONACC, session_id);
+        if (latency != NULL) {
+            histogram_record(&latency->handshake, monotonic_usec() - first_sent_at);
+        }
+
+        if ((size_t) received_length == sizeof(PPCB_RESPONSE_packet)) {
+            *window = 1;
+            *flags = 0;
+            return;
+        }
 
+        PPCB_CONN_extension granted;
+        memcpy(&granted, buffer + sizeof(PPCB_RESPONSE_packet), sizeof(PPCB_CONN_extension));
+        granted.window = be16toh(granted.window);
+        granted.payload_size = be32toh(granted.payload_size);
+        if (granted.window == 0 || granted.window > *window ||
+            granted.payload_size == 0 || granted.payload_size > *payload_size ||
+            (granted.flags & ~*flags) != 0) {
+            fatal("receiving CONACC");
+        }
+
+        *window = granted.window;
+        *payload_size = granted.payload_size;
+        *flags = granted.flags;
         return;
     }
 
     fatal("didn't receive CONACC after retransmission");
 }
 
-bool client_receives_packet(
+// Waits until deadline for ACC of any packet in [packet_number, next_packet_number) or for RCVD.
+// ACCs are cumulative, so the highest acknowledged packet is stored in acknowledged. Unless
+// selective is NULL, ACCs carry the DATA held by the server, which is stored there; an ACC of
+// packet_number - 1 is then accepted too if it reports held DATA. RCVD is accepted in place of
+// ACC, as the server sends it only after the last ACC (which may be lost). Returns the id of the
+// received packet or 0 on timeout.
+static uint8_t client_receives_packet(
         int                 socket_fd,
         struct sockaddr_in  server_address,
         uint64_t            session_id,
         uint64_t            packet_number,
+        uint64_t            next_packet_number,
+        uint64_t            deadline,
         char                *buffer,
-        PPCB_Packet_id      confirming_packet
+        PPCB_Packet_id      confirming_packet,
+        uint64_t            *acknowledged,
+        PPCB_ACC_selective  *selective
 ) {
+    size_t acc_length = sizeof(PPCB_PACKET_RESPONSE_packet) +
+                        ((selective != NULL) ? sizeof(PPCB_ACC_selective) : 0);
     struct sockaddr_in receive_address;
     char *waiting_for = (confirming_packet == PPCB_ACC) ? "ACC" : "RCVD";
 
-    for (;;) {
-        ssize_t received_length = receive_packet_udp(socket_fd, &receive_address, buffer, false);
+    // Stale packets must not keep the deadline from expiring.
+    while (monotonic_usec() < deadline) {
+        ssize_t received_length = receive_packet_udp(socket_fd, &receive_address, buffer,
+                                                     usec_until(deadline));
 
         if (received_length < 0) {
             sys_fatal("recvfrom");
         } else if (received_length == 0) {
-            return false; // timeout
+            return 0; // timeout
         }
 
         if (different_addresses(receive_address, server_address)) {
-            continue; // Reset timer and wait for another packet.
+            continue; // Wait for another packet.
         }
 
         uint8_t packet_id;
         memcpy(&packet_id, buffer, sizeof(uint8_t));
 
         // Check if we received previous CONACC.
-        if (packet_id == PPCB_CONACC && received_length == sizeof(PPCB_RESPONSE_packet)) {
+        if (packet_id == PPCB_CONACC &&
+            ((size_t) received_length == sizeof(PPCB_RESPONSE_packet) ||
+             (size_t) received_length == sizeof(PPCB_RESPONSE_packet) + sizeof(PPCB_CONN_extension))) {
             PPCB_RESPONSE_packet response_packet;
             memcpy(&response_packet, buffer, sizeof(PPCB_RESPONSE_packet));
             validate_response_packet(&response_packet, PPCB_CONACC, session_id);
+            stats_duplicate_acc();
         } // Check if we received previous ACC.
-        else if (packet_id == PPCB_ACC && received_length == sizeof(PPCB_PACKET_RESPONSE_packet)) {
+        else if (packet_id == PPCB_ACC && (size_t) received_length == acc_length) {
             PPCB_PACKET_RESPONSE_packet response_packet;
             memcpy(&response_packet, buffer, sizeof(PPCB_PACKET_RESPONSE_packet));
             response_packet.packet_number = be64toh(response_packet.packet_number);
@@ -101,67 +189,109 @@ bool client_receives_packet(
             if (response_packet.session_id != session_id) {
                 fatal("incorrect session id");
             }
-            if (response_packet.packet_number < packet_number) {
+
+            PPCB_ACC_selective held = {.first = 0, .count = 0};
+            if (selective != NULL) {
+                memcpy(&held, buffer + sizeof(PPCB_PACKET_RESPONSE_packet),
+                       sizeof(PPCB_ACC_selective));
+                held.first = be64toh(held.first);
+                held.count = be16toh(held.count);
+            }
+
+            if (response_packet.packet_number + 1 < packet_number ||
+                (response_packet.packet_number + 1 == packet_number && held.count == 0)) {
+                stats_duplicate_acc();
                 continue; // previous ACC packet
             }
-            if (response_packet.packet_number == packet_number && confirming_packet == PPCB_ACC) {
-                return true; // We got packet we were waiting for
+            if (response_packet.packet_number < next_packet_number && confirming_packet == PPCB_ACC &&
+                (held.count == 0 || (held.first > response_packet.packet_number + 1 &&
+                                     held.first + held.count <= next_packet_number))) {
+                *acknowledged = response_packet.packet_number;
+                if (selective != NULL) {
+                    *selective = held;
+                }
+                return PPCB_ACC; // We got packet we were waiting for
             }
 
             fatal("receiving %s", waiting_for);
         } // Check if we received correct packet.
-        else if (packet_id == PPCB_RCVD && confirming_packet == PPCB_RCVD
-                && (size_t)received_length == sizeof(PPCB_RESPONSE_packet)) {
-
+        else if (packet_id == PPCB_RCVD && (size_t)received_length == sizeof(PPCB_RESPONSE_packet)) {
             PPCB_RESPONSE_packet response_packet;
             memcpy(&response_packet, buffer, sizeof(PPCB_RESPONSE_packet));
             validate_response_packet(&response_packet, PPCB_RCVD, session_id);
 
-            return true;
+            return PPCB_RCVD;
         } // Unknown packet id.
         else {
+            if (packet_id == PPCB_RJT) {
+                stats_rejected();
+            }
             fatal("receiving %s", waiting_for);
         }
     }
 
-    return false;
+    return 0;
 }
 
+// What the client knows about DATA in flight. Its place in the byte sequence is kept, as the
+// payload size may shrink after it was cut.
+typedef struct {
+    uint64_t    sent_at;        // 0 once retransmitted (Karn's rule).
+    uint64_t    offset;
+    uint32_t    length;
+    uint64_t    transmission;   // Order of its first transmission among all DATA sent.
+    uint64_t    retransmission; // Order of its latest transmission if it was sent again, else 0.
+    bool        held;           // The server reported it holds the packet.
+} PPCB_in_flight;
+
+// Queues DATA; it is sent once the batch fills up or is flushed.
 static void client_send_bytes_to_server(
-        int                 socket_fd,
-        struct sockaddr_in  server_address,
+        PPCB_send_batch         *batch,
+        uint64_t                session_id,
+        uint64_t                packet_number,
+        const char              *byte_sequence,
+        const PPCB_in_flight    *packet
+) {
+    send_batch_add_DATA(batch, session_id, packet_number, byte_sequence + packet->offset,
+                        packet->length);
+}
+
+// Sends DATA packet_number again, as the latest transmission.
+static void client_resends_bytes(
+        PPCB_send_batch     *batch,
         uint64_t            session_id,
         uint64_t            packet_number,
-        uint32_t            current_send,
-        uint32_t            bytes_send,
-        char                *byte_sequence,
-        char                *buffer,
-        char                *send_buffer
+        const char          *byte_sequence,
+        PPCB_in_flight      *packet,
+        uint64_t            *transmissions
 ) {
-    PPCB_DATA_packet data_to_send;
-    set_DATA(&data_to_send, session_id, packet_number, current_send);
-
-    memcpy(send_buffer, &data_to_send, sizeof(PPCB_DATA_packet));
-    memcpy(send_buffer + sizeof(PPCB_DATA_packet), byte_sequence + bytes_send, current_send);
-
-    size_t message_length = current_send + sizeof(PPCB_DATA_packet);
-    ssize_t sent_length;
-    bool received_packet;
-
-    for (ssize_t transmit = 0; transmit < MAX_RETRANSMITS + 1; transmit++) {
-        sent_length = send_packet_udp(socket_fd, server_address, message_length, send_buffer);
-        validate_send(sent_length, message_length, true, PPCB_UDPR, "sending DATA");
-
-        received_packet = client_receives_packet(socket_fd, server_address, session_id, packet_number,
-                                                 buffer, PPCB_ACC);
-        if (!received_packet) {
-            continue;
-        }
+    client_send_bytes_to_server(batch, session_id, packet_number, byte_sequence, packet);
+    packet->sent_at = 0;
+    packet->retransmission = ++*transmissions;
+    stats_retransmitted(1);
+    TRACE_INSTANT("retransmit DATA", packet_number);
+}
 
+// Records how long packets in [from, to) waited for their acknowledgement. Packets whose own
+// ACC was lost wait until the ACC, or RCVD, which covers them.
+static void record_acknowledged(
+        PPCB_udpr_latency   *latency,
+        const PPCB_in_flight *in_flight,
+        uint16_t            window,
+        uint64_t            from,
+        uint64_t            to
+) {
+    if (latency == NULL) {
         return;
     }
 
-    fatal("didn't receive ACC after retransmissions");
+    uint64_t now = monotonic_usec();
+    for (uint64_t packet_number = from; packet_number < to; packet_number++) {
+        if (in_flight[packet_number % window].sent_at != 0) {
+            histogram_record(&latency->acknowledgement,
+                             now - in_flight[packet_number % window].sent_at);
+        }
+    }
 }
 
 /// UDPR CLIENT FUNCTION ///
@@ -170,69 +300,298 @@ void send_bytes_udpr(
         int                   socket_fd,
         struct sockaddr_in    server_address,
         uint64_t              session_id,
-        uint64_t              byte_sequence_length,
-        char*                 byte_sequence
+        PPCB_input            *input,
+        uint16_t              window,
+        uint32_t              payload_size,
+        PPCB_udpr_latency     *latency
 ) {
-    static char buffer[BUFFER_SIZE], send_buffer[BUFFER_SIZE];
+    uint64_t byte_sequence_length = input->length;
+    char *byte_sequence = input->data;
+
+    static char buffer[BUFFER_SIZE];
+
+    PPCB_rtt rtt;
+    rtt_init(&rtt);
+
+    uint8_t flags = timestamp_used() ? PPCB_FLAG_TIMESTAMPS : 0;
+    client_initialise_connection(socket_fd, server_address, session_id, byte_sequence_length,
+                                 &window, &payload_size, &flags, &rtt, buffer, latency);
+
+    // Data exchange. Up to window packets are in flight. With a window above 1 the server holds
+    // DATA which came after a gap and reports it in its ACCs, so only lost packets are sent
+    // again, while new ones keep going out: those with DATA sent REORDER_THRESHOLD transmissions
+    // later acknowledged, and after a timeout all which are neither acknowledged nor held.
+    uint64_t first_unacknowledged = 0, next_packet_number = 0, next_offset = 0, acknowledged;
+    uint64_t transmissions = 0, latest_acknowledged = 0;
+    uint64_t deadline = 0, last_sent_at = 0;
+    uint8_t received = 0;
+    PPCB_ACC_selective held = {.first = 0, .count = 0};
+    PPCB_ACC_selective *selective = (window > 1) ? &held : NULL;
+
+    PPCB_in_flight *in_flight = calloc(window, sizeof(PPCB_in_flight));
+    ASSERT_MALLOC(in_flight);
+
+    // The window is filled with as few system calls as possible.
+    PPCB_send_batch batch;
+    send_batch_init(&batch, socket_fd, server_address, PPCB_UDPR);
+
+    // Only DATA is sent from here on, as transmit stamps are matched to the sends by count.
+    if (flags & PPCB_FLAG_TIMESTAMPS) {
+        batch.timestamps = true;
+        if (!timestamp_transmit(socket_fd)) {
+            sys_error("no transmit timestamps");
+        }
+    }
 
-    client_initialise_connection(socket_fd, server_address, session_id, byte_sequence_length, buffer);
+    while (first_unacknowledged < next_packet_number || next_offset < byte_sequence_length) {
+        while (next_offset < byte_sequence_length &&
+               next_packet_number < first_unacknowledged + window) {
+            payload_size = send_batch_fit(&batch, payload_size);
+
+            PPCB_in_flight *packet = &in_flight[next_packet_number % window];
+            *packet = (PPCB_in_flight) {
+                .sent_at                        = monotonic_usec(),
+                .offset                         = next_offset,
+                .length                         = min(payload_size,
+                                                      byte_sequence_length - next_offset),
+                .transmission                   = ++transmissions,
+                .retransmission                 = 0,
+                .held                           = false
+            };
+            client_send_bytes_to_server(&batch, session_id, next_packet_number, byte_sequence,
+                                        packet);
+
+            next_offset += packet->length;
+            if (next_offset == byte_sequence_length) {
+                last_sent_at = monotonic_usec();
+            }
+            next_packet_number++;
+        }
 
-    // Data exchange.
-    uint64_t bytes_send = 0, packet_number = 0;
-    uint32_t max_size = min(MAX_PACKET_SIZE, PACKET_SIZE);
+        send_batch_flush(&batch);
 
-    while (bytes_send < byte_sequence_length) {
-        uint32_t current_send = min(max_size, byte_sequence_length - bytes_send);
+        if (deadline == 0) {
+            deadline = monotonic_usec() + rtt.rto;
+        }
 
-        client_send_bytes_to_server(socket_fd, server_address, session_id, packet_number,
-                                    current_send, bytes_send, byte_sequence,  buffer, send_buffer);
+        received = client_receives_packet(socket_fd, server_address, session_id,
+                                          first_unacknowledged, next_packet_number, deadline,
+                                          buffer, PPCB_ACC, &acknowledged, selective);
+        if (received == PPCB_RCVD) {
+            record_acknowledged(latency, in_flight, window, first_unacknowledged,
+                                next_packet_number);
+            break;
+        }
+        if (received == 0) {
+            stats_timed_out();
+            TRACE_INSTANT("ACC timeout", first_unacknowledged);
+            if (rtt_expired(&rtt)) {
+                fatal("didn't receive ACC after retransmissions");
+            }
 
-        bytes_send += current_send;
-        packet_number++;
+            rtt_backoff(&rtt);
+            for (uint64_t i = first_unacknowledged; i < next_packet_number; i++) {
+                if (!in_flight[i % window].held) {
+                    client_resends_bytes(&batch, session_id, i, byte_sequence,
+                                         &in_flight[i % window], &transmissions);
+                }
+            }
+            deadline = 0;
+            continue;
+        }
+
+        // Only an ACC which the acknowledged packet itself brought measures a round trip.
+        PPCB_in_flight *last = &in_flight[acknowledged % window];
+        if (acknowledged >= first_unacknowledged && last->sent_at != 0 && !last->held) {
+            uint64_t sample = monotonic_usec() - last->sent_at;
+            rtt_sample(&rtt, sample);
+            stats_rtt(sample);
+        }
+        rtt_progress(&rtt);
+
+        // The ACC of a resent packet may answer either copy, so it counts as the first one.
+        for (uint64_t i = first_unacknowledged; i <= acknowledged; i++) {
+            latest_acknowledged = max(latest_acknowledged, in_flight[i % window].transmission);
+        }
+        for (uint64_t i = held.first; i < held.first + held.count; i++) {
+            if (!in_flight[i % window].held) {
+                // Packets getting through is progress, even while the gap before them persists.
+                in_flight[i % window].held = true;
+                deadline = 0;
+            }
+            latest_acknowledged = max(latest_acknowledged, in_flight[i % window].transmission);
+        }
+
+        if (acknowledged >= first_unacknowledged) {
+            record_acknowledged(latency, in_flight, window, first_unacknowledged,
+                                acknowledged + 1);
+            first_unacknowledged = acknowledged + 1;
+            deadline = 0;
+            input_release(input, (first_unacknowledged < next_packet_number) ?
+                                 in_flight[first_unacknowledged % window].offset : next_offset);
+        }
+
+        for (uint64_t i = first_unacknowledged; i < next_packet_number; i++) {
+            PPCB_in_flight *packet = &in_flight[i % window];
+            uint64_t transmission = max(packet->transmission, packet->retransmission);
+            if (!packet->held && transmission + REORDER_THRESHOLD <= latest_acknowledged) {
+                client_resends_bytes(&batch, session_id, i, byte_sequence, packet,
+                                     &transmissions);
+            }
+        }
     }
 
-    if (!client_receives_packet(socket_fd, server_address, session_id, packet_number, buffer,
-                                PPCB_RCVD)) {
+    free(in_flight);
+
+    // RCVD is never retransmitted, so give the server the full MAX_WAIT.
+    deadline = monotonic_usec() + (uint64_t) MAX_WAIT * USEC_PER_SEC;
+    if (received != PPCB_RCVD &&
+        client_receives_packet(socket_fd, server_address, session_id, next_packet_number,
+                               next_packet_number, deadline, buffer, PPCB_RCVD, &acknowledged,
+                               selective) == 0) {
+        stats_timed_out();
         fatal("didn't receive RCVD");
     }
+    if (latency != NULL && next_packet_number > 0) {
+        histogram_record(&latency->completion, monotonic_usec() - last_sent_at);
+    }
 }
 
 /// UDPR SERVER HELPER FUNCTIONS ///
 
-ssize_t server_sends_packet(
-        int                 socket_fd,
-        struct sockaddr_in  client_address,
-        uint64_t            session_id,
-        uint64_t            packet_number,
-        PPCB_Packet_id      confirming_packet
+// With a window above 1, ACC carries a PPCB_ACC_selective.
+static bool acknowledges_selectively(
+        const PPCB_CONN_extension   *extension
+) {
+    return extension != NULL && extension->window > 1;
+}
+
+// Sends ACC of packet_number. With selective acknowledgements it carries the run of DATA held
+// around reported, or the lowest run above it.
+static ssize_t server_sends_ACC(
+        int                         socket_fd,
+        struct sockaddr_in          client_address,
+        uint64_t                    session_id,
+        uint64_t                    packet_number,
+        const PPCB_CONN_extension   *extension,
+        const PPCB_reassembly       *reassembly,
+        uint64_t                    reported
+) {
+    PPCB_PACKET_RESPONSE_packet data_to_send;
+    set_PACKET_RESPONSE(&data_to_send, PPCB_ACC, session_id, packet_number);
+
+    uint64_t first = 0;
+    uint16_t count = (reassembly != NULL) ?
+                     reassembly_run(reassembly, packet_number + 1, reported, &first) : 0;
+    PPCB_ACC_selective selective;
+    set_ACC_selective(&selective, first, count);
+
+    struct iovec vector[] = {
+        {.iov_base = &data_to_send, .iov_len = sizeof(PPCB_PACKET_RESPONSE_packet)},
+        {.iov_base = &selective, .iov_len = sizeof(PPCB_ACC_selective)}
+    };
+    return send_vector_udp(socket_fd, client_address, vector,
+                           acknowledges_selectively(extension) ? 2 : 1);
+}
+
+// CONACC carries the granted extension if the client sent one. ACC reports the lowest run of DATA
+// held in reassembly, if given.
+static ssize_t server_sends_packet(
+        int                         socket_fd,
+        struct sockaddr_in          client_address,
+        uint64_t                    session_id,
+        uint64_t                    packet_number,
+        PPCB_Packet_id              confirming_packet,
+        const PPCB_CONN_extension   *extension,
+        const PPCB_reassembly       *reassembly
 ) {
     if (confirming_packet == PPCB_ACC) {
-        PPCB_PACKET_RESPONSE_packet data_to_send;
-        set_PACKET_RESPONSE(&data_to_send, PPCB_ACC, session_id, packet_number);
-        return send_packet_udp(socket_fd, client_address,
-                               sizeof(PPCB_PACKET_RESPONSE_packet), &data_to_send);
+        return server_sends_ACC(socket_fd, client_address, session_id, packet_number, extension,
+                                reassembly, packet_number + 2);
     }
     else {
         PPCB_RESPONSE_packet data_to_send;
         set_RESPONSE(&data_to_send, confirming_packet, session_id);
 
-        return send_packet_udp(socket_fd, client_address,
-                               sizeof(PPCB_RESPONSE_packet), &data_to_send);
+        PPCB_CONN_extension granted;
+        bool extended = (confirming_packet == PPCB_CONACC && extension != NULL);
+        if (extended) {
+            set_CONN_extension(&granted, extension->window, extension->payload_size,
+                               extension->flags);
+        }
+
+        struct iovec vector[] = {
+            {.iov_base = &data_to_send, .iov_len = sizeof(PPCB_RESPONSE_packet)},
+            {.iov_base = &granted, .iov_len = sizeof(PPCB_CONN_extension)}
+        };
+        return send_vector_udp(socket_fd, client_address, vector, extended ? 2 : 1);
     }
 }
 
+static size_t confirmation_length(
+        PPCB_Packet_id              confirming_packet,
+        const PPCB_CONN_extension   *extension
+) {
+    if (confirming_packet == PPCB_ACC) {
+        return sizeof(PPCB_PACKET_RESPONSE_packet) +
+               (acknowledges_selectively(extension) ? sizeof(PPCB_ACC_selective) : 0);
+    }
+    if (confirming_packet == PPCB_CONACC && extension != NULL) {
+        return sizeof(PPCB_RESPONSE_packet) + sizeof(PPCB_CONN_extension);
+    }
+    return sizeof(PPCB_RESPONSE_packet);
+}
+
+// Repeats the last confirmation, so the client learns where the server is.
+static void server_resends_confirmation(
+        int                         socket_fd,
+        struct sockaddr_in          client_address,
+        uint64_t                    session_id,
+        uint64_t                    packet_number,
+        const PPCB_CONN_extension   *extension,
+        const PPCB_reassembly       *reassembly
+) {
+    PPCB_Packet_id confirming_packet = (packet_number == 0) ? PPCB_CONACC : PPCB_ACC;
+    ssize_t sent_length = server_sends_packet(socket_fd, client_address, session_id,
+                                              packet_number - (packet_number > 0),
+                                              confirming_packet, extension, reassembly);
+    validate_send(sent_length, confirmation_length(confirming_packet, extension), false, PPCB_UDPR,
+                  (confirming_packet == PPCB_ACC) ? "sending ACC" : "sending CONACC");
+}
+
+// Replaces the requested values with those the server grants. The window is what fits the receive
+// buffer of socket_fd, and reassembly can hold all of it.
+static void grant_extension(
+        int                     socket_fd,
+        PPCB_CONN_extension     *extension
+) {
+    extension->payload_size = min(extension->payload_size, MAX_PACKET_SIZE);
+    extension->window = min(extension->window,
+                            receive_window_udp(socket_fd, extension->payload_size));
+    extension->window = min(extension->window, reassembly_window(extension->payload_size));
+    extension->flags &= timestamp_used() ? PPCB_FLAG_TIMESTAMPS : 0;
+}
+
+// DATA's header, followed by its timestamp in sessions which agreed on them.
+static size_t data_header_length(
+        const PPCB_CONN_extension   *extension
+) {
+    bool timestamps = extension != NULL && (extension->flags & PPCB_FLAG_TIMESTAMPS);
+    return sizeof(PPCB_DATA_packet) + (timestamps ? sizeof(PPCB_DATA_timestamp) : 0);
+}
+
 static bool validate_CONN_packet(
         uint64_t    session_id,
-        uint8_t     packet_id,
         uint64_t    byte_sequence_length,
-        char        *buffer
+        const char  *buffer,
+        size_t      received_length
 ) {
     PPCB_CONN_packet conn_packet;
-    memcpy(&conn_packet, buffer, sizeof(PPCB_CONN_packet));
-
-    conn_packet.byte_sequence_length = be64toh(conn_packet.byte_sequence_length);
+    PPCB_CONN_extension extension;
+    bool extended;
 
-    if (packet_id != PPCB_CONN || conn_packet.session_id != session_id ||
+    if (!read_CONN(buffer, received_length, &conn_packet, &extension, &extended) ||
+        conn_packet.id != PPCB_CONN || conn_packet.session_id != session_id ||
         conn_packet.protocol_id != PPCB_UDPR ||
         conn_packet.byte_sequence_length != byte_sequence_length) {
         return false;
@@ -241,131 +600,260 @@ static bool validate_CONN_packet(
     return true;
 }
 
-ssize_t server_receives_packet(
-        int                 socket_fd,
-        struct sockaddr_in  client_address,
-        uint64_t            session_id,
-        uint64_t            packet_number,
-        uint64_t            byte_sequence_length,
-        uint64_t            bytes_received,
-        char                *buffer
+// Checks a packet from the client. DATA numbered above packet_number but within the window is
+// held in reassembly until the packets before it arrive, and acknowledged selectively, so the
+// client sends again only what is missing. Previous DATA has the last confirmation repeated,
+// as the ACC for it may have been lost. The delay of every valid timestamped DATA is
+// counted, with the kernel's arrival stamp arrived_at. Returns the length of the payload of the
+// awaited DATA, 0 for a packet to ignore, or -1 when the session is over.
+static ssize_t server_checks_packet(
+        int                         socket_fd,
+        struct sockaddr_in          client_address,
+        uint64_t                    session_id,
+        uint64_t                    packet_number,
+        uint64_t                    byte_sequence_length,
+        uint64_t                    bytes_received,
+        const PPCB_CONN_extension   *extension,
+        const char                  *datagram,
+        size_t                      received_length,
+        uint64_t                    arrived_at,
+        PPCB_reassembly             *reassembly
 ) {
-    struct sockaddr_in receive_address;
+    uint16_t window = (extension != NULL) ? extension->window : 1;
+    uint32_t payload_size = (extension != NULL) ? extension->payload_size : MAX_PACKET_SIZE;
+    size_t header_length = data_header_length(extension);
 
-    for (;;) {
-        ssize_t received_length = receive_packet_udp(socket_fd, &receive_address, buffer, false);
+    uint8_t packet_id;
+    memcpy(&packet_id, datagram, sizeof(uint8_t));
 
-        if (received_length < 0) {
-            sys_error("recvfrom");
+    // We might receive previous CONN.
+    if (packet_id == PPCB_CONN) {
+        if (!validate_CONN_packet(session_id, byte_sequence_length, datagram, received_length)) {
+            error("invalid CONN");
             return -1;
-        } else if (received_length == 0) {
-            return 0; // timeout
         }
 
-        uint8_t packet_id;
-        memcpy(&packet_id, buffer, sizeof(uint8_t));
+        return 0;
+    }
 
-        // First we need to check if this is a correct client.
-        if (different_addresses(receive_address, client_address)) {
-            if (packet_id == PPCB_CONN) {
-                server_sends_RESPONSE_udp(socket_fd, receive_address, 0, PPCB_UDPR, PPCB_CONRJT);
-            }
-            else if (packet_id == PPCB_DATA) {
-                server_sends_RJT_udp(socket_fd, receive_address, 0, packet_number, PPCB_UDPR);
-            }
-            continue;
+    // Now we check if this is DATA.
+    if (packet_id != PPCB_DATA || received_length < header_length) {
+        error("invalid DATA");
+        if (packet_id == PPCB_DATA) {
+            server_sends_RJT_udp(socket_fd, client_address, session_id, packet_number, PPCB_UDPR);
         }
+        return -1;
+    }
 
-        // We might receive previous CONN.
-        if ((size_t) received_length == sizeof(PPCB_CONN_packet)) {
-            if (!validate_CONN_packet(session_id, packet_id, byte_sequence_length, buffer)) {
-                error("invalid CONN");
-                return -1;
-            }
-
-            continue;
-        }
+    PPCB_DATA_packet data_packet;
+    memcpy(&data_packet, datagram, sizeof(PPCB_DATA_packet));
 
-        // Now we check if this is DATA.
-        if (packet_id != PPCB_DATA || (size_t) received_length < sizeof(PPCB_DATA_packet)) {
-            error("invalid DATA");
-            if (packet_id == PPCB_DATA) {
-                server_sends_RJT_udp(socket_fd, client_address, session_id, packet_number, PPCB_UDPR);
-            }
-            return -1;
-        }
+    data_packet.packet_number = be64toh(data_packet.packet_number);
+    data_packet.packet_byte_sequence_length = be32toh(data_packet.packet_byte_sequence_length);
+    size_t message_length = header_length + data_packet.packet_byte_sequence_length;
 
-        PPCB_DATA_packet data_packet;
-        memcpy(&data_packet, buffer, sizeof(PPCB_DATA_packet));
+    if (received_length != message_length ||
+        !validate_data_packet(&data_packet,PPCB_UDPR, session_id, packet_number + window - 1,
+                              bytes_received, byte_sequence_length, payload_size)) {
 
-        data_packet.packet_number = be64toh(data_packet.packet_number);
-        data_packet.packet_byte_sequence_length = be32toh(data_packet.packet_byte_sequence_length);
-        size_t message_length = sizeof(PPCB_DATA_packet) + data_packet.packet_byte_sequence_length;
+        error("invalid DATA");
+        server_sends_RJT_udp(socket_fd, client_address, session_id, packet_number, PPCB_UDPR);
+        return -1;
+    }
 
-        if ((size_t) received_length != message_length ||
-            !validate_data_packet(&data_packet,PPCB_UDPR, session_id, packet_number,
-                                  bytes_received, byte_sequence_length)) {
+    if (header_length > sizeof(PPCB_DATA_packet)) {
+        PPCB_DATA_timestamp stamp;
+        memcpy(&stamp, datagram + sizeof(PPCB_DATA_packet), sizeof(PPCB_DATA_timestamp));
+        stats_delay(be64toh(stamp.sent_at), arrived_at);
+    }
 
-            error("invalid DATA");
-            server_sends_RJT_udp(socket_fd, client_address, session_id, packet_number, PPCB_UDPR);
-            return -1;
+    if (data_packet.packet_number > packet_number) {
+        // Got DATA sent ahead of a lost or reordered one. Before the first ACC there is nothing
+        // to acknowledge it with, so the client learns about it from the ACCs which follow.
+        PPCB_reassembly_result held = reassembly_hold(reassembly, packet_number,
+                                                      data_packet.packet_number,
+                                                      datagram + header_length,
+                                                      data_packet.packet_byte_sequence_length);
+        if (held == REASSEMBLY_DUPLICATE) {
+            stats_duplicate_data();
         }
+        if (held != REASSEMBLY_BEYOND && packet_number > 0) {
+            ssize_t sent_length = server_sends_ACC(socket_fd, client_address, session_id,
+                                                   packet_number - 1, extension, reassembly,
+                                                   data_packet.packet_number);
+            validate_send(sent_length, confirmation_length(PPCB_ACC, extension), false,
+                          PPCB_UDPR, "sending ACC");
+        }
+        return 0;
+    }
 
-        if (data_packet.packet_number < packet_number) {
-            continue; // Got previous DATA
-        } // Got waited for DATA
+    if (data_packet.packet_number < packet_number) {
+        // Got previous DATA.
+        stats_duplicate_data();
+        server_resends_confirmation(socket_fd, client_address, session_id, packet_number,
+                                    extension, reassembly);
+        stats_retransmitted(1);
+        TRACE_INSTANT("resend confirmation", packet_number);
+        return 0;
+    } // Got waited for DATA
+
+    if (data_packet.packet_byte_sequence_length > byte_sequence_length - bytes_received) {
+        error("invalid DATA");
+        server_sends_RJT_udp(socket_fd, client_address, session_id, packet_number, PPCB_UDPR);
+
+        return -1;
+    }
 
-        if (data_packet.packet_byte_sequence_length > byte_sequence_length - bytes_received) {
-            error("invalid DATA");
-            server_sends_RJT_udp(socket_fd, client_address, session_id, packet_number, PPCB_UDPR);
+    return data_packet.packet_byte_sequence_length;
+}
+
+static ssize_t server_receives_packet(
+        int                         socket_fd,
+        struct sockaddr_in          client_address,
+        uint64_t                    session_id,
+        uint64_t                    packet_number,
+        uint64_t                    byte_sequence_length,
+        uint64_t                    bytes_received,
+        uint64_t                    deadline,
+        const PPCB_CONN_extension   *extension,
+        PPCB_receive_batch          *batch,
+        PPCB_reassembly             *reassembly,
+        char                        **datagram
+) {
+    struct sockaddr_in receive_address;
+
+    for (;;) {
+        ssize_t received_length = receive_batch_next(batch, &receive_address, datagram,
+                                                     usec_until(deadline));
 
+        if (received_length < 0) {
+            sys_error("recvfrom");
             return -1;
+        } else if (received_length == 0) {
+            return 0; // timeout
         }
 
-        return data_packet.packet_byte_sequence_length;
+        // First we need to check if this is a correct client.
+        if (different_addresses(receive_address, client_address)) {
+            server_rejects_stranger(socket_fd, receive_address, *datagram, packet_number,
+                                    PPCB_UDPR);
+            continue;
+        }
+        stats_received((size_t) received_length, 1);
+
+        ssize_t payload_length = server_checks_packet(socket_fd, client_address, session_id,
+                                                      packet_number, byte_sequence_length,
+                                                      bytes_received, extension, *datagram,
+                                                      received_length,
+                                                      receive_batch_arrival(batch), reassembly);
+        if (payload_length != 0) {
+            return payload_length;
+        }
     }
 
     return 0;
 }
 
-ssize_t exchange_server(
+// Writes out the DATA held from packet_number on, up to the first packet still missing.
+// Returns how many packets were released, or -1 when the session is over.
+static ssize_t server_releases_held(
         int                 socket_fd,
         struct sockaddr_in  client_address,
         uint64_t            session_id,
         uint64_t            packet_number,
-        PPCB_Packet_id      confirming_packet,
         uint64_t            byte_sequence_length,
-        uint64_t            bytes_received,
-        char                *buffer
+        uint64_t            *bytes_received,
+        PPCB_reassembly     *reassembly,
+        PPCB_output         *output
 ) {
-    char *sending_error;
-    size_t expected_length;
-    if (confirming_packet == PPCB_ACC) {
-        sending_error = "sending ACC";
-        expected_length = sizeof(PPCB_PACKET_RESPONSE_packet);
+    ssize_t released = 0;
+    const char *payload;
+    uint32_t length;
+
+    while ((length = reassembly_take(reassembly, packet_number + released, &payload)) > 0) {
+        // Held DATA is checked against the byte sequence only now that its place is known.
+        if (length > byte_sequence_length - *bytes_received) {
+            error("invalid DATA");
+            server_sends_RJT_udp(socket_fd, client_address, session_id,
+                                 packet_number + released, PPCB_UDPR);
+            return -1;
+        }
+
+        if (!output_write(output, payload, length)) {
+            return -1;
+        }
+        *bytes_received += length;
+        stats_delivered(length);
+        released++;
     }
-    else {
-        sending_error = "sending CONACC";
-        expected_length = sizeof(PPCB_RESPONSE_packet);
+
+    // The slots go back to reassembly, so writes queued from them have to be done.
+    if (released > 0 && !output_drain(output)) {
+        return -1;
     }
+    return released;
+}
 
-    for (ssize_t transmit = 0; transmit < MAX_RETRANSMITS + 1; transmit++) {
+static ssize_t exchange_server(
+        int                         socket_fd,
+        struct sockaddr_in          client_address,
+        uint64_t                    session_id,
+        uint64_t                    packet_number,
+        PPCB_Packet_id              confirming_packet,
+        uint64_t                    byte_sequence_length,
+        uint64_t                    bytes_received,
+        PPCB_rtt                    *rtt,
+        const PPCB_CONN_extension   *extension,
+        PPCB_output                 *output,
+        PPCB_receive_batch          *batch,
+        PPCB_reassembly             *reassembly
+) {
+    char *sending_error = (confirming_packet == PPCB_ACC) ? "sending ACC" : "sending CONACC";
+    size_t expected_length = confirmation_length(confirming_packet, extension);
+
+    // With a window the next DATA may be sent before our ACC arrives, so only the handshake
+    // and stop-and-wait exchanges measure a round trip.
+    bool measures_rtt = (confirming_packet == PPCB_CONACC || extension == NULL ||
+                         extension->window == 1);
+
+    for (ssize_t transmit = 0; !rtt_expired(rtt); transmit++) {
         ssize_t sent_length = server_sends_packet(socket_fd, client_address, session_id,
-                                                  packet_number, confirming_packet);
+                                                  packet_number, confirming_packet, extension,
+                                                  reassembly);
         validate_send(sent_length, expected_length, false, PPCB_UDPR, sending_error);
+        if (transmit > 0) {
+            stats_retransmitted(1);
+            TRACE_INSTANT("retransmit confirmation", packet_number);
+        }
 
+        uint64_t sent_at = monotonic_usec();
+        char *datagram;
         ssize_t received_length = server_receives_packet(socket_fd, client_address, session_id,
                                                  packet_number + (confirming_packet == PPCB_ACC),
-                                                 byte_sequence_length, bytes_received, buffer);
+                                                 byte_sequence_length, bytes_received,
+                                                 sent_at + rtt->rto, extension, batch,
+                                                 reassembly, &datagram);
 
         if (received_length == -1) {
             return -1; // error occurred
         } else if (received_length == 0) {
+            stats_timed_out();
+            TRACE_INSTANT("DATA timeout", transmit);
+            rtt_backoff(rtt);
             continue; // timeout
         }
 
-        printf("%.*s", (int) received_length, buffer + sizeof(PPCB_DATA_packet));
-        fflush(stdout);
+        if (transmit == 0 && measures_rtt) {
+            uint64_t sample = monotonic_usec() - sent_at;
+            rtt_sample(rtt, sample);
+            stats_rtt(sample);
+        }
+        rtt_progress(rtt);
+
+        if (!output_write(output, datagram + data_header_length(extension), received_length)) {
+            return -1;
+        }
+        stats_delivered((uint64_t) received_length);
         return received_length;
     }
 
@@ -380,39 +868,200 @@ void handle_connection_udpr(
         struct sockaddr_in  client_address,
         uint64_t            session_id,
         uint64_t            byte_sequence_length,
-        char                *buffer
+        PPCB_CONN_extension *extension,
+        PPCB_output         *output,
+        PPCB_receive_batch  *batch
 ) {
+    if (extension != NULL) {
+        grant_extension(socket_fd, extension);
+    }
+
+    PPCB_rtt rtt;
+    rtt_init(&rtt);
+
+    PPCB_reassembly reassembly;
+    reassembly_init(&reassembly, (extension != NULL) ? extension->window : 1,
+                    (extension != NULL) ? extension->payload_size : MAX_PACKET_SIZE);
+
     uint64_t bytes_received = 0, packet_number = 0;
     ssize_t received_length = exchange_server(socket_fd, client_address, session_id,
                                               packet_number, PPCB_CONACC, byte_sequence_length,
-                                              bytes_received, buffer);
+                                              bytes_received, &rtt, extension, output, batch,
+                                              &reassembly);
 
     if (received_length < 0) {
+        output_flush(output);
+        reassembly_destroy(&reassembly);
         return;
     }
 
     bytes_received += (uint64_t) received_length;
 
     while (bytes_received < byte_sequence_length) {
+        // DATA which came ahead of its turn needs no waiting; one ACC then covers all of it.
+        ssize_t released = server_releases_held(socket_fd, client_address, session_id,
+                                                packet_number + 1, byte_sequence_length,
+                                                &bytes_received, &reassembly, output);
+        if (released < 0) {
+            output_flush(output);
+            reassembly_destroy(&reassembly);
+            return;
+        }
+        packet_number += (uint64_t) released;
+        if (bytes_received == byte_sequence_length) {
+            break;
+        }
+
         received_length = exchange_server(socket_fd,  client_address, session_id,
                                           packet_number,PPCB_ACC, byte_sequence_length,
-                                          bytes_received, buffer);
+                                          bytes_received, &rtt, extension, output, batch,
+                                          &reassembly);
 
         if (received_length < 0) {
+            output_flush(output);
+            reassembly_destroy(&reassembly);
             return;
         }
 
         bytes_received += (uint64_t) received_length;
         packet_number++;
     }
+    reassembly_destroy(&reassembly);
+
+    if (!output_flush(output)) {
+        return;
+    }
 
     // Servers sends ACC once.
     ssize_t sent_length = server_sends_packet(socket_fd, client_address, session_id,
-                                              packet_number, PPCB_ACC);
-    validate_send(sent_length, sizeof(PPCB_PACKET_RESPONSE_packet), false, PPCB_UDPR, "sending ACC");
+                                              packet_number, PPCB_ACC, extension, NULL);
+    validate_send(sent_length, confirmation_length(PPCB_ACC, extension), false, PPCB_UDPR,
+                  "sending ACC");
 
     // Server sends RCVD once.
     sent_length = server_sends_packet(socket_fd, client_address, session_id,
-                                              packet_number, PPCB_RCVD);
-    validate_send(sent_length, sizeof(PPCB_RESPONSE_packet), false, PPCB_UDPR, "sending RCVD");
+                                              packet_number, PPCB_RCVD, extension, NULL);
+    if (validate_send(sent_length, sizeof(PPCB_RESPONSE_packet), false, PPCB_UDPR, "sending RCVD")) {
+        stats_completed();
+    }
+}
+
+/// EVENT-DRIVEN UDPR SERVER ///
+
+// Sends the last confirmation again and waits for the next DATA at most the current RTO.
+static void session_udpr_confirm(
+        int                 socket_fd,
+        PPCB_session        *session
+) {
+    server_resends_confirmation(socket_fd, session->address, session->session_id,
+                                session->packet_number,
+                                session->extended ? &session->extension : NULL,
+                                &session->reassembly);
+
+    session->sent_at = monotonic_usec();
+    session->deadline = session->sent_at + session->rtt.rto;
+}
+
+bool session_udpr_start(
+        int                         socket_fd,
+        PPCB_session                *session,
+        const PPCB_CONN_extension   *extension
+) {
+    session->extended = (extension != NULL);
+    if (extension != NULL) {
+        session->extension = *extension;
+        grant_extension(socket_fd, &session->extension);
+    }
+
+    rtt_init(&session->rtt);
+    reassembly_init(&session->reassembly, session->extended ? session->extension.window : 1,
+                    session->extended ? session->extension.payload_size : MAX_PACKET_SIZE);
+    session->transmit = 0;
+    session_udpr_confirm(socket_fd, session);
+    return true;
+}
+
+bool session_udpr_receive(
+        int                 socket_fd,
+        PPCB_session        *session,
+        const char          *datagram,
+        size_t              received_length,
+        uint64_t            arrived_at
+) {
+    const PPCB_CONN_extension *extension = session->extended ? &session->extension : NULL;
+
+    ssize_t payload_length = server_checks_packet(socket_fd, session->address,
+                                                  session->session_id, session->packet_number,
+                                                  session->byte_sequence_length,
+                                                  session->bytes_received, extension, datagram,
+                                                  received_length, arrived_at,
+                                                  &session->reassembly);
+    if (payload_length <= 0) {
+        return payload_length == 0;
+    }
+
+    // As in exchange_server, only the first transmit of a stop-and-wait exchange is measured.
+    bool measures_rtt = (session->packet_number == 0 || extension == NULL ||
+                         extension->window == 1);
+    if (session->transmit == 0 && measures_rtt) {
+        uint64_t sample = monotonic_usec() - session->sent_at;
+        rtt_sample(&session->rtt, sample);
+        stats_rtt(sample);
+    }
+    rtt_progress(&session->rtt);
+
+    if (!output_write(&session->output, datagram + data_header_length(extension),
+                      payload_length)) {
+        return false;
+    }
+
+    session->bytes_received += (uint64_t) payload_length;
+    session->packet_number++;
+    session->transmit = 0;
+    stats_delivered((uint64_t) payload_length);
+
+    ssize_t released = server_releases_held(socket_fd, session->address, session->session_id,
+                                            session->packet_number,
+                                            session->byte_sequence_length,
+                                            &session->bytes_received, &session->reassembly,
+                                            &session->output);
+    if (released < 0) {
+        return false;
+    }
+    session->packet_number += (uint64_t) released;
+
+    if (session->bytes_received < session->byte_sequence_length) {
+        session_udpr_confirm(socket_fd, session);
+        return true;
+    }
+
+    if (!output_flush(&session->output)) {
+        return false;
+    }
+
+    // Server sends the last ACC and RCVD once.
+    server_resends_confirmation(socket_fd, session->address, session->session_id,
+                                session->packet_number, extension, NULL);
+    server_sends_RESPONSE_udp(socket_fd, session->address, session->session_id, PPCB_UDPR,
+                              PPCB_RCVD);
+    return false;
+}
+
+bool session_udpr_timeout(
+        int                 socket_fd,
+        PPCB_session        *session
+) {
+    stats_timed_out();
+    TRACE_INSTANT("DATA timeout", session->transmit);
+    rtt_backoff(&session->rtt);
+    if (rtt_expired(&session->rtt)) {
+        error("didn't receive DATA after retransmissions");
+        return false;
+    }
+
+    session->transmit++;
+    session_udpr_confirm(socket_fd, session);
+    stats_retransmitted(1);
+    TRACE_INSTANT("retransmit confirmation", session->packet_number);
+    return true;
 }
@@ -0,0 +1,374 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "ppcb-uring.h"
+#include "ppcb-common.h"
+#include "ppcb-metrics.h"
+#include "ppcb-rtt.h"
+#include "err.h"
+
+// Marks completions of writes; the rest of user_data is the length written.
+#define URING_WRITE (1ULL << 63)
+#define URING_RECEIVE 0
+#define URING_BUFFER_GROUP 0
+
+
+/// SYSTEM CALLS ///
+
+static int uring_setup(
+        unsigned                entries,
+        struct io_uring_params  *params
+) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(
+        PPCB_uring      *ring,
+        unsigned        min_complete,
+        unsigned        flags,
+        void            *argument,
+        size_t          argument_length
+) {
+    unsigned to_submit = ring->sq_pending;
+    if (to_submit > 0) {
+        // Submitted entries can't be linked to any more.
+        ring->chain_tail = NULL;
+    }
+    int result = (int) syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags,
+                               argument, argument_length);
+    if (result >= 0) {
+        ring->sq_pending -= min((unsigned) result, to_submit);
+    }
+    return result;
+}
+
+static int uring_register(
+        PPCB_uring      *ring,
+        unsigned        opcode,
+        void            *argument,
+        unsigned        count
+) {
+    return (int) syscall(__NR_io_uring_register, ring->fd, opcode, argument, count);
+}
+
+/// QUEUES ///
+
+static struct io_uring_sqe *uring_get_sqe(
+        PPCB_uring  *ring
+) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+
+    // A full queue is handed to the kernel first.
+    while (tail - head > ring->sq_mask) {
+        if (uring_enter(ring, 0, 0, NULL, 0) < 0 && errno != EINTR && errno != EAGAIN) {
+            sys_fatal("io_uring_enter");
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+    return sqe;
+}
+
+static void uring_arm_receive(
+        PPCB_uring  *ring
+) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = ring->socket_fd;
+    sqe->addr = (uint64_t) (uintptr_t) &ring->receive_template;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_RECEIVE;
+
+    ring->receive_armed = true;
+}
+
+// Takes every completion the kernel posted.
+static void uring_reap(
+        PPCB_uring  *ring
+) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+
+        if (cqe->user_data & URING_WRITE) {
+            uint64_t expected_length = cqe->user_data & ~URING_WRITE;
+            ring->pending_writes--;
+            metrics_backlog(-(int64_t) expected_length);
+            if ((uint64_t) cqe->res != expected_length && ring->write_error == 0) {
+                ring->write_error = (cqe->res < 0) ? -cqe->res : EIO;
+            }
+            continue;
+        }
+
+        // The multishot receive stops when it runs out of buffers or fails.
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            ring->receive_armed = false;
+        }
+        if (cqe->res == -ENOBUFS || ring->received_count == URING_BUFFERS) {
+            continue;
+        }
+
+        size_t i = (ring->received_first + ring->received_count) % URING_BUFFERS;
+        ring->received[i] = (PPCB_uring_completion) {.result = cqe->res, .flags = cqe->flags};
+        ring->received_count++;
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/// IO_URING BACKEND ///
+
+bool uring_init(
+        PPCB_uring  *ring,
+        int         socket_fd
+) {
+    memset(ring, 0, sizeof(*ring));
+    ring->socket_fd = socket_fd;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER;
+
+    ring->fd = uring_setup(URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(ring->fd);
+        return false;
+    }
+
+    size_t sq_length = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_length = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_mapping_length = (sq_length > cq_length) ? sq_length : cq_length;
+    ring->ring_mapping = mmap(NULL, ring->ring_mapping_length, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_mapping == MAP_FAILED) {
+        sys_fatal("mmap");
+    }
+
+    ring->sqes_length = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_length, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        sys_fatal("mmap");
+    }
+
+    char *mapping = ring->ring_mapping;
+    ring->sq_head = (unsigned *) (mapping + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (mapping + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (mapping + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (mapping + params.sq_off.array);
+    ring->cq_head = (unsigned *) (mapping + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (mapping + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (mapping + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (mapping + params.cq_off.cqes);
+
+    // Buffers the kernel picks from for every datagram, registered once.
+    size_t buffer_ring_length = URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->buffer_ring = mmap(NULL, buffer_ring_length, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = mmap(NULL, (size_t) URING_BUFFERS * URING_BUFFER_SIZE,
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffer_ring == MAP_FAILED || ring->buffers == MAP_FAILED) {
+        sys_fatal("mmap");
+    }
+
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uint64_t) (uintptr_t) ring->buffer_ring;
+    registration.ring_entries = URING_BUFFERS;
+    registration.bgid = URING_BUFFER_GROUP;
+    if (uring_register(ring, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        uring_destroy(ring);
+        return false;
+    }
+
+    for (uint16_t i = 0; i < URING_BUFFERS; i++) {
+        uring_recycle(ring, i);
+    }
+
+    ring->receive_template.msg_namelen = sizeof(struct sockaddr_in);
+    return true;
+}
+
+void uring_queue_write(
+        PPCB_uring  *ring,
+        const void  *chain,
+        int         fd,
+        const void  *data,
+        size_t      length,
+        uint64_t    offset
+) {
+    if (length == 0) {
+        return;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) data;
+    sqe->len = (uint32_t) length;
+    sqe->off = offset;
+    sqe->user_data = URING_WRITE | length;
+
+    ring->pending_writes++;
+    metrics_backlog((int64_t) length);
+
+    // Writes at the file position land in the order they were queued only if linked. The link
+    // goes on the previous write of the chain once this one follows it, so the last one of every
+    // chain stays unlinked and nothing else is pulled in.
+    if (offset == (uint64_t) -1) {
+        if (ring->chain_tail != NULL && ring->chain == chain && ring->chain_fd == fd) {
+            ring->chain_tail->flags |= IOSQE_IO_LINK;
+        }
+        ring->chain_tail = sqe;
+        ring->chain = chain;
+        ring->chain_fd = fd;
+    }
+}
+
+bool uring_drain_writes(
+        PPCB_uring  *ring
+) {
+    // Usually one call: writes to a file complete while they are submitted.
+    while (ring->pending_writes > 0) {
+        if (uring_enter(ring, ring->pending_writes, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR) {
+            return false;
+        }
+        uring_reap(ring);
+    }
+
+    int write_error = ring->write_error;
+    ring->write_error = 0;
+    errno = write_error;
+    return write_error == 0;
+}
+
+int uring_wait_received(
+        PPCB_uring  *ring,
+        uint64_t    timeout
+) {
+    uint64_t deadline = (timeout > 0) ? monotonic_usec() + timeout : 0;
+
+    for (;;) {
+        uring_reap(ring);
+        if (ring->received_count > 0) {
+            return (int) ring->received_count;
+        }
+        if (!ring->receive_armed) {
+            uring_arm_receive(ring);
+        }
+
+        if (deadline > 0 && monotonic_usec() >= deadline) {
+            // Hand over whatever is queued, without waiting.
+            uring_enter(ring, 0, 0, NULL, 0);
+            return 0;
+        }
+
+        // The wait is bounded by the kernel, not by SO_RCVTIMEO.
+        uint64_t left = (deadline > 0) ? usec_until(deadline) : 0;
+        struct __kernel_timespec wait = {
+            .tv_sec = left / USEC_PER_SEC,
+            .tv_nsec = (left % USEC_PER_SEC) * 1000
+        };
+        struct io_uring_getevents_arg argument = {
+            .sigmask = 0,
+            .sigmask_sz = _NSIG / 8,
+            .ts = (deadline > 0) ? (uint64_t) (uintptr_t) &wait : 0
+        };
+
+        int result = uring_enter(ring, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                                 &argument, sizeof(argument));
+        if (result < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+            return -1;
+        }
+    }
+}
+
+bool uring_take_received(
+        PPCB_uring          *ring,
+        struct sockaddr_in  *receive_address,
+        char                **datagram,
+        size_t              *length,
+        uint16_t            *buffer_id
+) {
+    while (ring->received_count > 0) {
+        PPCB_uring_completion completion = ring->received[ring->received_first];
+        ring->received_first = (ring->received_first + 1) % URING_BUFFERS;
+        ring->received_count--;
+
+        if (completion.result < 0 || !(completion.flags & IORING_CQE_F_BUFFER)) {
+            continue;
+        }
+
+        // The buffer holds the recvmsg header, the address and then the datagram.
+        *buffer_id = (uint16_t) (completion.flags >> IORING_CQE_BUFFER_SHIFT);
+        char *buffer = ring->buffers + (size_t) *buffer_id * URING_BUFFER_SIZE;
+
+        struct io_uring_recvmsg_out header;
+        memcpy(&header, buffer, sizeof(header));
+        memcpy(receive_address, buffer + sizeof(header), sizeof(*receive_address));
+
+        if (header.flags & MSG_TRUNC) {
+            uring_recycle(ring, *buffer_id);
+            continue;
+        }
+
+        *datagram = buffer + sizeof(header) + ring->receive_template.msg_namelen +
+                    ring->receive_template.msg_controllen;
+        *length = header.payloadlen;
+        return true;
+    }
+
+    return false;
+}
+
+void uring_recycle(
+        PPCB_uring  *ring,
+        uint16_t    buffer_id
+) {
+    struct io_uring_buf *buffer = &ring->buffer_ring->bufs[ring->buffer_tail & (URING_BUFFERS - 1)];
+    buffer->addr = (uint64_t) (uintptr_t) (ring->buffers + (size_t) buffer_id * URING_BUFFER_SIZE);
+    buffer->len = URING_BUFFER_SIZE;
+    buffer->bid = buffer_id;
+
+    ring->buffer_tail++;
+    __atomic_store_n(&ring->buffer_ring->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+}
+
+void uring_destroy(
+        PPCB_uring  *ring
+) {
+    munmap(ring->buffers, (size_t) URING_BUFFERS * URING_BUFFER_SIZE);
+    munmap(ring->buffer_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+    munmap(ring->sqes, ring->sqes_length);
+    munmap(ring->ring_mapping, ring->ring_mapping_length);
+    close(ring->fd);
+}
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -11,46 +12,108 @@
 
 #include "err.h"
 #include "ppcb-common.h"
+#include "ppcb-histogram.h"
+#include "ppcb-input.h"
+#include "ppcb-stats.h"
 #include "ppcb-tcp.h"
+#include "ppcb-timestamp.h"
 #include "ppcb-udp.h"
 #include "ppcb-udpr.h"
 
-uint64_t read_byte_sequence(char **byte_sequence) {
-    uint64_t byte_sequence_length = 0, current_size = SEQUENCE_SIZE;
+static void usage(char const *program) {
+    fatal("usage: %s [-w window] [-m spool_threshold] [-z] [-s payload_size] [-p] "
+          "[-S stats_file] [-l] [-T] <protocol> <host> <port> [file]\n", program);
+}
 
-    while (fgets(*byte_sequence + byte_sequence_length,current_size - byte_sequence_length,stdin)) {
-        byte_sequence_length += strlen(*byte_sequence + byte_sequence_length);
+// The session is reported at exit, so a transfer which failed is reported as well.
+static PPCB_stats stats;
 
-        if (byte_sequence_length + 1 >= current_size) {
-            current_size *= 2;
+static void report_stats(void) {
+    stats_report(&stats);
+}
 
-            *byte_sequence = realloc(*byte_sequence, current_size);
-            ASSERT_MALLOC(*byte_sequence);
-        }
-    }
+// Printed at exit too, so the latencies of a transfer which failed are told as well.
+static PPCB_udpr_latency latency;
 
-    // Check if error while reading from file.
-    if (feof(stdin) == 0) {
-        fatal("fgets");
-    }
+static void report_latency(void) {
+    fprintf(stderr, "latency\tsamples\tp50_usec\tp99_usec\tp99.9_usec\tmax_usec\n");
+    histogram_print(&latency.handshake, "handshake", stderr);
+    histogram_print(&latency.acknowledgement, "acknowledgement", stderr);
+    histogram_print(&latency.completion, "completion", stderr);
+}
 
-    *byte_sequence = realloc(*byte_sequence, byte_sequence_length + 1);
-    ASSERT_MALLOC(*byte_sequence);
+// From the stamp in DATA to the kernel's transmit stamp, in nanoseconds.
+static PPCB_histogram send_stack;
 
-    return byte_sequence_length;
+static void report_send_stack(void) {
+    fprintf(stderr, "stack\tsamples\tp50_nsec\tp99_nsec\tp99.9_nsec\tmax_nsec\n");
+    histogram_print(&send_stack, "send_stack", stderr);
 }
 
-
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        fatal("usage: %s <protocol> <host> <port>\n", argv[0]);
+    uint16_t window = 1;
+    uint64_t spool_threshold = SPOOL_THRESHOLD;
+    bool use_sendfile = false;
+    uint32_t payload_size = PACKET_SIZE;
+    bool discover_path_mtu = false;
+    bool measure_latency = false;
+    bool timestamps = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "+w:m:zs:pS:lT")) != -1) {
+        if (option == 'w') {
+            char *endptr;
+            unsigned long value = strtoul(optarg, &endptr, 10);
+            if (*endptr != 0 || value == 0 || value > UINT16_MAX) {
+                fatal("%s is not a valid window", optarg);
+            }
+            window = (uint16_t) value;
+        }
+        else if (option == 'm') {
+            char *endptr;
+            errno = 0;
+            spool_threshold = strtoull(optarg, &endptr, 10);
+            if (errno != 0 || *endptr != 0) {
+                fatal("%s is not a valid spool threshold", optarg);
+            }
+        }
+        else if (option == 'z') {
+            use_sendfile = true;
+        }
+        else if (option == 's') {
+            char *endptr;
+            unsigned long value = strtoul(optarg, &endptr, 10);
+            if (*endptr != 0 || value == 0 || value > MAX_TCP_PAYLOAD) {
+                fatal("%s is not a valid payload size", optarg);
+            }
+            payload_size = (uint32_t) value;
+        }
+        else if (option == 'p') {
+            discover_path_mtu = true;
+        }
+        else if (option == 'S') {
+            stats_use_file(optarg);
+        }
+        else if (option == 'l') {
+            measure_latency = true;
+        }
+        else if (option == 'T') {
+            timestamps = true;
+        }
+        else {
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 3 && argc - optind != 4) {
+        usage(argv[0]);
     }
 
     // Ignore SIGPIPE signals, so they are delivered as normal errors.
     signal(SIGPIPE, SIG_IGN);
 
     // Processing protocol type.
-    char const *protocol_str = argv[1];
+    char const *protocol_str = argv[optind];
     PPCB_Protocol selected_protocol;
     if (strcmp(protocol_str, "tcp") == 0) {
         selected_protocol = PPCB_TCP;
@@ -65,17 +128,28 @@ int main(int argc, char *argv[]) {
         fatal("inappropriate protocol: %s", protocol_str);
     }
 
+    // A datagram carries at most MAX_PACKET_SIZE; TCP streams larger payloads if the server
+    // grants them.
+    if (selected_protocol != PPCB_TCP && payload_size > MAX_PACKET_SIZE) {
+        fatal("payload size of %s is at most %d", protocol_str, MAX_PACKET_SIZE);
+    }
+    if (selected_protocol == PPCB_TCP && discover_path_mtu) {
+        fatal("path MTU discovery is for udp and udpr");
+    }
+    if (selected_protocol != PPCB_UDPR && (measure_latency || timestamps)) {
+        fatal("latency histograms and timestamps are for udpr");
+    }
+
     uint16_t protocol_type = (selected_protocol == PPCB_TCP) ? SOCK_STREAM : SOCK_DGRAM;
 
     // Process server address.
-    char const *host = argv[2];
-    uint16_t port = read_port(argv[3]);
+    char const *host = argv[optind + 1];
+    uint16_t port = read_port(argv[optind + 2]);
     struct sockaddr_in server_address = get_server_address(host, port, selected_protocol);
 
-    // Read byte sequence.
-    char *byte_sequence = (char *)malloc(SEQUENCE_SIZE * sizeof(char));
-    ASSERT_MALLOC(byte_sequence);
-    uint64_t byte_sequence_length = read_byte_sequence(&byte_sequence);
+    // Read byte sequence (from the file argument if given, stdin otherwise).
+    PPCB_input input;
+    input_open(&input, (argc - optind == 4) ? argv[optind + 3] : NULL, spool_threshold);
 
     // Create a socket.
     int socket_fd = socket(AF_INET, protocol_type, 0);
@@ -83,25 +157,56 @@ int main(int argc, char *argv[]) {
         sys_fatal("cannot create a socket");
     }
 
+    if (discover_path_mtu) {
+        uint32_t path_payload_size = path_payload_size_udp(socket_fd, server_address, timestamps);
+        if (path_payload_size == 0) {
+            fatal("cannot discover the path MTU");
+        }
+        payload_size = min(payload_size, path_payload_size);
+    }
+
     // Get random session id.
     uint64_t session_id;
     if (getrandom(&session_id, sizeof(uint64_t), GRND_NONBLOCK) == -1) {
         sys_fatal("cannot get random bytes");
     }
 
+    stats_init(&stats, "client", selected_protocol);
+    stats_attach(&stats);
+    stats_session(session_id);
+    atexit(report_stats);
+
+    // Exit handlers run in reverse, so the latencies come first.
+    if (timestamps) {
+        histogram_init(&send_stack);
+        timestamp_use(&send_stack);
+        atexit(report_send_stack);
+    }
+    if (measure_latency) {
+        histogram_init(&latency.handshake);
+        histogram_init(&latency.acknowledgement);
+        histogram_init(&latency.completion);
+        atexit(report_latency);
+    }
+
     // Communicate with a server.
     if (selected_protocol == PPCB_TCP) {
-        send_bytes_tcp(socket_fd, server_address, session_id, byte_sequence_length, byte_sequence);
+        send_bytes_tcp(socket_fd, server_address, session_id, &input, use_sendfile, payload_size);
     }
     else if (selected_protocol == PPCB_UDP) {
-        send_bytes_udp(socket_fd, server_address, session_id, byte_sequence_length, byte_sequence);
+        send_bytes_udp(socket_fd, server_address, session_id, &input, payload_size);
     }
     else {
-        send_bytes_udpr(socket_fd, server_address, session_id, byte_sequence_length, byte_sequence);
+        send_bytes_udpr(socket_fd, server_address, session_id, &input, window, payload_size,
+                        measure_latency ? &latency : NULL);
     }
 
+    // Any failure ends the client, so getting here means RCVD came.
+    stats_delivered(input.length);
+    stats_completed();
+
     // Free allocated memory and close descriptors.
-    free(byte_sequence);
+    input_close(&input);
     close(socket_fd);
 
     return 0;
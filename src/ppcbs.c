@@ -1,23 +1,40 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
 #include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <stdbool.h>
 
+#include "ppcb-batch.h"
 #include "ppcb-common.h"
+#include "ppcb-metrics.h"
+#include "ppcb-output.h"
+#include "ppcb-rtt.h"
+#include "ppcb-session.h"
+#include "ppcb-stats.h"
+#include "ppcb-timer.h"
+#include "ppcb-timestamp.h"
 #include "err.h"
 #include "ppcb-tcp.h"
 #include "ppcb-udp.h"
 #include "ppcb-udpr.h"
+#include "protconst.h"
 
 
 void setup_tcp_server(
         int socket_fd,
         struct sockaddr_in server_address,
+        PPCB_output *output,
         char *buffer
 ) {
     // Switch the socket to listening.
@@ -40,63 +57,551 @@ void setup_tcp_server(
             sys_fatal("accept");
         }
 
-        handle_connection_tcp(client_fd, buffer);
+        PPCB_stats stats;
+        stats_init(&stats, "server", PPCB_TCP);
+        stats_attach(&stats);
+
+        handle_connection_tcp(client_fd, output, buffer);
         close(client_fd);
+
+        stats_attach(NULL);
+        stats_report(&stats);
+    }
+}
+
+// Threads started by -j, each with a socket of its own.
+#define MAX_WORKERS 256
+
+// Events taken from epoll at once.
+#define MAX_EVENTS 64
+
+// Gives the connection MAX_WAIT more for its next bytes.
+static void connection_touch(
+        PPCB_timer_wheel        *timers,
+        PPCB_tcp_connection     *connection
+) {
+    timer_schedule(timers, &connection->timer,
+                   monotonic_usec() + (uint64_t) MAX_WAIT * USEC_PER_SEC);
+}
+
+static void connection_close(
+        PPCB_timer_wheel        *timers,
+        PPCB_tcp_connection     *connection
+) {
+    timer_cancel(timers, &connection->timer);
+    connection_tcp_destroy(connection);
+    stats_report(&connection->stats);
+    free(connection);
+}
+
+static void accept_connections(
+        int                     socket_fd,
+        int                     epoll_fd,
+        PPCB_timer_wheel        *timers,
+        PPCB_flush_policy       policy
+) {
+    for (;;) {
+        struct sockaddr_in client_address;
+        int client_fd = accept4(socket_fd, (struct sockaddr *) &client_address,
+                                &((socklen_t) {sizeof(client_address)}), SOCK_NONBLOCK);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                errno != ECONNABORTED) {
+                sys_error("accept");
+            }
+            return;
+        }
+
+        PPCB_tcp_connection *connection = malloc(sizeof(PPCB_tcp_connection));
+        ASSERT_MALLOC(connection);
+        connection_tcp_init(connection, client_fd, policy);
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = connection};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0) {
+            sys_error("epoll_ctl");
+            connection_tcp_destroy(connection);
+            free(connection);
+            continue;
+        }
+
+        connection_touch(timers, connection);
     }
 }
 
+// Serves many connections at once from a single thread. Each one is a state machine fed
+// by epoll, and is dropped after MAX_WAIT without any bytes, as in the blocking server.
+void setup_tcp_server_concurrent(
+        int socket_fd,
+        PPCB_flush_policy policy
+) {
+    if (listen(socket_fd, CONCURRENT_QUEUE_LENGTH) < 0) {
+        sys_fatal("listen");
+    }
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        sys_fatal("epoll_create1");
+    }
+
+    // The listening socket is told apart by the NULL connection.
+    if (fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK) < 0) {
+        sys_fatal("fcntl");
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) < 0) {
+        sys_fatal("epoll_ctl");
+    }
+
+    PPCB_timer_wheel *timers = malloc(sizeof(PPCB_timer_wheel));
+    ASSERT_MALLOC(timers);
+    timer_wheel_init(timers, monotonic_usec());
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;) {
+        int timeout = -1;
+        uint64_t left = timer_wheel_timeout(timers, monotonic_usec());
+        if (left > 0) {
+            timeout = (int) ((left + 999) / 1000);
+        }
+
+        int event_count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (event_count < 0 && errno != EINTR) {
+            sys_fatal("epoll_wait");
+        }
+
+        for (int i = 0; i < event_count; i++) {
+            PPCB_tcp_connection *connection = events[i].data.ptr;
+            if (connection == NULL) {
+                accept_connections(socket_fd, epoll_fd, timers, policy);
+            }
+            else {
+                stats_attach(&connection->stats);
+                bool goes_on = connection_tcp_receive(connection);
+                stats_attach(NULL);
+
+                if (goes_on) {
+                    connection_touch(timers, connection);
+                } else {
+                    connection_close(timers, connection);
+                }
+            }
+        }
+
+        PPCB_timer *timer;
+        while ((timer = timer_wheel_expire(timers, monotonic_usec())) != NULL) {
+            PPCB_tcp_connection *connection = timer->data;
+            error("timeout");
+            stats_attach(&connection->stats);
+            stats_timed_out();
+            stats_attach(NULL);
+            connection_close(timers, connection);
+        }
+    }
+}
+
+// Reads CONN which opens a session, answering CONRJT when it is invalid.
+static bool server_reads_CONN(
+        int socket_fd,
+        struct sockaddr_in client_address,
+        const char *buffer,
+        ssize_t received_length,
+        PPCB_CONN_packet *data_received,
+        PPCB_CONN_extension *extension,
+        bool *extended
+) {
+    if (!read_CONN(buffer, received_length, data_received, extension, extended)) {
+        error("receiving CONN");
+        return false;
+    }
+
+    uint8_t packet_id = data_received->id;
+    uint8_t protocol_id = data_received->protocol_id;
+
+    if (packet_id != PPCB_CONN || (protocol_id != PPCB_UDP && protocol_id != PPCB_UDPR) ||
+        data_received->byte_sequence_length == 0 || extension->window == 0 ||
+        extension->payload_size == 0) {
+
+        error("invalid CONN");
+        if (packet_id == PPCB_CONN) {
+            server_sends_RESPONSE_udp(socket_fd, client_address, data_received->session_id,
+                                      PPCB_UDP, PPCB_CONRJT);
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
 void setup_udp_server(
         int socket_fd,
-        char *buffer
+        PPCB_output *output,
+        bool use_uring
 ) {
     ssize_t received_length;
 
     struct sockaddr_in client_address;
 
+    // Datagrams are received in batches, shared with the session handlers.
+    PPCB_receive_batch batch;
+    receive_batch_init(&batch, socket_fd, use_uring);
+    output_attach_ring(output, batch.ring);
+
     for (;;) {
-        received_length = receive_packet_udp(socket_fd, &client_address, buffer, true);
-        if (!validate_receive(received_length, sizeof(PPCB_CONN_packet),
-                              false, PPCB_UDP, "receiving CONN")) {
+        char *buffer;
+        received_length = receive_batch_next(&batch, &client_address, &buffer, 0);
+        if (received_length < 0) {
+            sys_error("recvfrom");
             continue;
         }
 
         PPCB_CONN_packet data_received;
-        memcpy(&data_received, buffer, sizeof(PPCB_CONN_packet));
+        PPCB_CONN_extension extension;
+        bool extended;
+        if (!server_reads_CONN(socket_fd, client_address, buffer, received_length,
+                               &data_received, &extension, &extended)) {
+            continue;
+        }
 
-        uint8_t packet_id = data_received.id;
-        uint8_t protocol_id = data_received.protocol_id;
         uint64_t session_id = data_received.session_id;
-        uint64_t byte_sequence_length = be64toh(data_received.byte_sequence_length);
-
-        if (packet_id != PPCB_CONN || (protocol_id != PPCB_UDP && protocol_id != PPCB_UDPR) ||
-            byte_sequence_length == 0) {
-
-            error("invalid CONN");
-            if (packet_id == PPCB_CONN) {
-                server_sends_RESPONSE_udp(socket_fd, client_address, session_id, PPCB_UDP,
-                                          PPCB_CONRJT);
-            }
+        uint64_t byte_sequence_length = data_received.byte_sequence_length;
 
+        if (!output_open_session(output, session_id, byte_sequence_length)) {
+            server_sends_RESPONSE_udp(socket_fd, client_address, session_id, PPCB_UDP,
+                                      PPCB_CONRJT);
             continue;
         }
 
-        if (protocol_id == PPCB_UDP) {
+        // The session counts from its CONN on.
+        PPCB_stats stats;
+        stats_init(&stats, "server", data_received.protocol_id);
+        stats_attach(&stats);
+        stats_session(session_id);
+        stats_received((size_t) received_length, 1);
+
+        if (data_received.protocol_id == PPCB_UDP) {
             handle_connection_udp(socket_fd, client_address, session_id,
-                                  byte_sequence_length, buffer);
+                                  byte_sequence_length, output, &batch);
         } else {
+            // Only udpr understands the extension; the others answer with a plain CONACC.
             handle_connection_udpr(socket_fd, client_address, session_id,
-                                   byte_sequence_length, buffer);
+                                   byte_sequence_length, extended ? &extension : NULL, output,
+                                   &batch);
+        }
+        output_close_session(output);
+
+        stats_attach(NULL);
+        stats_report(&stats);
+    }
+}
+
+// Passes a datagram to its session, or opens a new session for CONN.
+static void serve_datagram(
+        int socket_fd,
+        PPCB_session_table *table,
+        struct sockaddr_in client_address,
+        const char *buffer,
+        ssize_t received_length,
+        uint64_t arrived_at,
+        PPCB_flush_policy policy,
+        PPCB_uring *ring
+) {
+    uint64_t session_id;
+    if ((size_t) received_length >= sizeof(PPCB_RESPONSE_packet)) {
+        memcpy(&session_id, buffer + sizeof(uint8_t), sizeof(uint64_t));
+
+        PPCB_session *session = session_find(table, client_address, session_id);
+        if (session != NULL) {
+            stats_attach(&session->stats);
+            stats_received((size_t) received_length, 1);
+            bool goes_on = (session->protocol == PPCB_UDP)
+                           ? session_udp_receive(socket_fd, session, buffer, received_length)
+                           : session_udpr_receive(socket_fd, session, buffer, received_length,
+                                                  arrived_at);
+            stats_attach(NULL);
+
+            if (goes_on) {
+                session_update(table, session);
+            } else {
+                session_remove(table, session);
+            }
+            return;
+        }
+    }
+
+    PPCB_CONN_packet data_received;
+    PPCB_CONN_extension extension;
+    bool extended;
+    if (!server_reads_CONN(socket_fd, client_address, buffer, received_length,
+                           &data_received, &extension, &extended)) {
+        return;
+    }
+
+    PPCB_session *session = session_add(table, client_address, data_received.session_id,
+                                        data_received.protocol_id, policy);
+    if (session == NULL) {
+        error("too many sessions");
+        server_sends_RESPONSE_udp(socket_fd, client_address, data_received.session_id,
+                                  PPCB_UDP, PPCB_CONRJT);
+        return;
+    }
+    session->byte_sequence_length = data_received.byte_sequence_length;
+    output_attach_ring(&session->output, ring);
+
+    if (!output_open_session(&session->output, session->session_id,
+                             session->byte_sequence_length)) {
+        server_sends_RESPONSE_udp(socket_fd, client_address, session->session_id, PPCB_UDP,
+                                  PPCB_CONRJT);
+        session_remove(table, session);
+        return;
+    }
+
+    stats_attach(&session->stats);
+    stats_session(session->session_id);
+    stats_received((size_t) received_length, 1);
+    bool started = (session->protocol == PPCB_UDP)
+                   ? session_udp_start(socket_fd, session)
+                   : session_udpr_start(socket_fd, session, extended ? &extension : NULL);
+    stats_attach(NULL);
+
+    if (started) {
+        session_update(table, session);
+    } else {
+        session_remove(table, session);
+    }
+}
+
+// Serves many udp and udpr sessions on one socket. Datagrams find their session by
+// (address, session_id); each session has its own state and deadline.
+void setup_udp_server_concurrent(
+        int socket_fd,
+        PPCB_flush_policy policy,
+        bool use_uring
+) {
+    PPCB_receive_batch batch;
+    receive_batch_init(&batch, socket_fd, use_uring);
+
+    PPCB_session_table *table = malloc(sizeof(PPCB_session_table));
+    ASSERT_MALLOC(table);
+    session_table_init(table);
+
+    for (;;) {
+        uint64_t timeout = session_timeout(table, monotonic_usec());
+
+        struct sockaddr_in client_address;
+        char *buffer;
+        ssize_t received_length = receive_batch_next(&batch, &client_address, &buffer, timeout);
+        if (received_length < 0) {
+            sys_error("recvfrom");
+        }
+        else if (received_length > 0) {
+            serve_datagram(socket_fd, table, client_address, buffer, received_length,
+                           receive_batch_arrival(&batch), policy, batch.ring);
+        }
+
+        uint64_t now = monotonic_usec();
+        PPCB_session *session;
+        while ((session = session_expired(table, now)) != NULL) {
+            stats_attach(&session->stats);
+            bool goes_on = session->protocol == PPCB_UDPR &&
+                           session_udpr_timeout(socket_fd, session);
+            if (session->protocol == PPCB_UDP) {
+                error("timeout");
+                stats_timed_out();
+            }
+            stats_attach(NULL);
+
+            if (goes_on) {
+                session_update(table, session);
+            } else {
+                session_remove(table, session);
+            }
+        }
+    }
+}
+
+// A server loop with its own socket, output and buffer.
+typedef struct {
+    size_t              index;
+    PPCB_Protocol       protocol;
+    uint16_t            port;
+    PPCB_flush_policy   flush_policy;
+    bool                concurrent;
+    bool                reuse_port;     // Several workers share the port.
+    bool                pin;            // Runs on one CPU only.
+    bool                uring;          // UDP datagrams and their payloads go through io_uring.
+    pthread_t           thread;
+} PPCB_worker;
+
+static int create_server_socket(
+        PPCB_worker *worker,
+        struct sockaddr_in *server_address
+) {
+    uint16_t protocol_type = (worker->protocol == PPCB_TCP) ? SOCK_STREAM : SOCK_DGRAM;
+
+    // Create a socket.
+    int socket_fd = socket(AF_INET, protocol_type, 0);
+    if (socket_fd < 0) {
+        sys_fatal("cannot create a socket");
+    }
+
+    // Every worker binds its own socket; the kernel spreads connections and flows between them.
+    int enable = 1;
+    if (worker->reuse_port &&
+        setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        sys_fatal("setsockopt");
+    }
+
+    // Bind the socket to a concrete address.
+    server_address->sin_family = AF_INET;                    // IPv4
+    server_address->sin_addr.s_addr = htonl(INADDR_ANY);     // Listening on all interfaces.
+    server_address->sin_port = htons(worker->port);
+
+    if (bind(socket_fd, (struct sockaddr *) server_address,
+            (socklen_t) sizeof *server_address) < 0) {
+        sys_fatal("bind");
+    }
+
+    return socket_fd;
+}
+
+// Pins the worker to the index-th of the CPUs the server may run on.
+static void pin_worker(
+        PPCB_worker *worker
+) {
+    cpu_set_t allowed, chosen;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        sys_fatal("sched_getaffinity");
+    }
+
+    size_t skip = worker->index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && skip-- == 0) {
+            CPU_ZERO(&chosen);
+            CPU_SET(cpu, &chosen);
+            break;
         }
     }
+
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(chosen), &chosen);
+    if (result != 0) {
+        errno = result;
+        sys_fatal("pthread_setaffinity_np");
+    }
 }
 
+static void *run_worker(
+        void *argument
+) {
+    PPCB_worker *worker = argument;
+
+    if (worker->pin) {
+        pin_worker(worker);
+    }
+    metrics_register_thread();
+
+    struct sockaddr_in server_address;
+    int socket_fd = create_server_socket(worker, &server_address);
+
+    // Only the blocking TCP server receives into it, payloads of any size it may grant.
+    char *buffer = malloc(TCP_BUFFER_SIZE);
+    ASSERT_MALLOC(buffer);
+
+    // Received bytes go to stdout.
+    PPCB_output output;
+    output_init(&output, STDOUT_FILENO, worker->flush_policy);
+
+    if (worker->protocol == PPCB_UDP && worker->concurrent) {
+        setup_udp_server_concurrent(socket_fd, worker->flush_policy, worker->uring);
+    } else if (worker->protocol == PPCB_TCP && worker->concurrent) {
+        setup_tcp_server_concurrent(socket_fd, worker->flush_policy);
+    } else if (worker->protocol == PPCB_TCP) {
+        setup_tcp_server(socket_fd, server_address, &output, buffer);
+    } else {
+        setup_udp_server(socket_fd, &output, worker->uring);
+    }
+
+    output_destroy(&output);
+    free(buffer);
+    close(socket_fd);
+    return NULL;
+}
+
+
+static void usage(char const *program) {
+    fatal("usage: %s [-f latency|throughput] [-e] [-j workers] [-a] [-u] [-o directory [-d]] "
+          "[-S stats_file] [-M metrics_file|unix:metrics_socket] [-T] <protocol> <port>", program);
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fatal("usage: %s <protocol> <port>", argv[0]);
+    PPCB_flush_policy flush_policy = PPCB_FLUSH_LATENCY;
+    bool concurrent = false, pin = false, uring = false, direct = false;
+    size_t worker_count = 1;
+    const char *directory = NULL;
+    const char *metrics_target = NULL;
+
+    int option;
+    while ((option = getopt(argc, argv, "+f:ej:auo:dS:M:T")) != -1) {
+        if (option == 'f' && strcmp(optarg, "latency") == 0) {
+            flush_policy = PPCB_FLUSH_LATENCY;
+        }
+        else if (option == 'f' && strcmp(optarg, "throughput") == 0) {
+            flush_policy = PPCB_FLUSH_THROUGHPUT;
+        }
+        else if (option == 'e') {
+            concurrent = true;
+        }
+        else if (option == 'j') {
+            char *end;
+            unsigned long value = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || value < 1 || value > MAX_WORKERS) {
+                fatal("%s is not a valid number of workers", optarg);
+            }
+            worker_count = value;
+        }
+        else if (option == 'a') {
+            pin = true;
+        }
+        else if (option == 'u') {
+            uring = true;
+        }
+        else if (option == 'o') {
+            directory = optarg;
+        }
+        else if (option == 'd') {
+            direct = true;
+        }
+        else if (option == 'S') {
+            stats_use_file(optarg);
+        }
+        else if (option == 'M') {
+            metrics_target = optarg;
+        }
+        else if (option == 'T') {
+            timestamp_use(NULL);
+        }
+        else {
+            usage(argv[0]);
+        }
     }
 
-    char const *protocol_str = argv[1];
+    if (argc - optind != 2 || (direct && directory == NULL)) {
+        usage(argv[0]);
+    }
+
+    // Sessions are written to files of their own instead of stdout.
+    if (directory != NULL) {
+        struct stat directory_stat;
+        if (stat(directory, &directory_stat) < 0) {
+            sys_fatal("%s", directory);
+        }
+        if (!S_ISDIR(directory_stat.st_mode)) {
+            fatal("%s is not a directory", directory);
+        }
+        output_use_directory(directory, direct);
+    }
+
+    char const *protocol_str = argv[optind];
     PPCB_Protocol selected_protocol;
 
     if (strcmp(protocol_str, "tcp") == 0) {
@@ -107,37 +612,49 @@ int main(int argc, char *argv[]) {
         fatal("inappropriate protocol: %s", protocol_str);
     }
 
-    uint16_t protocol_type = (selected_protocol == PPCB_TCP) ? SOCK_STREAM : SOCK_DGRAM;
-    uint16_t port = read_port(argv[2]);
+    uint16_t port = read_port(argv[optind + 1]);
 
     // Ignore SIGPIPE signals, so they are delivered as normal errors.
     signal(SIGPIPE, SIG_IGN);
 
-    // Create a socket.
-    int socket_fd = socket(AF_INET, protocol_type, 0);
-    if (socket_fd < 0) {
-        sys_fatal("cannot create a socket");
+    if (worker_count > 1) {
+        output_share_descriptor();
+    }
+    if (metrics_target != NULL) {
+        metrics_serve(metrics_target);
     }
 
-    // Bind the socket to a concrete address.
-    struct sockaddr_in server_address;
-    server_address.sin_family = AF_INET;                    // IPv4
-    server_address.sin_addr.s_addr = htonl(INADDR_ANY);     // Listening on all interfaces.
-    server_address.sin_port = htons(port);
+    PPCB_worker workers[MAX_WORKERS];
+    for (size_t i = 0; i < worker_count; i++) {
+        workers[i] = (PPCB_worker) {
+            .index                      = i,
+            .protocol                   = selected_protocol,
+            .port                       = port,
+            .flush_policy               = flush_policy,
+            .concurrent                 = concurrent,
+            .reuse_port                 = worker_count > 1,
+            .pin                        = pin,
+            .uring                      = uring
+        };
+    }
 
-    if (bind(socket_fd, (struct sockaddr *) &server_address,
-            (socklen_t) sizeof server_address) < 0) {
-        sys_fatal("bind");
+    // A single worker runs on the main thread.
+    if (worker_count == 1) {
+        run_worker(&workers[0]);
+        return 0;
     }
 
-    static char buffer[BUFFER_SIZE];
+    for (size_t i = 0; i < worker_count; i++) {
+        int result = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+        if (result != 0) {
+            errno = result;
+            sys_fatal("pthread_create");
+        }
+    }
 
-    if (selected_protocol == PPCB_TCP) {
-        setup_tcp_server(socket_fd, server_address, buffer);
-    } else {
-        setup_udp_server(socket_fd, buffer);
+    for (size_t i = 0; i < worker_count; i++) {
+        pthread_join(workers[i].thread, NULL);
     }
 
-    close(socket_fd);
     return 0;
 }
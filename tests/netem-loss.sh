@@ -0,0 +1,62 @@
+#!/bin/bash
+# Sends a file with udpr through ppcb-netem with loss and delay, and checks that it arrives
+# intact, that recovery takes a few round trips rather than one per lost packet, and that what
+# is sent again stays within a few times what gets lost.
+#
+# usage: tests/netem-loss.sh <bin directory>
+
+BIN=${1:-bin}
+LOSS=5
+DELAY_MS=5
+SEED=1
+WINDOW=256
+PAYLOAD=1000
+PACKETS=1000
+# A round trip is twice the delay; with loss recovered a window at a time the transfer takes
+# about ten, when every lost packet costs one of its own it takes well over fifty.
+MAX_WALL_USEC=$((30 * 2 * DELAY_MS * 1000))
+# Losses are resent one by one, but a timeout resends a whole window less what the server holds.
+MAX_RETRANSMISSIONS=$((5 * PACKETS * LOSS / 100))
+
+WORK=$(mktemp -d)
+trap 'kill $SERVER $NETEM 2>/dev/null; wait 2>/dev/null; rm -rf "$WORK"' EXIT
+
+fail() {
+    echo "netem-loss: $*" >&2
+    for log in "$WORK"/*.err; do
+        sed "s|^|$(basename "$log"): |" "$log" >&2
+    done
+    exit 1
+}
+
+# The value of a field of a stats line.
+field() {
+    grep -o "\"$2\":[0-9]*" "$1" | head -1 | cut -d: -f2
+}
+
+head -c $((PAYLOAD * PACKETS)) /dev/urandom > "$WORK/input"
+
+PORT=$((20000 + $$ % 20000))
+"$BIN/ppcbs" -S "$WORK/server.jsonl" udp $PORT > "$WORK/output" 2> "$WORK/server.err" &
+SERVER=$!
+"$BIN/ppcb-netem" -l $LOSS -d $DELAY_MS -S $SEED $((PORT + 1)) 127.0.0.1 $PORT 2> "$WORK/netem.err" &
+NETEM=$!
+sleep 0.2
+
+# RCVD is sent once, so the client may give up waiting for it although everything arrived;
+# what is checked is what the server received and how it went.
+timeout 60 "$BIN/ppcbc" -w $WINDOW -s $PAYLOAD -S "$WORK/client.jsonl" \
+    udpr 127.0.0.1 $((PORT + 1)) < "$WORK/input" 2> "$WORK/client.err"
+sleep 0.2
+
+cmp -s "$WORK/input" "$WORK/output" || fail "the server's output differs from the input"
+grep -q '"completed":true' "$WORK/server.jsonl" || fail "the server didn't complete the session"
+
+WALL_USEC=$(field "$WORK/server.jsonl" wall_usec)
+RETRANSMISSIONS=$(field "$WORK/client.jsonl" retransmissions)
+[ "$WALL_USEC" -le $MAX_WALL_USEC ] ||
+    fail "took ${WALL_USEC} us, over ${MAX_WALL_USEC} us"
+[ -z "$RETRANSMISSIONS" ] || [ "$RETRANSMISSIONS" -le $MAX_RETRANSMISSIONS ] ||
+    fail "${RETRANSMISSIONS} retransmissions, over ${MAX_RETRANSMISSIONS}"
+
+echo "netem-loss: ${WALL_USEC} us, ${RETRANSMISSIONS:-?} retransmissions"
@@ -0,0 +1,22 @@
+#ifndef PPCB_TEST_H
+#define PPCB_TEST_H
+
+#include <stdio.h>
+
+/// CHECKS ///
+
+// Failed checks are reported with their place and counted, so one run shows all of them.
+static int test_failures = 0;
+
+#define CHECK(condition)                                                                    \
+    do {                                                                                    \
+        if (!(condition)) {                                                                 \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);   \
+            test_failures++;                                                                \
+        }                                                                                   \
+    } while (0)
+
+// What main returns: 0 when every check passed.
+#define TEST_RESULT() ((test_failures == 0) ? 0 : 1)
+
+#endif // PPCB_TEST_H
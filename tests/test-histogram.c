@@ -0,0 +1,117 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "ppcb-histogram.h"
+#include "ppcb-test.h"
+
+
+#define EXACT_LIMIT (UINT64_C(1) << HISTOGRAM_SUB_BITS)
+#define MAX_VALUE (UINT64_C(1) << HISTOGRAM_MAX_BITS)
+
+static PPCB_histogram histogram;
+
+/// BUCKETS ///
+
+// Values below 2^HISTOGRAM_SUB_BITS have buckets of their own.
+static void test_exact(void) {
+    histogram_init(&histogram);
+    for (uint64_t value = 0; value < EXACT_LIMIT; value++) {
+        histogram_record(&histogram, value);
+    }
+
+    CHECK(histogram.count == EXACT_LIMIT);
+    CHECK(histogram.min == 0 && histogram.max == EXACT_LIMIT - 1);
+    for (uint64_t value = 0; value < EXACT_LIMIT; value++) {
+        // Half a rank below, away from rounding.
+        double percentile = 100.0 * ((double) value + 0.5) / EXACT_LIMIT;
+        CHECK(histogram_percentile(&histogram, percentile) == value);
+    }
+}
+
+// Above, a value is reported as the end of its bucket: never below it, and less than 1/64
+// of it above. The end of one bucket is followed by the start of the next.
+static void test_bucket_width(void) {
+    for (uint64_t value = EXACT_LIMIT; value < MAX_VALUE; value += value / 37 + 1) {
+        histogram_init(&histogram);
+        histogram_record(&histogram, value);
+        histogram_record(&histogram, MAX_VALUE);
+
+        uint64_t end = histogram_percentile(&histogram, 50);
+        CHECK(end >= value);
+        CHECK((end - value) * (EXACT_LIMIT / 2) < value);
+        if (end + 1 == MAX_VALUE) {
+            continue;
+        }
+
+        histogram_init(&histogram);
+        histogram_record(&histogram, end + 1);
+        histogram_record(&histogram, MAX_VALUE);
+        CHECK(histogram_percentile(&histogram, 50) > end);
+    }
+}
+
+// Values from 2^HISTOGRAM_MAX_BITS on share the last bucket, but the maximum stays exact.
+static void test_overflow(void) {
+    histogram_init(&histogram);
+    histogram_record(&histogram, MAX_VALUE * 4);
+    histogram_record(&histogram, UINT64_MAX);
+
+    CHECK(histogram.max == UINT64_MAX);
+    CHECK(histogram_percentile(&histogram, 50) == MAX_VALUE - 1);
+    CHECK(histogram_percentile(&histogram, 100) == MAX_VALUE - 1);
+}
+
+/// PERCENTILES ///
+
+// The rank of a percentile is rounded up, counted from 1, and the answer never passes the
+// maximum recorded.
+static void test_ranks(void) {
+    histogram_init(&histogram);
+    CHECK(histogram_percentile(&histogram, 50) == 0);
+
+    histogram_record(&histogram, 40);
+    histogram_record(&histogram, 10);
+    histogram_record(&histogram, 30);
+    histogram_record(&histogram, 20);
+
+    CHECK(histogram.min == 10 && histogram.max == 40);
+    CHECK(histogram_percentile(&histogram, 0) == 10);
+    CHECK(histogram_percentile(&histogram, 25) == 10);
+    CHECK(histogram_percentile(&histogram, 26) == 20);
+    CHECK(histogram_percentile(&histogram, 50) == 20);
+    CHECK(histogram_percentile(&histogram, 75) == 30);
+    CHECK(histogram_percentile(&histogram, 99.9) == 40);
+    CHECK(histogram_percentile(&histogram, 100) == 40);
+
+    // 1000 lies in a bucket ending at 1007.
+    histogram_init(&histogram);
+    histogram_record(&histogram, 1000);
+    CHECK(histogram_percentile(&histogram, 100) == 1000);
+}
+
+// The tail of many samples: one in 500 is slow.
+static void test_tail(void) {
+    histogram_init(&histogram);
+    for (uint64_t i = 0; i < 100000; i++) {
+        histogram_record(&histogram, (i % 500 == 499) ? 5000000 : 100 + i % 10);
+    }
+
+    CHECK(histogram_percentile(&histogram, 50) == 104);
+    CHECK(histogram_percentile(&histogram, 99) == 109);
+    CHECK(histogram_percentile(&histogram, 99.9) == 5000000);
+
+    char line[256];
+    histogram_format(&histogram, line, sizeof(line));
+    CHECK(strcmp(line, "{\"samples\":100000,\"p50\":104,\"p99\":109,\"p99.9\":5000000,"
+                       "\"max\":5000000}") == 0);
+}
+
+int main(void) {
+    test_exact();
+    test_bucket_width();
+    test_overflow();
+    test_ranks();
+    test_tail();
+    return TEST_RESULT();
+}
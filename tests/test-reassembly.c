@@ -0,0 +1,151 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "ppcb-reassembly.h"
+#include "ppcb-test.h"
+
+
+#define PAYLOAD_SIZE 4
+#define WINDOW 8
+
+static PPCB_reassembly reassembly;
+
+// Payload of DATA packet_number: a letter picked by its number.
+static const char *payload_of(
+        uint64_t    packet_number
+) {
+    static char payload[PAYLOAD_SIZE];
+    memset(payload, 'a' + (int) (packet_number % 26), PAYLOAD_SIZE);
+    return payload;
+}
+
+static PPCB_reassembly_result hold(
+        uint64_t    awaited,
+        uint64_t    packet_number,
+        uint32_t    length
+) {
+    return reassembly_hold(&reassembly, awaited, packet_number, payload_of(packet_number), length);
+}
+
+// Takes DATA packet_number and checks it is the one held.
+static void check_take(
+        uint64_t    packet_number,
+        uint32_t    length
+) {
+    const char *payload = NULL;
+    CHECK(reassembly_take(&reassembly, packet_number, &payload) == length);
+    if (length > 0) {
+        CHECK(payload != NULL && memcmp(payload, payload_of(packet_number), length) == 0);
+    }
+}
+
+/// HOLDING ///
+
+// Only DATA ahead of the awaited packet, within the window and the payload size, is held,
+// and each packet only once.
+static void test_hold(void) {
+    reassembly_init(&reassembly, 1, PAYLOAD_SIZE);
+    CHECK(hold(0, 1, PAYLOAD_SIZE) == REASSEMBLY_BEYOND);
+    reassembly_destroy(&reassembly);
+
+    reassembly_init(&reassembly, WINDOW, PAYLOAD_SIZE);
+    CHECK(reassembly.capacity == WINDOW - 1);
+    CHECK(hold(10, 10, PAYLOAD_SIZE) == REASSEMBLY_BEYOND);
+    CHECK(hold(10, 9, PAYLOAD_SIZE) == REASSEMBLY_BEYOND);
+    CHECK(hold(10, 10 + WINDOW, PAYLOAD_SIZE) == REASSEMBLY_BEYOND);
+    CHECK(hold(10, 11, PAYLOAD_SIZE + 1) == REASSEMBLY_BEYOND);
+    CHECK(hold(10, 11, 0) == REASSEMBLY_BEYOND);
+    CHECK(reassembly.held == 0);
+
+    CHECK(hold(10, 11, PAYLOAD_SIZE) == REASSEMBLY_HELD);
+    CHECK(hold(10, 10 + WINDOW - 1, 1) == REASSEMBLY_HELD);
+    CHECK(hold(10, 11, PAYLOAD_SIZE) == REASSEMBLY_DUPLICATE);
+    CHECK(reassembly.held == 2);
+    reassembly_destroy(&reassembly);
+}
+
+// The awaited packet pulls out what was held behind it, in order, until the next gap; the
+// slots taken are free for packets a window later.
+static void test_drain(void) {
+    reassembly_init(&reassembly, WINDOW, PAYLOAD_SIZE);
+    CHECK(hold(0, 3, PAYLOAD_SIZE) == REASSEMBLY_HELD);
+    CHECK(hold(0, 1, PAYLOAD_SIZE) == REASSEMBLY_HELD);
+    CHECK(hold(0, 2, 2) == REASSEMBLY_HELD);
+    CHECK(hold(0, 5, PAYLOAD_SIZE) == REASSEMBLY_HELD);
+
+    // DATA 0 arrived.
+    check_take(1, PAYLOAD_SIZE);
+    check_take(2, 2);
+    check_take(3, PAYLOAD_SIZE);
+    check_take(4, 0);
+    CHECK(reassembly.held == 1);
+
+    // DATA 4 arrived.
+    check_take(5, PAYLOAD_SIZE);
+    check_take(6, 0);
+    CHECK(reassembly.held == 0);
+
+    for (uint64_t packet_number = 7; packet_number < 6 + WINDOW; packet_number++) {
+        CHECK(hold(6, packet_number, PAYLOAD_SIZE) == REASSEMBLY_HELD);
+    }
+    for (uint64_t packet_number = 7; packet_number < 6 + WINDOW; packet_number++) {
+        check_take(packet_number, PAYLOAD_SIZE);
+    }
+    CHECK(reassembly.held == 0);
+    reassembly_destroy(&reassembly);
+}
+
+/// SELECTIVE ACKNOWLEDGEMENTS ///
+
+// Awaiting DATA 1, with 3, 4 and 6 held: the run around a held packet, or the first one
+// above a packet which isn't held.
+static void test_run(void) {
+    reassembly_init(&reassembly, WINDOW, PAYLOAD_SIZE);
+    uint64_t first = 0;
+    CHECK(reassembly_run(&reassembly, 1, 3, &first) == 0);
+
+    hold(1, 3, PAYLOAD_SIZE);
+    hold(1, 4, PAYLOAD_SIZE);
+    hold(1, 6, PAYLOAD_SIZE);
+
+    CHECK(reassembly_run(&reassembly, 1, 3, &first) == 2 && first == 3);
+    CHECK(reassembly_run(&reassembly, 1, 4, &first) == 2 && first == 3);
+    CHECK(reassembly_run(&reassembly, 1, 2, &first) == 2 && first == 3);
+    CHECK(reassembly_run(&reassembly, 1, 1, &first) == 2 && first == 3);
+    CHECK(reassembly_run(&reassembly, 1, 5, &first) == 1 && first == 6);
+    CHECK(reassembly_run(&reassembly, 1, 6, &first) == 1 && first == 6);
+    CHECK(reassembly_run(&reassembly, 1, 7, &first) == 0);
+
+    // Once DATA 1 and 2 came, 3 and 4 are taken and 6 is what remains held.
+    check_take(3, PAYLOAD_SIZE);
+    check_take(4, PAYLOAD_SIZE);
+    CHECK(reassembly_run(&reassembly, 5, 5, &first) == 1 && first == 6);
+
+    // The slots of the window wrap around, but only packets within it count.
+    hold(5, 5 + WINDOW - 1, PAYLOAD_SIZE);
+    CHECK(reassembly_run(&reassembly, 5, 7, &first) == 1 && first == 5 + WINDOW - 1);
+    reassembly_destroy(&reassembly);
+}
+
+// The window granted for a payload size lets the buffer hold all of it.
+static void test_window(void) {
+    uint16_t window = reassembly_window(1400);
+    reassembly_init(&reassembly, window, 1400);
+    CHECK(reassembly.capacity == (size_t) window - 1);
+    reassembly_destroy(&reassembly);
+
+    reassembly_init(&reassembly, window + 1, 1400);
+    CHECK(reassembly.capacity == (size_t) window - 1);
+    reassembly_destroy(&reassembly);
+
+    CHECK(reassembly_window(1) == UINT16_MAX);
+}
+
+int main(void) {
+    test_hold();
+    test_drain();
+    test_run();
+    test_window();
+    return TEST_RESULT();
+}
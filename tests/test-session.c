@@ -0,0 +1,150 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "ppcb-session.h"
+#include "ppcb-common.h"
+#include "ppcb-output.h"
+#include "ppcb-timer.h"
+#include "ppcb-test.h"
+
+
+static PPCB_session_table table;
+
+static struct sockaddr_in client_address(
+        uint32_t    host,
+        uint16_t    port
+) {
+    struct sockaddr_in address = {
+        .sin_family                     = AF_INET,
+        .sin_port                       = htons(port),
+        .sin_addr.s_addr                = htonl(host)
+    };
+    return address;
+}
+
+static PPCB_session *add(
+        struct sockaddr_in  address,
+        uint64_t            session_id
+) {
+    return session_add(&table, address, session_id, PPCB_UDPR, PPCB_FLUSH_LATENCY);
+}
+
+/// LOOKUP ///
+
+// A session is found by its own address and id only, also when another one shares either.
+static void test_find(void) {
+    session_table_init(&table);
+    struct sockaddr_in a = client_address(0x7F000001, 5000);
+    struct sockaddr_in b = client_address(0x7F000001, 5001);
+    struct sockaddr_in c = client_address(0x7F000002, 5000);
+
+    PPCB_session *a1 = add(a, 1);
+    PPCB_session *a2 = add(a, 2);
+    PPCB_session *b1 = add(b, 1);
+    CHECK(a1 != NULL && a2 != NULL && b1 != NULL);
+    CHECK(table.count == 3);
+
+    CHECK(session_find(&table, a, 1) == a1);
+    CHECK(session_find(&table, a, 2) == a2);
+    CHECK(session_find(&table, b, 1) == b1);
+    CHECK(session_find(&table, b, 2) == NULL);
+    CHECK(session_find(&table, c, 1) == NULL);
+    CHECK(a1->session_id == 1 && !different_addresses(a1->address, a));
+
+    session_remove(&table, a2);
+    CHECK(table.count == 2);
+    CHECK(session_find(&table, a, 2) == NULL);
+    CHECK(session_find(&table, a, 1) == a1);
+    CHECK(session_find(&table, b, 1) == b1);
+
+    session_remove(&table, a1);
+    session_remove(&table, b1);
+    CHECK(table.count == 0);
+    CHECK(session_find(&table, b, 1) == NULL);
+}
+
+// The table takes MAX_SESSIONS however their keys fall into buckets, rejects one more, and
+// every session stays reachable while others around it in the chains go.
+static void test_full(void) {
+    static PPCB_session *sessions[MAX_SESSIONS];
+    session_table_init(&table);
+
+    // Few addresses and ids apart by the number of buckets, so chains get long.
+    for (size_t i = 0; i < MAX_SESSIONS; i++) {
+        sessions[i] = add(client_address(0x0A000000 + i % 4, 1000), i * SESSION_BUCKETS);
+        CHECK(sessions[i] != NULL);
+    }
+    CHECK(table.count == MAX_SESSIONS);
+    CHECK(add(client_address(0x0A000000, 1001), 0) == NULL);
+
+    for (size_t i = 0; i < MAX_SESSIONS; i += 2) {
+        session_remove(&table, sessions[i]);
+    }
+    for (size_t i = 0; i < MAX_SESSIONS; i++) {
+        PPCB_session *found = session_find(&table, client_address(0x0A000000 + i % 4, 1000),
+                                           i * SESSION_BUCKETS);
+        CHECK(found == ((i % 2 == 0) ? NULL : sessions[i]));
+    }
+
+    // Room again for what was removed.
+    CHECK(add(client_address(0x0A000000, 1001), 0) != NULL);
+    CHECK(table.count == MAX_SESSIONS / 2 + 1);
+
+    for (size_t bucket = 0; bucket < SESSION_BUCKETS; bucket++) {
+        while (table.buckets[bucket] != NULL) {
+            session_remove(&table, table.buckets[bucket]);
+        }
+    }
+    CHECK(table.count == 0);
+}
+
+/// DEADLINES ///
+
+// Sessions come out once their deadlines pass, earliest first; a moved deadline counts from
+// then on, and a removed session never comes out.
+static void test_deadlines(void) {
+    session_table_init(&table);
+    uint64_t now = monotonic_usec();
+
+    PPCB_session *first = add(client_address(0x7F000001, 6000), 1);
+    PPCB_session *second = add(client_address(0x7F000001, 6000), 2);
+    PPCB_session *third = add(client_address(0x7F000001, 6000), 3);
+    PPCB_session *removed = add(client_address(0x7F000001, 6000), 4);
+    CHECK(session_timeout(&table, now) == 0);
+
+    first->deadline = now + 10000;
+    second->deadline = now + 30000;
+    third->deadline = now + 20000;
+    removed->deadline = now + 5000;
+    session_update(&table, first);
+    session_update(&table, second);
+    session_update(&table, third);
+    session_update(&table, removed);
+    session_remove(&table, removed);
+
+    uint64_t timeout = session_timeout(&table, now);
+    CHECK(timeout > 0 && timeout <= 10000 + TIMER_TICK_USEC);
+    CHECK(session_expired(&table, now + 10000 - TIMER_TICK_USEC) == NULL);
+    CHECK(session_expired(&table, now + 10000 + TIMER_TICK_USEC) == first);
+    CHECK(session_expired(&table, now + 10000 + TIMER_TICK_USEC) == NULL);
+
+    second->deadline = now + 15000;
+    session_update(&table, second);
+    CHECK(session_expired(&table, now + 15000 + TIMER_TICK_USEC) == second);
+    CHECK(session_expired(&table, now + 20000 + TIMER_TICK_USEC) == third);
+    CHECK(session_expired(&table, now + 60000) == NULL);
+    CHECK(session_timeout(&table, now + 60000) == 0);
+
+    session_remove(&table, first);
+    session_remove(&table, second);
+    session_remove(&table, third);
+}
+
+int main(void) {
+    test_find();
+    test_full();
+    test_deadlines();
+    return TEST_RESULT();
+}
@@ -0,0 +1,144 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ppcb-timer.h"
+#include "ppcb-test.h"
+
+
+// Ticks spanned by one slot of a level, as in ppcb-timer.c.
+#define SPAN(level) (UINT64_C(1) << (TIMER_SLOT_BITS * (level)))
+#define START_USEC (UINT64_C(1000) * TIMER_TICK_USEC + 17)
+
+static PPCB_timer_wheel wheel;
+
+/// FIRING ///
+
+// Runs the wheel the way a server loop does, sleeping as long as timer_wheel_timeout allows,
+// until no timer is left. Every timer must come out at or after its deadline, within a tick of
+// it, and only once. Returns the number of wakeups.
+static size_t run_wheel(
+        PPCB_timer  *timers,
+        size_t      count,
+        uint64_t    now
+) {
+    size_t wakeups = 0;
+
+    for (;;) {
+        PPCB_timer *timer;
+        while ((timer = timer_wheel_expire(&wheel, now)) != NULL) {
+            CHECK(timer >= timers && timer < timers + count);
+            CHECK(timer->slot == NULL);
+            CHECK(timer->deadline <= now);
+            CHECK(now < timer->deadline + TIMER_TICK_USEC);
+            *(bool *) timer->data = true;
+        }
+
+        uint64_t timeout = timer_wheel_timeout(&wheel, now);
+        if (timeout == 0) {
+            return wakeups;
+        }
+        now += timeout;
+        wakeups++;
+    }
+}
+
+// Deadlines on every level, at the edges between them, and beyond the span of the wheel,
+// which come down level by level and are placed again on the way.
+static void test_levels(void) {
+    static const uint64_t delays[] = {
+        0, 1, SPAN(1) - 1, SPAN(1), SPAN(1) + 1, SPAN(2) - 1, SPAN(2), 3 * SPAN(2) + 5,
+        SPAN(3) - 1, SPAN(3), 7 * SPAN(3) + 11, SPAN(4) - 1, SPAN(4), SPAN(4) + 3 * SPAN(3) + 5
+    };
+    enum { COUNT = sizeof(delays) / sizeof(delays[0]) };
+    PPCB_timer timers[COUNT];
+    bool fired[COUNT] = {false};
+
+    timer_wheel_init(&wheel, START_USEC);
+    for (size_t i = 0; i < COUNT; i++) {
+        timer_init(&timers[i], &fired[i]);
+        timer_schedule(&wheel, &timers[i], START_USEC + delays[i] * TIMER_TICK_USEC + i);
+    }
+    CHECK(wheel.count == COUNT);
+
+    size_t wakeups = run_wheel(timers, COUNT, START_USEC);
+    for (size_t i = 0; i < COUNT; i++) {
+        CHECK(fired[i]);
+    }
+    CHECK(wheel.count == 0);
+    // A wakeup per timer and per slot brought down, not per tick.
+    CHECK(wakeups < COUNT + 2 * TIMER_LEVELS * TIMER_SLOTS);
+}
+
+/// MOVING AND CANCELLING ///
+
+// A timer moved from a high level to the lowest fires at its new deadline, one moved the
+// other way not before its new one, and a cancelled one never.
+static void test_moves(void) {
+    PPCB_timer timers[3];
+    bool fired[3] = {false};
+    PPCB_timer *earlier = &timers[0], *later = &timers[1], *cancelled = &timers[2];
+
+    timer_wheel_init(&wheel, START_USEC);
+    for (size_t i = 0; i < 3; i++) {
+        timer_init(&timers[i], &fired[i]);
+    }
+
+    timer_schedule(&wheel, earlier, START_USEC + 5 * SPAN(3) * TIMER_TICK_USEC);
+    timer_schedule(&wheel, later, START_USEC + 3 * TIMER_TICK_USEC);
+    timer_schedule(&wheel, cancelled, START_USEC + 2 * TIMER_TICK_USEC);
+    timer_schedule(&wheel, earlier, START_USEC + 10 * TIMER_TICK_USEC);
+    timer_schedule(&wheel, later, START_USEC + 2 * SPAN(2) * TIMER_TICK_USEC);
+    timer_cancel(&wheel, cancelled);
+    timer_cancel(&wheel, cancelled);
+    CHECK(wheel.count == 2);
+
+    CHECK(timer_wheel_expire(&wheel, START_USEC + 5 * TIMER_TICK_USEC) == NULL);
+    CHECK(timer_wheel_expire(&wheel, START_USEC + 11 * TIMER_TICK_USEC) == earlier);
+
+    run_wheel(timers, 3, START_USEC + 11 * TIMER_TICK_USEC);
+    CHECK(fired[1] && !fired[2]);
+    CHECK(wheel.count == 0);
+    CHECK(timer_wheel_timeout(&wheel, START_USEC) == 0);
+}
+
+// After a long stall every timer which came due in between comes out at once, and one
+// scheduled in the past is due immediately.
+static void test_stall(void) {
+    PPCB_timer timers[4];
+    bool fired[4] = {false};
+
+    timer_wheel_init(&wheel, START_USEC);
+    for (size_t i = 0; i < 4; i++) {
+        timer_init(&timers[i], &fired[i]);
+    }
+    timer_schedule(&wheel, &timers[0], START_USEC + 2 * TIMER_TICK_USEC);
+    timer_schedule(&wheel, &timers[1], START_USEC + SPAN(1) * TIMER_TICK_USEC);
+    timer_schedule(&wheel, &timers[2], START_USEC + SPAN(2) * TIMER_TICK_USEC);
+    timer_schedule(&wheel, &timers[3], START_USEC + 2 * SPAN(2) * TIMER_TICK_USEC);
+
+    uint64_t now = START_USEC + (SPAN(2) + 1) * TIMER_TICK_USEC;
+    size_t expired = 0;
+    PPCB_timer *timer;
+    while ((timer = timer_wheel_expire(&wheel, now)) != NULL) {
+        CHECK(timer != &timers[3]);
+        expired++;
+    }
+    CHECK(expired == 3);
+    CHECK(wheel.count == 1);
+
+    PPCB_timer past;
+    timer_init(&past, NULL);
+    timer_schedule(&wheel, &past, START_USEC);
+    CHECK(timer_wheel_timeout(&wheel, now) == 1);
+    CHECK(timer_wheel_expire(&wheel, now) == &past);
+    timer_cancel(&wheel, &timers[3]);
+    CHECK(timer_wheel_expire(&wheel, now + SPAN(3) * TIMER_TICK_USEC) == NULL);
+}
+
+int main(void) {
+    test_levels();
+    test_moves();
+    test_stall();
+    return TEST_RESULT();
+}